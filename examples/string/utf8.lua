@@ -0,0 +1,60 @@
+--
+-- LuaRT UTF-8 example : string:ulen() and string:usub() on CJK text, with timings
+--
+
+-- characters are counted the way character iterators walk the string :
+-- a leading byte spans its whole sequence, any other byte is one character
+local function walk(s)
+    local count, i = 0, 1
+    while i <= #s do
+        local b = s:byte(i)
+        i = i + (b >= 0xF0 and 4 or b >= 0xE0 and 3 or b >= 0xC0 and 2 or 1)
+        count = count + 1
+    end
+    return count
+end
+
+local cjk = ("日本語のテキスト、中文文本，한국어 텍스트。"):rep(4096)
+local cases = {
+    ["CJK"]                 = cjk,
+    ["CJK and ASCII"]       = (cjk:sub(1, 3000).."plain ASCII text "):rep(64),
+    ["emoji"]               = ("😀漢字"):rep(10000),
+    ["stray continuation"]  = cjk:sub(1, 30000).."\x80"..cjk:sub(1, 30000),
+    ["truncated sequence"]  = cjk:sub(1, 30000).."\xE6\x97"..cjk:sub(1, 30000),
+    ["truncated end"]       = cjk.."\xF0\x9F\x98",
+}
+
+for name, s in pairs(cases) do
+    local len = s:ulen()
+    assert(len == walk(s), name..": wrong character count")
+    -- concatenating every character gives back the string
+    local chars = {}
+    for i = 1, len do
+        chars[i] = s:usub(i, i)
+    end
+    assert(table.concat(chars) == s, name..": wrong characters")
+    assert(s:usub(len + 1) == "", name..": characters past the end")
+    assert(s:usub(-1) == chars[len], name..": wrong last character")
+end
+
+local function bench(name, func, times)
+    local start = os.clock()
+    for i = 1, times do
+        func(i)
+    end
+    print(string.format("%-40s %8.3f ms", name, (os.clock() - start) * 1000))
+end
+
+local len = cjk:ulen()
+print(string.format("CJK text : %d bytes, %d characters", #cjk, len))
+-- the index of a string is cached, so ulen() is timed on distinct strings
+local texts = {}
+for i = 1, 100 do
+    texts[i] = cjk..i
+end
+bench("ulen() x 100", function(i) return texts[i]:ulen() end, 100)
+bench("usub() at random positions x 100000", function(i)
+    local start = (i * 7919) % len + 1
+    return cjk:usub(start, start + 16)
+end, 100000)
+bench("usub() suffix x 1000", function(i) return cjk:usub(-i) end, 1000)
@@ -0,0 +1,30 @@
+--
+-- LuaRT serialization example : values round-trip, and malformed serialized data
+--
+
+local t = { 1, 2.5, "three", true, nested = { x = 1 }, data = sys.Buffer("bytes") }
+-- shared and cyclic tables are serialized once, and referenced after that
+t.self = t
+t.shared = t.nested
+
+local buf = sys.serialize(t, "text", 42, nil, false)
+local copy, text, n, none, no = sys.deserialize(buf)
+assert(copy[1] == 1 and copy[2] == 2.5 and copy[3] == "three" and copy[4] == true)
+assert(copy.nested.x == 1 and copy.self == copy and copy.shared == copy.nested)
+assert(copy.data == t.data and copy.data.encoding == t.data.encoding)
+assert(text == "text" and n == 42 and none == nil and no == false)
+print("round-trip of "..#buf.." bytes")
+
+-- malformed data raises an error
+local malformed = {
+    ["truncated string"] = sys.serialize("a string"):sub(1, 5),
+    ["unknown value tag"] = "\255",
+    ["unknown Buffer encoding"] = "\8\2\9ab",
+    ["oversized table"] = "\6\255\255\255\255\15\0",
+    ["reference to an unknown table"] = "\7\5"
+}
+for name, data in pairs(malformed) do
+    local ok, err = pcall(sys.deserialize, data)
+    assert(not ok, name)
+    print(name..": "..err)
+end
@@ -0,0 +1,23 @@
+--
+-- LuaRT Worker example : sleep() and await() inside a Worker function
+--
+
+-- the Worker function runs as a Task in its own Lua state, on its own thread
+local worker = sys.Worker(function(self, delay)
+    sleep(delay)
+    -- wait for a message from the main thread
+    local message = await(self:receive())
+    -- Tasks started by the Worker terminate before its Lua state is closed
+    async(function()
+        sleep(delay)
+        self:send("sent from a Worker Task")
+    end)
+    return message:upper()
+end, 100)
+
+worker:send("hello from the main thread")
+print(await(worker:receive()))
+
+local result = await(worker:wait())
+assert(result == "HELLO FROM THE MAIN THREAD", worker.error)
+print(result)
@@ -21,13 +21,30 @@ struct Buffer {
 	size_t			size;
 	BYTE			*bytes;
 	int				encoding;
+	size_t			capacity;		//--- allocated bytes, always >= size
+	struct BufferBlock *block;		//--- shared storage of Buffer views, NULL if the Buffer owns its bytes
 };
 
 LUA_CONSTRUCTOR(Buffer);
 extern const luaL_Reg Buffer_methods[];
 extern const luaL_Reg Buffer_metafields[];
 
-int base64_encode(lua_State *L, Buffer *b);
+Buffer *buffer_pushmapping(lua_State *L, void *view, BYTE *bytes, size_t size, BOOL writable);
+
+//---------------------------------------- Reader object
+typedef struct {
+	luart_type		type;
+	Buffer			*buffer;
+	int				ref;		//--- reference to the Buffer instance
+	size_t			pos;		//--- current position (from 0)
+	int				big;		//--- default endianness, TRUE for big endian
+} Reader;
+
+extern luart_type TReader;
+
+LUA_CONSTRUCTOR(Reader);
+extern const luaL_Reg Reader_methods[];
+extern const luaL_Reg Reader_metafields[];
 
 #ifdef __cplusplus
 }
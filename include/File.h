@@ -30,8 +30,18 @@ typedef struct {
 	wchar_t		*fname;
 	wchar_t		*fullpath;
 	int			mode;
+	char		*rbuf;		//--- read-ahead buffer
+	size_t		rpos;
+	size_t		rlen;
+	char		*wbuf;		//--- scratch buffer to gather and convert written values
+	size_t		wsize;
+	size_t		bufsize;	//--- stream buffer size, 0 for the default
+	BOOL		autoflush;
 } File;
 
+#define FILE_READAHEAD 65536
+#define FILE_BUFFERSIZE 65536
+
 typedef enum { ASCII, UTF8, _UNICODE } Encoding;
 
 //---------------------------------------- Console.stdout get property
@@ -44,15 +54,16 @@ extern const luaL_Reg File_metafields[];
 
 //---------------------------------------- Asynchronous IO
 typedef struct {
-	HANDLE 	thread;
 	wchar_t *from;
 	wchar_t *to;
 	BOOL	cancel;
 	int		ref;
 	ULARGE_INTEGER	totalfilesize;
 	ULARGE_INTEGER	transferred;
+	volatile LONG	refs;		//--- one reference for the Task, one for the running Job
 } AsyncIO;
 int gc_asyncTask(lua_State *L);
+size_t file_writebytes(File *f, const void *data, size_t len);
 int IOTaskContinue(lua_State* L, int status, lua_KContext ctx);
 
 //---------------------------------------- File members declaration
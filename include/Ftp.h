@@ -44,7 +44,6 @@ typedef struct Ftp {
 typedef BOOL (__stdcall *FTPFUNC)(HINTERNET, LPCWSTR);
 
 typedef struct asyncTask {
-	HANDLE		thread;
 	Ftp 		*ftp;
 	DWORD		error = 0;
 	std::string	received;
@@ -52,6 +51,8 @@ typedef struct asyncTask {
 	wchar_t 	*str2 = NULL;
 	bool		boolean = false;
 	FTPFUNC 	ftpfunc;
+	LPTHREAD_START_ROUTINE thread;
+	volatile LONG refs = 2;	//--- one reference for the Task, one for the running Job
 } asyncTask;
 
 enum TaskResult { RError, RString, RBoolean, RFile };
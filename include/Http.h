@@ -54,6 +54,7 @@ typedef struct Http {
 	std::string		proxy;
 	bool 			failed = false;
 	bool 			done = false;
+	HANDLE			completed;
 	DWORD 			sended;
 	std::string		outbuffer;
 	char			inbuffer[65536];
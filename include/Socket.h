@@ -50,6 +50,7 @@ typedef struct {
 	BOOL		write;
 	BOOL		error;
 	int			protocol;
+	HANDLE		event;
 } Socket;
 extern luart_type TSocket;
 
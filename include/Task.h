@@ -29,6 +29,11 @@ struct Task {
 	ULONGLONG	sleep;
 	void		*userdata;
 	lua_CFunction gc_func;
+	size_t		timer;
+	BOOL		queued;
+	HANDLE		wait;
+	struct Job	*job;
+	struct Scheduler *scheduler;
  };
 
 //---------------------------------------- Task object
@@ -0,0 +1,50 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | Watcher.h | LuaRT Watcher object header
+*/
+
+#pragma once
+
+#include <luart.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WATCHER_BUFFER	65536		//--- ReadDirectoryChangesW() buffer size, the maximum for network shares
+#define WATCHER_DELAY	50			//--- default coalescing delay in milliseconds
+
+//---------------------------------------- State shared between a Watcher and its waiting Tasks
+typedef struct {
+	HANDLE			dir;
+	OVERLAPPED		ov;			//--- its event is signaled once changes are available
+	DWORD			*buffer;
+	wchar_t			*path;
+	BOOL			recursive;
+	BOOL			closed;
+	DWORD			delay;
+	ULONGLONG		last;		//--- time of the last received changes
+	int				changes;	//--- coalesced changes, in their order of arrival
+	int				index;		//--- coalesced changes, by path
+	int				refs;
+} WatcherState;
+
+//---------------------------------------- Watcher object
+typedef struct {
+	luart_type		type;
+	WatcherState	*state;
+} Watcher;
+
+extern luart_type TWatcher;
+
+LUA_CONSTRUCTOR(Watcher);
+extern const luaL_Reg Watcher_methods[];
+extern const luaL_Reg Watcher_metafields[];
+
+#ifdef __cplusplus
+}
+#endif
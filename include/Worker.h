@@ -0,0 +1,63 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | Worker.h | LuaRT Worker object header
+*/
+
+#pragma once
+
+#include <luart.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHANNEL_SIZE 64
+
+//---------------------------------------- Bounded single producer/single consumer message queue
+typedef struct {
+	char	*data;
+	size_t	len;
+} Message;
+
+typedef struct {
+	Message			slots[CHANNEL_SIZE];
+	volatile LONG	head;		//--- next message to receive, only updated by the receiving thread
+	volatile LONG	tail;		//--- next free slot, only updated by the sending thread
+	volatile LONG	closed;
+	HANDLE			readable;	//--- signaled when a message has been sent or the Channel closed
+	HANDLE			writable;	//--- signaled when a message has been received or the Channel closed
+} Channel;
+
+//---------------------------------------- State shared between a Worker thread and its parent
+typedef struct {
+	Channel			in;			//--- parent to Worker messages
+	Channel			out;		//--- Worker to parent messages
+	HANDLE			thread;
+	char			*chunk;		//--- Worker function, as a binary chunk or Lua source
+	size_t			chunklen;
+	char			*args;		//--- serialized arguments, then serialized results
+	size_t			argslen;
+	char			*error;
+	volatile LONG	refs;
+} WorkerState;
+
+//---------------------------------------- Worker object
+typedef struct {
+	luart_type		type;
+	WorkerState		*state;
+	BOOL			inside;		//--- TRUE for the Worker object passed to the Worker function
+} Worker;
+
+extern luart_type TWorker;
+
+LUA_CONSTRUCTOR(Worker);
+extern const luaL_Reg Worker_methods[];
+extern const luaL_Reg Worker_metafields[];
+
+#ifdef __cplusplus
+}
+#endif
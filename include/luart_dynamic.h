@@ -185,6 +185,11 @@ typedef struct Task Task;
 //--- Push a task with the provided continuation C function and starts it, with a context and optional cleanup lua_CFunction
 //--- Always returns 1
 LUA_API int lua_pushtask(lua_State *L, lua_KFunction taskfunc, void *userdata, lua_CFunction gc);
+
+//--- Push a Task that runs func(userdata) on the runtime worker pool, calling the continuation k with the func result once done
+//--- If period is not INFINITE, k is also called every period milliseconds with STILL_ACTIVE status while func runs (results discarded)
+//--- Always returns 1
+LUA_API int lua_pushjob(lua_State *L, LPTHREAD_START_ROUTINE func, lua_KFunction k, void *userdata, lua_CFunction gc, DWORD period);
 LUA_API void lua_setupdate(lua_CFunction func);
 
 //--- Sleeps the current task or the current Lua state for the provided delay
@@ -196,6 +201,10 @@ LUA_API int lua_throwevent(lua_State *L, const char *name, int nparams);
 //--- Wait for the Task at index idx to terminate
 LUA_API int lua_wait(lua_State *L, int idx);
 
+//--- Park the current Task until the handle is signaled or the timeout expires, then call the continuation k
+//--- A NULL handle just sleeps for the timeout. Must be returned from a lua_CFunction or continuation
+LUA_API int lua_waitevent(lua_State *L, HANDLE h, DWORD timeout, lua_KContext ctx, lua_KFunction k);
+
 //--- Get the current executing Task
 LUA_API Task *lua_gettask(lua_State *L);
 
@@ -225,6 +234,9 @@ typedef struct Buffer Buffer;
 
 LUA_API Buffer *lua_toBuffer(lua_State *L, int idx);
 
+//--- Same as lua_toBuffer() but strings are wrapped in a Buffer view, only copied when the Buffer is modified
+LUA_API Buffer *lua_viewBuffer(lua_State *L, int idx);
+
 //--------------- zip decompression functions
 struct zip_t;
 #ifdef _WIN64
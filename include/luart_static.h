@@ -739,6 +739,11 @@ typedef struct Task Task;
 //--- Push a task with the provided continuation C function and starts it, with a context and optional cleanup lua_CFunction
 //--- Always returns 1
 typedef int (__cdecl *lua_pushtask_t) (lua_State *L, lua_KFunction taskfunc, void *userdata, lua_CFunction gc);
+
+//--- Push a Task that runs func(userdata) on the runtime worker pool, calling the continuation k with the func result once done
+//--- If period is not INFINITE, k is also called every period milliseconds with STILL_ACTIVE status while func runs (results discarded)
+//--- Always returns 1
+typedef int (__cdecl *lua_pushjob_t) (lua_State *L, LPTHREAD_START_ROUTINE func, lua_KFunction k, void *userdata, lua_CFunction gc, DWORD period);
 typedef void (__cdecl *lua_setupdate_t) (lua_CFunction func);
 
 //--- Sleeps the current task or the current Lua state for the provided delay
@@ -750,6 +755,10 @@ typedef int (__cdecl *lua_throwevent_t) (lua_State *L, const char *name, int npa
 //--- Wait for the Task at index idx to terminate
 typedef int (__cdecl *lua_wait_t) (lua_State *L, int idx);
 
+//--- Park the current Task until the handle is signaled or the timeout expires, then call the continuation k
+//--- A NULL handle just sleeps for the timeout. Must be returned from a lua_CFunction or continuation
+typedef int (__cdecl *lua_waitevent_t) (lua_State *L, HANDLE h, DWORD timeout, lua_KContext ctx, lua_KFunction k);
+
 //--- Get the current executing Task
 typedef Task * (__cdecl *lua_gettask_t) (lua_State *L);
 
@@ -779,6 +788,9 @@ typedef struct Buffer Buffer;
 
 typedef Buffer * (__cdecl *lua_toBuffer_t) (lua_State *L, int idx);
 
+//--- Same as lua_toBuffer() but strings are wrapped in a Buffer view, only copied when the Buffer is modified
+typedef Buffer * (__cdecl *lua_viewBuffer_t) (lua_State *L, int idx);
+
 //--------------- zip decompression functions
 struct zip_t;
 #ifdef _WIN64
@@ -890,6 +902,7 @@ LUA_API  luaL_Reg 				*WIDGET_METHODS;
 #define lua_pushcclosure        LUA_PREFIX.Pushcclosure
 #define lua_pushfstring         LUA_PREFIX.Pushfstring
 #define lua_pushinteger         LUA_PREFIX.Pushinteger
+#define lua_pushjob             LUA_PREFIX.Pushjob
 #define lua_pushlightuserdata   LUA_PREFIX.Pushlightuserdata
 #define lua_pushlstring         LUA_PREFIX.Pushlstring
 #define lua_pushlwstring        LUA_PREFIX.Pushlwstring
@@ -954,7 +967,9 @@ LUA_API  luaL_Reg 				*WIDGET_METHODS;
 #define lua_upvalueid           LUA_PREFIX.Upvalueid
 #define lua_upvaluejoin         LUA_PREFIX.Upvaluejoin
 #define lua_version             LUA_PREFIX.Version
+#define lua_viewBuffer          LUA_PREFIX.ViewBuffer
 #define lua_wait                LUA_PREFIX.Wait
+#define lua_waitevent           LUA_PREFIX.Waitevent
 #define lua_warning             LUA_PREFIX.Warning
 #define lua_xmove               LUA_PREFIX.Xmove
 #define lua_yieldk              LUA_PREFIX.Yieldk
@@ -1104,6 +1119,7 @@ typedef struct lua_All_functions
   lua_pushcclosure_t      Pushcclosure;
   lua_pushfstring_t       Pushfstring;
   lua_pushinteger_t       Pushinteger;
+  lua_pushjob_t           Pushjob;
   lua_pushlightuserdata_t Pushlightuserdata;
   lua_pushlstring_t       Pushlstring;
   lua_pushlwstring_t      Pushlwstring;
@@ -1168,7 +1184,9 @@ typedef struct lua_All_functions
   lua_upvalueid_t         Upvalueid;
   lua_upvaluejoin_t       Upvaluejoin;
   lua_version_t           Version;
+  lua_viewBuffer_t        ViewBuffer;
   lua_wait_t              Wait;
+  lua_waitevent_t         Waitevent;
   lua_warning_t           Warning;
   lua_xmove_t             Xmove;
   lua_yieldk_t            Yieldk;
@@ -0,0 +1,103 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | Deflater.c | LuaRT Deflater object implementation
+*/
+#define LUA_LIB
+
+#include "stream.h"
+#include "lrtapi.h"
+#include <luart.h>
+
+luart_type TDeflater;
+
+/* ------------------------------------------------------------------------ */
+
+LUA_CONSTRUCTOR(Deflater) {
+	Deflater *d = calloc(1, sizeof(Deflater));
+
+	d->level = MZ_DEFAULT_LEVEL;
+	lua_newinstance(L, d, Deflater);
+	stream_init(L, d, 2);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "level") != LUA_TNIL)
+			luaL_argcheck(L, (d->level = (int)luaL_checkinteger(L, -1)) >= 0 && d->level <= 9, 2, "level must be between 0 and 9");
+		lua_pop(L, 1);
+	}
+	if (!stream_deflateinit(d))
+		luaL_error(L, "Failed to initialize deflate compression");
+	return 1;
+}
+
+LUA_METHOD(Deflater, write) {
+	Deflater *d = lua_self(L, 1, Deflater);
+	int i, n = lua_gettop(L);
+
+	for (i = 2; i <= n; i++)
+		stream_feed(L, d, i, stream_compress);
+	return stream_push(L, d);
+}
+
+LUA_METHOD(Deflater, finish) {
+	Deflater *d = lua_self(L, 1, Deflater);
+	const char *err;
+	int i, n = lua_gettop(L);
+
+	for (i = 2; i <= n; i++)
+		stream_feed(L, d, i, stream_compress);
+	if (!d->finished && (err = stream_deflate(L, d, NULL, 0, MZ_FINISH)))
+		luaL_error(L, "%s", err);
+	return stream_push(L, d);
+}
+
+LUA_METHOD(Deflater, __gc) {
+	Deflater *d = lua_self(L, 1, Deflater);
+	mz_deflateEnd(&d->z);
+	stream_free(L, d);
+	free(d);
+	return 0;
+}
+
+LUA_PROPERTY_GET(Deflater, format) {
+	lua_pushstring(L, stream_formats[lua_self(L, 1, Deflater)->format]);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Deflater, level) {
+	lua_pushinteger(L, lua_self(L, 1, Deflater)->level);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Deflater, size) {
+	lua_pushinteger(L, (lua_Integer)lua_self(L, 1, Deflater)->size);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Deflater, compressed) {
+	lua_pushinteger(L, (lua_Integer)lua_self(L, 1, Deflater)->compressed);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Deflater, finished) {
+	lua_pushboolean(L, lua_self(L, 1, Deflater)->finished);
+	return 1;
+}
+
+const luaL_Reg Deflater_metafields[] = {
+	{"__gc",		Deflater___gc},
+	{NULL, NULL}
+};
+
+const luaL_Reg Deflater_methods[] = {
+	METHOD(Deflater, write)
+	METHOD(Deflater, finish)
+	READONLY_PROPERTY(Deflater, format)
+	READONLY_PROPERTY(Deflater, level)
+	READONLY_PROPERTY(Deflater, size)
+	READONLY_PROPERTY(Deflater, compressed)
+	READONLY_PROPERTY(Deflater, finished)
+	{NULL, NULL}
+};
@@ -0,0 +1,93 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | Inflater.c | LuaRT Inflater object implementation
+*/
+#define LUA_LIB
+
+#include "stream.h"
+#include "lrtapi.h"
+#include <luart.h>
+
+luart_type TInflater;
+
+/* ------------------------------------------------------------------------ */
+
+LUA_CONSTRUCTOR(Inflater) {
+	Inflater *i = calloc(1, sizeof(Inflater));
+
+	lua_newinstance(L, i, Inflater);
+	stream_init(L, i, 2);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TTABLE);
+	if (!stream_inflateinit(i))
+		luaL_error(L, "Failed to initialize inflate decompression");
+	return 1;
+}
+
+LUA_METHOD(Inflater, write) {
+	Inflater *i = lua_self(L, 1, Inflater);
+	int idx, n = lua_gettop(L);
+
+	for (idx = 2; idx <= n; idx++)
+		stream_feed(L, i, idx, stream_inflate);
+	return stream_push(L, i);
+}
+
+//--- Raises an error if the compressed data is truncated
+LUA_METHOD(Inflater, finish) {
+	Inflater *i = lua_self(L, 1, Inflater);
+	const char *err;
+	int idx, n = lua_gettop(L);
+
+	for (idx = 2; idx <= n; idx++)
+		stream_feed(L, i, idx, stream_inflate);
+	if (!i->finished && (err = stream_end(i)))
+		luaL_error(L, "%s", err);
+	return stream_push(L, i);
+}
+
+LUA_METHOD(Inflater, __gc) {
+	Inflater *i = lua_self(L, 1, Inflater);
+	mz_inflateEnd(&i->z);
+	stream_free(L, i);
+	free(i);
+	return 0;
+}
+
+LUA_PROPERTY_GET(Inflater, format) {
+	lua_pushstring(L, stream_formats[lua_self(L, 1, Inflater)->format]);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Inflater, size) {
+	lua_pushinteger(L, (lua_Integer)lua_self(L, 1, Inflater)->size);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Inflater, compressed) {
+	lua_pushinteger(L, (lua_Integer)lua_self(L, 1, Inflater)->compressed);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Inflater, finished) {
+	lua_pushboolean(L, lua_self(L, 1, Inflater)->finished);
+	return 1;
+}
+
+const luaL_Reg Inflater_metafields[] = {
+	{"__gc",		Inflater___gc},
+	{NULL, NULL}
+};
+
+const luaL_Reg Inflater_methods[] = {
+	METHOD(Inflater, write)
+	METHOD(Inflater, finish)
+	READONLY_PROPERTY(Inflater, format)
+	READONLY_PROPERTY(Inflater, size)
+	READONLY_PROPERTY(Inflater, compressed)
+	READONLY_PROPERTY(Inflater, finished)
+	{NULL, NULL}
+};
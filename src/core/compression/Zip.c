@@ -19,8 +19,10 @@
 #include <stdio.h>
 #include <wchar.h>
 #include <shlwapi.h>
+#include <math.h>
 
 #include "lib\zip.h"
+#include "sys\pool.h"
 #define MINIZ_HEADER_FILE_ONLY
 #include "lib\miniz.h"
 
@@ -171,20 +173,231 @@ static void make_dir_path(Zip *z, char *dir) {
 	}
 }
 
-static BOOL write_dir(Zip *z, const char *_dir, BOOL isfullpath, const char* dest) {
+//-------------------------------------[ Parallel writer ]
+
+#define PACK_ENTRY_MAX	16777216	//--- larger files are compressed while being appended to the archive
+#define PACK_MEMORY		134217728	//--- maximum size of the files being compressed at once
+#define PACK_SAMPLE		16384		//--- size of the samples used to estimate the entropy of a file
+#define PACK_ENTROPY	7.5			//--- files above this entropy, in bits per byte, are stored
+
+typedef enum { PACK_FILE, PACK_LARGE, PACK_DIR } PackKind;
+
+typedef struct {
+	volatile LONG	refs;
+	HANDLE			ready;		//--- set each time an entry has been compressed
+} PackShared;
+
+//--- Entries are appended in order, files being read and compressed on the worker pool in the meantime
+typedef struct PackEntry {
+	Job					job;
+	struct PackEntry	*next;
+	PackShared			*shared;
+	volatile LONG		done;
+	PackKind			kind;
+	int					level;
+	char				*path;
+	char				*name;
+	ULONGLONG			size;
+	time_t				mtime;
+	BOOL				failed;
+	BOOL				deflated;
+	BYTE				*data;		//--- raw deflated data, or stored data
+	size_t				len;
+	mz_uint32			crc;
+} PackEntry;
+
+typedef struct {
+	Zip			*z;
+	int			level;
+	PackShared	*shared;
+	PackEntry	*head;
+	PackEntry	*tail;
+	size_t		count;		//--- files being compressed
+	size_t		max;
+	size_t		bytes;
+	BOOL		result;
+} Pack;
+
+static void pack_release(PackShared *shared) {
+	if (InterlockedDecrement(&shared->refs) == 0) {
+		CloseHandle(shared->ready);
+		free(shared);
+	}
+}
+
+static void entropy_sample(size_t *counts, const BYTE *p, size_t len) {
+	while (len--)
+		counts[*p++]++;
+}
+
+static double entropy(const size_t *counts, size_t total) {
+	double bits = 0;
+	int i;
+
+	for (i = 0; i < 256; i++)
+		if (counts[i]) {
+			double f = (double)counts[i] / total;
+			bits -= f * log2(f);
+		}
+	return bits;
+}
+
+//--- Estimates the entropy of data from samples at its start, middle and end, so that media and archives are not compressed again
+static BOOL pack_isdense(const BYTE *p, size_t len) {
+	size_t counts[256] = {0};
+
+	if (len <= 3*PACK_SAMPLE)
+		entropy_sample(counts, p, len);
+	else {
+		entropy_sample(counts, p, PACK_SAMPLE);
+		entropy_sample(counts, p + len/2 - PACK_SAMPLE/2, PACK_SAMPLE);
+		entropy_sample(counts, p + len - PACK_SAMPLE, PACK_SAMPLE);
+		len = 3*PACK_SAMPLE;
+	}
+	return len && entropy(counts, len) > PACK_ENTROPY;
+}
+
+static BOOL pack_isdensefile(FILE *f, ULONGLONG size) {
+	BYTE *p = malloc(3*PACK_SAMPLE);
+	BOOL result = FALSE;
+
+	if (p && fread(p, 1, PACK_SAMPLE, f) == PACK_SAMPLE && !_fseeki64(f, (__int64)(size/2 - PACK_SAMPLE/2), SEEK_SET)
+		&& fread(p + PACK_SAMPLE, 1, PACK_SAMPLE, f) == PACK_SAMPLE && !_fseeki64(f, (__int64)(size - PACK_SAMPLE), SEEK_SET)
+		&& fread(p + 2*PACK_SAMPLE, 1, PACK_SAMPLE, f) == PACK_SAMPLE)
+		result = pack_isdense(p, 3*PACK_SAMPLE);
+	free(p);
+	rewind(f);
+	return result;
+}
+
+//--- Deflates the file content, which is kept stored if it does not get smaller
+static void pack_deflate(PackEntry *e, const BYTE *in, size_t size) {
+	mz_stream s;
+
+	memset(&s, 0, sizeof(s));
+	if (mz_deflateInit2(&s, e->level, MZ_DEFLATED, -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY) != MZ_OK)
+		return;
+	e->len = mz_deflateBound(&s, (mz_ulong)size);
+	if ((e->data = malloc(e->len))) {
+		s.next_in = in;
+		s.avail_in = (unsigned int)size;
+		s.next_out = e->data;
+		s.avail_out = (unsigned int)e->len;
+		if (mz_deflate(&s, MZ_FINISH) == MZ_STREAM_END && s.total_out < size) {
+			e->len = s.total_out;
+			e->deflated = TRUE;
+		} else {
+			free(e->data);
+			e->data = NULL;
+		}
+	}
+	mz_deflateEnd(&s);
+}
+
+static DWORD __stdcall PackThread(LPVOID data) {
+	PackEntry *e = (PackEntry *)data;
+	PackShared *shared = e->shared;
+	FILE *f = fopen(e->path, "rb");
+	size_t size = (size_t)e->size;
+	BYTE *in = malloc(size ? size : 1);
+
+	if (!f || !in || fread(in, 1, size, f) != size)
+		e->failed = TRUE;
+	else {
+		e->crc = (mz_uint32)mz_crc32(MZ_CRC32_INIT, in, size);
+		//--- tiny files are stored, as miniz does
+		if (e->level && size > 3 && !pack_isdense(in, size))
+			pack_deflate(e, in, size);
+		if (!e->deflated) {
+			e->data = in;
+			e->len = size;
+			in = NULL;
+		}
+	}
+	if (f)
+		fclose(f);
+	free(in);
+	InterlockedExchange(&e->done, TRUE);
+	SetEvent(shared->ready);
+	pack_release(shared);
+	return 0;
+}
+
+static void pack_append(Pack *p, PackEntry *e) {
+	FILE *f;
+
+	if (e->kind == PACK_DIR)
+		make_dir_path(p->z, e->name);
+	else if (e->kind == PACK_LARGE) {
+		if ((f = fopen(e->path, "rb"))) {
+			p->result &= !zip_entry_addcfile(p->z->zip, e->name, f, e->size, e->mtime, p->level && !pack_isdensefile(f, e->size) ? p->level : 0);
+			fclose(f);
+		} else p->result = FALSE;
+	} else p->result &= !e->failed && !zip_entry_addraw(p->z->zip, e->name, e->data, e->len, e->deflated ? e->size : 0, e->crc, e->mtime);
+}
+
+//--- Appends the first entry once it is ready
+static void pack_pop(Pack *p) {
+	PackEntry *e = p->head;
+
+	while (!e->done)
+		WaitForSingleObject(p->shared->ready, INFINITE);
+	if (!(p->head = e->next))
+		p->tail = NULL;
+	if (e->kind == PACK_FILE) {
+		p->count--;
+		p->bytes -= (size_t)e->size;
+	}
+	pack_append(p, e);
+	free(e->data);
+	free(e->path);
+	free(e->name);
+	free(e);
+}
+
+//--- Queues an entry, waiting for the first ones to be appended while too many files are being compressed
+static void pack_push(Pack *p, PackKind kind, const char *path, const char *name, ULONGLONG size, const FILETIME *modified) {
+	PackEntry *e = calloc(1, sizeof(PackEntry));
+
+	e->kind = kind;
+	e->path = path ? strdup(path) : NULL;
+	e->name = strdup(name);
+	e->size = size;
+	e->level = p->level;
+	if (modified)
+		//--- FILETIME counts 100ns intervals since 1601, converted to seconds since the Unix epoch
+		e->mtime = (time_t)(((((ULONGLONG)modified->dwHighDateTime << 32) | modified->dwLowDateTime) - 116444736000000000ULL) / 10000000);
+	if (kind == PACK_FILE)
+		while (p->head && (p->count >= p->max || p->bytes + size > PACK_MEMORY))
+			pack_pop(p);
+	else e->done = TRUE;
+	if (p->tail)
+		p->tail->next = e;
+	else p->head = e;
+	p->tail = e;
+	if (kind == PACK_FILE) {
+		p->count++;
+		p->bytes += (size_t)size;
+		e->shared = p->shared;
+		e->job.func = PackThread;
+		e->job.userdata = e;
+		InterlockedIncrement(&p->shared->refs);
+		pool_queue(&e->job);
+	}
+	while (p->head && p->head->done)
+		pack_pop(p);
+}
+
+static void pack_dir(Pack *p, const char *_dir, const char *dest) {
 	HANDLE hFind;
 	WIN32_FIND_DATA FindFileData;
 	char *path;
 	char *dir = strdup(_dir);
-	BOOL result = TRUE;
 
 	if (dest) {
-		// int s = -1;
 		char *trailing = append_path(dest, "");
-		// char *dirname = trailing; //(trailing, &s);
-		size_t s = strlen(trailing);
-		make_dir_path(z, trailing);
-        free(trailing);
+		pack_push(p, PACK_DIR, NULL, trailing, 0, NULL);
+		free(trailing);
 	}
 	path = append_path(remove_trailing_sep(dir), "*");
 	if ((hFind = FindFirstFile(path, &FindFileData)) != INVALID_HANDLE_VALUE) {
@@ -194,22 +407,36 @@ static BOOL write_dir(Zip *z, const char *_dir, BOOL isfullpath, const char* des
 				char *newdest = dest ? append_path(dest, FindFileData.cFileName) : NULL;
 
 				if (FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-					result &= write_dir(z, newpath, isfullpath, newdest ? newdest : FindFileData.cFileName);
-				else {
-					if ((FindFileData.nFileSizeHigh && FindFileData.nFileSizeLow) || (strcmp(FindFileData.cFileName, z->fname) != 0)) {
-						result &= !zip_entry_open(z->zip, newdest ? newdest : FindFileData.cFileName) && !zip_entry_fwrite(z->zip, newpath);
-	        			zip_entry_close(z->zip);
-					}
+					pack_dir(p, newpath, newdest ? newdest : FindFileData.cFileName);
+				else if ((FindFileData.nFileSizeHigh && FindFileData.nFileSizeLow) || (strcmp(FindFileData.cFileName, p->z->fname) != 0)) {
+					ULONGLONG size = ((ULONGLONG)FindFileData.nFileSizeHigh << 32) | FindFileData.nFileSizeLow;
+					pack_push(p, size > PACK_ENTRY_MAX ? PACK_LARGE : PACK_FILE, newpath, newdest ? newdest : FindFileData.cFileName, size, &FindFileData.ftLastWriteTime);
 				}
 				free(newpath);
-				free(newdest);				
+				free(newdest);
 			}
 	  	} while (FindNextFile(hFind, &FindFileData));
 	    FindClose(hFind);
 	}
 	free(path);
 	free(dir);
-	return result;
+}
+
+static BOOL write_dir(Zip *z, const char *dir, BOOL isfullpath, const char* dest) {
+	Pack p = {0};
+
+	p.z = z;
+	p.level = zip_getlevel(z->zip);
+	p.max = pool_size()*2;
+	p.result = TRUE;
+	p.shared = calloc(1, sizeof(PackShared));
+	p.shared->refs = 1;
+	p.shared->ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+	pack_dir(&p, dir, dest);
+	while (p.head)
+		pack_pop(&p);
+	pack_release(p.shared);
+	return p.result;
 }
 
 LUA_METHOD(Zip, write) {
@@ -330,6 +557,230 @@ next:
 	return count;
 }
 
+//-------------------------------------[ Parallel extraction ]
+
+//--- Entries are claimed one by one by the calling thread and by runners on the worker pool
+//--- Each of them extracts through its own miniz reader, over a shared mapping of the archive
+typedef struct {
+	volatile LONG	refs;
+	volatile LONG	stop;		//--- set on cancellation
+	volatile LONG	next;		//--- next entry to claim
+	volatile LONG	completed;	//--- claimed entries processed, the operation is finished once all are
+	volatile LONG	done;		//--- entries to extract processed
+	volatile LONG	extracted;	//--- entries successfully extracted
+	LONG			entries;
+	LONG			total;		//--- entries to extract
+	mz_zip_archive	archive;	//--- reader of the thread running the operation
+	const void		*mem;
+	size_t			size;
+	HANDLE			file;
+	HANDLE			mapping;	//--- NULL for an archive already in memory
+	char			*dir;		//--- only extracts entries starting with dir, or NULL
+	size_t			len;
+	HANDLE			finished;
+	Job				*job;		//--- Job running the operation for a Task, or NULL
+	int				ref;		//--- progress callback
+	LONG			step;
+	LONG			reported;
+	BOOL			cancel;
+	wchar_t			*oldpath;	//--- current directory to restore once done
+} Unzip;
+
+typedef struct {
+	Job			job;
+	Unzip		*op;
+} UnzipJobRunner;
+
+static void unzip_release(Unzip *op) {
+	if (InterlockedDecrement(&op->refs) == 0) {
+		mz_zip_reader_end(&op->archive);
+		if (op->mapping) {
+			UnmapViewOfFile(op->mem);
+			CloseHandle(op->mapping);
+		}
+		if (op->file != INVALID_HANDLE_VALUE)
+			CloseHandle(op->file);
+		CloseHandle(op->finished);
+		free(op->dir);
+		free(op->oldpath);
+		free(op);
+	}
+}
+
+static BOOL unzip_stopped(Unzip *op) {
+	return op->stop || (op->job && op->job->cancelled);
+}
+
+static void unzip_entry(Unzip *op, mz_zip_archive *a, mz_uint idx) {
+	mz_uint size = mz_zip_reader_get_filename(a, idx, NULL, 0);
+	char *name;
+	wchar_t *wname;
+	int len = -1;
+
+	if (!size)
+		return;
+	name = malloc(size);
+	mz_zip_reader_get_filename(a, idx, name, size);
+	if (!op->dir || strncmp(op->dir, name, op->len) == 0) {
+		wname = utf8_towchar(name, &len);
+		if (make_path(wname) && (mz_zip_reader_is_file_a_directory(a, idx) || mz_zip_reader_extract_to_file(a, idx, name, 0)))
+			InterlockedIncrement(&op->extracted);
+		InterlockedIncrement(&op->done);
+		free(wname);
+	}
+	free(name);
+}
+
+//--- Claims entries until there are no more, entries being skipped once the operation is stopped
+static void unzip_claim(Unzip *op, mz_zip_archive *a) {
+	LONG idx;
+
+	while ((idx = InterlockedIncrement(&op->next)-1) < op->entries) {
+		if (!unzip_stopped(op))
+			unzip_entry(op, a, (mz_uint)idx);
+		if (InterlockedIncrement(&op->completed) == op->entries)
+			SetEvent(op->finished);
+	}
+}
+
+static DWORD __stdcall UnzipRunner(LPVOID data) {
+	Unzip *op = ((UnzipJobRunner *)data)->op;
+	mz_zip_archive a;
+
+	free(data);
+	memset(&a, 0, sizeof(a));
+	//--- runners starting once all entries have been claimed exit without reading the archive
+	if (!op->stop && op->next < op->entries && mz_zip_reader_init_mem(&a, op->mem, op->size, MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY)) {
+		unzip_claim(op, &a);
+		mz_zip_reader_end(&a);
+	}
+	unzip_release(op);
+	return 0;
+}
+
+//--- Runs the operation from the calling thread, that also extracts entries until all are done
+//--- Runners that start late find no more entries to claim, so completion never waits for them
+static DWORD __stdcall UnzipRun(LPVOID data) {
+	Unzip *op = (Unzip *)data;
+	size_t i, n = op->total > 1 ? pool_size() : 0;
+
+	for (i = 0; i < n; i++) {
+		UnzipJobRunner *runner = calloc(1, sizeof(UnzipJobRunner));
+		runner->job.func = UnzipRunner;
+		runner->job.userdata = runner;
+		runner->op = op;
+		InterlockedIncrement(&op->refs);
+		pool_queue(&runner->job);
+	}
+	unzip_claim(op, &op->archive);
+	if (op->entries)
+		WaitForSingleObject(op->finished, INFINITE);
+	return !unzip_stopped(op);
+}
+
+static DWORD __stdcall UnzipJob(LPVOID data) {
+	DWORD result = UnzipRun(data);
+	unzip_release((Unzip *)data);
+	return result;
+}
+
+//--- Returns NULL if the archive cannot be mapped in memory
+static Unzip *unzip_start(Zip *z, const char *dir) {
+	Unzip *op = calloc(1, sizeof(Unzip));
+	LARGE_INTEGER size;
+	LONG i;
+
+	op->refs = 1;
+	op->ref = LUA_NOREF;
+	op->file = INVALID_HANDLE_VALUE;
+	if (z->mode != 'r' || !z->zip)
+		goto failed;
+	if (!(op->mem = zip_getmem(z->zip, &op->size)) && z->fname) {
+		int len = -1;
+		wchar_t *fname = utf8_towchar(z->fname, &len);
+		op->file = CreateFileW(fname, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		free(fname);
+		//--- archives larger than the address space are extracted sequentially
+		if (op->file != INVALID_HANDLE_VALUE && GetFileSizeEx(op->file, &size) && (ULONGLONG)size.QuadPart <= (SIZE_T)-1
+			&& (op->mapping = CreateFileMappingW(op->file, NULL, PAGE_READONLY, 0, 0, NULL))) {
+			op->mem = MapViewOfFile(op->mapping, FILE_MAP_READ, 0, 0, 0);
+			op->size = (size_t)size.QuadPart;
+		}
+	}
+	if (!op->mem || !mz_zip_reader_init_mem(&op->archive, op->mem, op->size, MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY) || op->archive.m_total_files > LONG_MAX)
+		goto failed;
+	op->finished = CreateEvent(NULL, TRUE, FALSE, NULL);
+	op->total = op->entries = (LONG)op->archive.m_total_files;
+	if (dir) {
+		char name[MZ_ZIP_MAX_ARCHIVE_FILENAME_SIZE];
+		op->dir = strdup(dir);
+		op->len = strlen(dir);
+		for (i = op->total = 0; i < op->entries; i++)
+			if (mz_zip_reader_get_filename(&op->archive, (mz_uint)i, name, sizeof(name)) && strncmp(dir, name, op->len) == 0)
+				op->total++;
+	}
+	return op;
+failed:
+	mz_zip_reader_end(&op->archive);
+	if (op->mem && op->mapping)
+		UnmapViewOfFile(op->mem);
+	if (op->mapping)
+		CloseHandle(op->mapping);
+	if (op->file != INVALID_HANDLE_VALUE)
+		CloseHandle(op->file);
+	free(op);
+	return NULL;
+}
+
+//--- Extracts entries starting with dir, or all entries, to the current directory
+static uint64_t unzip(Zip *z, const char *dir) {
+	Unzip *op = unzip_start(z, dir);
+	uint64_t count;
+
+	if (!op)
+		return extract_zip(z->zip, dir);
+	UnzipRun(op);
+	count = (uint64_t)op->extracted;
+	unzip_release(op);
+	return count;
+}
+
+static int UnzipTaskContinue(lua_State* L, int status, lua_KContext ctx) {
+	Unzip *op = (Unzip *)ctx;
+
+	if (status == STILL_ACTIVE) {
+		//--- progress callback, called at most once every step entries
+		if (!op->cancel && op->ref != LUA_NOREF && op->done - op->reported >= op->step) {
+			op->reported = op->done;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, op->ref);
+			lua_pushinteger(L, op->done);
+			lua_pushinteger(L, op->total);
+			lua_call(L, 2, 1);
+			if ((op->cancel = lua_isnil(L, -1) ? FALSE : !lua_toboolean(L, -1)))
+				InterlockedExchange(&op->stop, TRUE);
+		}
+		return 0;
+	}
+	if (op->oldpath) {
+		SetCurrentDirectoryW(op->oldpath);
+		free(op->oldpath);
+		op->oldpath = NULL;
+	}
+	if (op->cancel)
+		return 0;
+	lua_pushinteger(L, op->extracted);
+	return 1;
+}
+
+static int gc_unzipTask(lua_State *L) {
+	Unzip *op = (Unzip *)lua_self(L, 1, Task)->userdata;
+
+	InterlockedExchange(&op->stop, TRUE);
+	luaL_unref(L, LUA_REGISTRYINDEX, op->ref);
+	unzip_release(op);
+	return 0;
+}
+
 static wchar_t *prep_destdir(lua_State *L, int idx) {
 	wchar_t *dir = luaL_checkDirname(L, idx);
 	wchar_t *oldpath = GetCurrentDir();
@@ -368,7 +819,7 @@ LUA_METHOD(Zip, extract)
 	if (zip_entry_open(z->zip, name) == 0) {
 dir:	if (zip_entry_isdir(z->zip)) {
 			zip_entry_close(z->zip);
-			extract_zip(z->zip, name);		
+			unzip(z, name);
 			lua_pushvalue(L, 2);
 			lua_pushinstance(L, Directory, 1);
 		}
@@ -412,7 +863,6 @@ LUA_METHOD(Zip, remove) {
 }
 
 typedef struct {
-	HANDLE thread;
 	struct zip_t* zip;
 	uint64_t result;
 	char *name;
@@ -420,61 +870,54 @@ typedef struct {
 	char *dir;
 	BOOL find_fname;
 	wchar_t *oldpath;
+	volatile LONG refs;		//--- one reference for the Task, one for the running Job
 } asyncZip;
 
-static Extract_gc(lua_State *L) {
-	asyncZip *z= (asyncZip*)lua_self(L, 1, Task)->userdata;
-	CloseHandle(z->thread);
-	free(z->oldpath);
-	if (z->dir)
+static void extract_release(asyncZip *z) {
+	if (InterlockedDecrement(&z->refs) == 0) {
+		free(z->oldpath);
 		free(z->dir);
-	if (z->name)
 		free(z->name);
-	free(z);
+		free(z);
+	}
+}
+
+static int Extract_gc(lua_State *L) {
+	extract_release((asyncZip*)lua_self(L, 1, Task)->userdata);
 	return 0;
 }
 
 static int ZipTaskContinue(lua_State* L, int status, lua_KContext ctx) {
     asyncZip *z = (asyncZip *)ctx;
 
-    if (WaitForSingleObject(z->thread, 0) == WAIT_OBJECT_0) {
-		lua_pushboolean(L, FALSE);
-		if (z->dir) {
-			if (z->result) {
-				lua_pushstring(L, z->dir);
-				lua_pushinstance(L, Directory, 1);
-				free(z->dir);
-			}
-		} else if (z->name) {
-			if (z->result) {
-				lua_pushstring(L, z->name);
-				lua_pushinstance(L, File, 1);
-			}
-		} else {
-			if (z->result > INT64_MAX)
-				lua_pushnumber(L, z->result);
-			else
-				lua_pushinteger(L, z->result);
+	lua_pushboolean(L, FALSE);
+	if (z->dir) {
+		if (z->result) {
+			lua_pushstring(L, z->dir);
+			lua_pushinstance(L, Directory, 1);
 		}
-		if (z->oldpath) {
-			SetCurrentDirectoryW(z->oldpath);
-			free(z->oldpath);
+	} else if (z->name) {
+		if (z->result) {
+			lua_pushstring(L, z->name);
+			lua_pushinstance(L, File, 1);
 		}
-		CloseHandle(z->thread);
-        return 1;
-    }
-    return lua_yieldk(L, 0, ctx, ZipTaskContinue);
+	} else {
+		if (z->result > INT64_MAX)
+			lua_pushnumber(L, z->result);
+		else
+			lua_pushinteger(L, z->result);
+	}
+	if (z->oldpath) {
+		SetCurrentDirectoryW(z->oldpath);
+		free(z->oldpath);
+		z->oldpath = NULL;
+	}
+    return 1;
 }
 
 static void push_ZipTask(lua_State *L, asyncZip *z, LPTHREAD_START_ROUTINE thread) {
-    lua_pushtask(L, ZipTaskContinue, z, gc_asyncTask);
-    lua_pushvalue(L, -1);
-    if ((z->thread = CreateThread(NULL, 0, thread, z, 0, NULL)))
-        lua_call(L, 0, 0); 
-    else {
-        luaL_getlasterror(L, GetLastError());
-        luaL_error(L, "async error : %s", lua_tostring(L, -1));
-    }   
+	z->refs = 2;
+    lua_pushjob(L, thread, ZipTaskContinue, z, Extract_gc, INFINITE);
 }
 
 static DWORD __stdcall extractThread(LPVOID data) {
@@ -488,6 +931,7 @@ static DWORD __stdcall extractThread(LPVOID data) {
 		if (!z->extractall)
 			zip_entry_close(z->zip);
 	}
+	extract_release(z);
     return 0;
 }
 
@@ -496,7 +940,7 @@ LUA_METHOD(Zip, extractall) {
 
 	if (lua_gettop(L) > 1)
 		oldpath = prep_destdir(L, 2);
-	lua_pushinteger(L, extract_zip(lua_self(L, 1, Zip)->zip, NULL));
+	lua_pushinteger(L, unzip(lua_self(L, 1, Zip), NULL));
 	if (oldpath) {
 		SetCurrentDirectoryW(oldpath);
 		free(oldpath);
@@ -504,14 +948,33 @@ LUA_METHOD(Zip, extractall) {
 	return 1;
 }
 
+//--- Zip.async.extractall([dir [, progress [, step]]]), progress(done, total) being called at most every step entries
 LUA_METHOD(Zip, extractall_async) {
-	asyncZip *z = calloc(1, sizeof(asyncZip));
+	Zip *zip = lua_self(L, lua_upvalueindex(1), Zip);
+	wchar_t *oldpath = NULL;
+	asyncZip *z;
+	Unzip *op;
 
-	if (lua_gettop(L) > 1)
-		z->oldpath = prep_destdir(L, 2);	
-	z->zip = lua_self(L, lua_upvalueindex(1), Zip)->zip;
-	z->extractall = TRUE;
-	push_ZipTask(L, z, extractThread);
+	if (!lua_isnoneornil(L, 1))
+		oldpath = prep_destdir(L, 1);
+	if ((op = unzip_start(zip, NULL))) {
+		op->oldpath = oldpath;
+		//--- one reference for the Task, one for the running Job
+		InterlockedIncrement(&op->refs);
+		if (lua_isfunction(L, 2)) {
+			lua_pushvalue(L, 2);
+			op->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			op->step = (LONG)luaL_optinteger(L, 3, 1);
+		}
+		lua_pushjob(L, UnzipJob, UnzipTaskContinue, op, gc_unzipTask, op->ref != LUA_NOREF ? 50 : INFINITE);
+		op->job = lua_self(L, -1, Task)->job;
+	} else {
+		z = calloc(1, sizeof(asyncZip));
+		z->oldpath = oldpath;
+		z->zip = zip->zip;
+		z->extractall = TRUE;
+		push_ZipTask(L, z, extractThread);
+	}
 	return 1;
 }
 
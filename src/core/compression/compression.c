@@ -18,6 +18,8 @@
 #include "lib\Zip.h"
 #include "lib\zip.h"
 #include "lrtapi.h"
+#include "stream.h"
+#include "sys\pool.h"
 
 LUA_METHOD(compression, deflate) {
 	size_t len; 
@@ -27,7 +29,6 @@ LUA_METHOD(compression, deflate) {
 	unsigned char *buff = malloc(cmp_len+sizeof(size_t));
 	int result;
 	
-	lua_pop(L, 1);
 	result = compress2(buff+sizeof(size_t), &cmp_len, str, len, (int)luaL_optinteger(L, 2, MZ_DEFAULT_COMPRESSION));
 	if ( result == Z_OK ) {
 		*((size_t *)buff) = len;
@@ -37,16 +38,18 @@ LUA_METHOD(compression, deflate) {
 	return result == Z_OK;
 }
 
+//--- The length prefix written by compression.deflate() is skipped, the output growing as needed
 LUA_METHOD(compression, inflate) {
 	size_t len;
 	const unsigned char *str = (const unsigned char *)luaL_tolstring(L, 1, &len);
-	mz_ulong uncmp_len = *((size_t *)(str));
-	unsigned char *buff = malloc(uncmp_len);
-	int result = uncompress(buff, &uncmp_len, str+sizeof(size_t), len);
-	if ( result == Z_OK )
-		lua_pushBuffer(L, buff, uncmp_len);
-	free(buff);
-	return result == Z_OK;
+	Inflater *i;
+
+	if (len < sizeof(size_t))
+		return 0;
+	i = lua_pushinstance(L, Inflater, 0);
+	if (stream_inflate(L, i, str+sizeof(size_t), len-sizeof(size_t)) || stream_end(i))
+		return 0;
+	return stream_push(L, i);
 }
 
 LUA_METHOD(compression, isZip) {
@@ -62,116 +65,108 @@ LUA_METHOD(compression, isZip) {
 	return 1;
 }
 
-#define  	GZIP_HEADER_MINSIZE 10
-#define  	GZIP_FOOTER_SIZE 8
-#define  	GZIP_COMPRESSION_DEFLATE 8
-#define 	CHUNK 16384
+//--- Buffers are processed in memory, Files and filenames are processed by chunks to the destination file
+//--- (a temporary file if not provided). Compression is spread over the worker pool if parallel is set
+//--- but remains synchronous : the calling thread (and any running Task) waits until the whole output is written
+//--- Feeds the source at index 1 to the Stream, run protected so that a partial output file can be removed on errors
+static int gzip_run(lua_State *L) {
+	Stream *s = (Stream *)lua_touserdata(L, 2);
+	BOOL compress = lua_toboolean(L, 3);
+	size_t parallel = (size_t)lua_tointeger(L, 4);
+	const char *err;
+
+	if (parallel)
+		stream_parallel(L, s, 1, parallel);
+	else {
+		stream_feed(L, s, 1, compress ? stream_compress : stream_inflate);
+		if ((err = compress ? stream_deflate(L, s, NULL, 0, MZ_FINISH) : stream_end(s)))
+			luaL_error(L, "%s", err);
+	}
+	if (s->output.fp) {
+		BOOL failed = fclose(s->output.fp) != 0;
+		s->output.fp = NULL;
+		if (failed)
+			luaL_error(L, strerror(errno));
+	}
+	return 0;
+}
+
+static int gzip_stream(lua_State *L, BOOL compress) {
+	Buffer *b = lua_iscinstance(L, 1, TBuffer);
+	wchar_t *dest = NULL, tmp[MAX_PATH];
+	lua_Integer parallel = 0;
+	BOOL tofile = FALSE;
+	Stream *s;
+
+	lua_settop(L, 4);
+	if (compress && lua_toboolean(L, 4))
+		luaL_argcheck(L, (parallel = lua_isinteger(L, 4) ? lua_tointeger(L, 4) : (lua_Integer)pool_size()*2) > 0, 4, "parallel must be greater than zero");
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		lua_pushvalue(L, 1);
+		lua_pushinstance(L, File, 1);
+		lua_replace(L, 1);
+		lua_pop(L, 1);
+	} else if (!b)
+		luaL_checkcinstance(L, 1, File);
+	lua_createtable(L, 0, 2);
+	lua_pushstring(L, "gzip");
+	lua_setfield(L, -2, "format");
+	if (compress) {
+		lua_pushinteger(L, luaL_optinteger(L, 3, MZ_DEFAULT_LEVEL));
+		lua_setfield(L, -2, "level");
+		s = lua_pushinstance(L, Deflater, 1);
+	} else s = lua_pushinstance(L, Inflater, 1);
+	if (!lua_isnil(L, 2))
+		dest = luaL_checkFilename(L, 2);
+	else if (!b && GetTempFileNameW(temp_path, NULL, 0, tmp))
+		dest = tmp;
+	if ((tofile = dest != NULL)) {
+		File *f = lua_iscinstance(L, 1, TFile);
+		wchar_t *fullpath = _wfullpath(NULL, dest, 0);
+		//--- opening the source File for writing would truncate it
+		BOOL same = f && fullpath && _wcsicmp(fullpath, f->fullpath) == 0;
+
+		free(fullpath);
+		if (!same && !(s->output.fp = _wfopen(dest, L"wb")) && dest == tmp)
+			DeleteFileW(tmp);
+		lua_pushwstring(L, dest);
+		if (dest != tmp)
+			free(dest);
+		if (same)
+			luaL_error(L, "cannot write to the source file '%s'", lua_tostring(L, -1));
+		if (!s->output.fp)
+			luaL_error(L, "failed to create '%s' : %s", lua_tostring(L, -1), strerror(errno));
+	}
+	lua_pushcfunction(L, gzip_run);
+	lua_pushvalue(L, 1);
+	lua_pushlightuserdata(L, s);
+	lua_pushboolean(L, compress);
+	lua_pushinteger(L, parallel);
+	if (lua_pcall(L, 4, 0, 0)) {
+		if (tofile) {
+			wchar_t *path = lua_towstring(L, -2);
+			if (s->output.fp) {
+				fclose(s->output.fp);
+				s->output.fp = NULL;
+			}
+			DeleteFileW(path);
+			free(path);
+		}
+		return lua_error(L);
+	}
+	if (tofile) {
+		lua_pushinstance(L, File, 1);
+		return 1;
+	}
+	return stream_push(L, s);
+}
 
 LUA_METHOD(compression, gunzip) {
-	int ret;
-    unsigned int have;
-    z_stream stream = {0};
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
-	wchar_t *fname;
-	FILE *filefrom, *fileto;
-	wchar_t tmp[MAX_PATH];
-
-    if (mz_inflateInit2(&stream, -MZ_DEFAULT_WINDOW_BITS) != MZ_OK)
-		luaL_error(L, "Failed to initialize deflate compression");
- 	fname = luaL_checkFilename(L, 1);
-	if (!(filefrom = _wfopen(fname, L"rb")))
-		luaL_error(L, "File not found");
-	GetTempFileNameW(temp_path, NULL, 0, tmp);
-	if (!(fileto = _wfopen(tmp, L"wb")))
-		luaL_error(L, "Cannot create temporary uncompressed file");
-	fread(in, 1, GZIP_HEADER_MINSIZE, filefrom);
-    do {
-        stream.avail_in = fread(in, 1, CHUNK, filefrom);
-        if (ferror(filefrom)) {
-ioerror: 	inflateEnd(&stream);
-            luaL_error(L, strerror(errno));
-        }
-        if (stream.avail_in == 0)
-            break;
-        stream.next_in = in;
-        do {
-            stream.avail_out = CHUNK;
-            stream.next_out = out;
-            ret = mz_inflate(&stream, MZ_NO_FLUSH);
-			if (ret < MZ_OK || ret > MZ_STREAM_END)
-				luaL_error(L, "Error during decompression");
-            have = CHUNK - stream.avail_out;
-            if (fwrite(out, 1, have, fileto) != have || ferror(fileto)) 
-				goto ioerror;
-        } while (stream.avail_out == 0);
-
-    } while (ret != Z_STREAM_END);
-    (void)inflateEnd(&stream);
-	fclose(filefrom);
-	fclose(fileto);
-	lua_pushwstring(L, tmp);
-	lua_pushinstance(L, File, 1);
-	free(fname);
-    return ret == Z_STREAM_END;
+	return gzip_stream(L, FALSE);
 }
 
 LUA_METHOD(compression, gzip) {
-    int flush;
-    unsigned int have;
-    z_stream stream = {0};
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
-	wchar_t *fname;
-	FILE *filefrom, *fileto;
-	wchar_t tmp[MAX_PATH];
-	static unsigned char gzip_header[] = { 0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0x0B };
-	mz_ulong crc = 0;
-	LONGLONG fsize = 0;
-
-	if (mz_deflateInit2(&stream, MZ_DEFAULT_LEVEL, MZ_DEFLATED, -MZ_DEFAULT_WINDOW_BITS, 1, 0) != MZ_OK)
-		luaL_error(L, "Failed to initialize deflate compression");
- 	fname = luaL_checkFilename(L, 1);
-	if (!(filefrom = _wfopen(fname, L"rb")))
-		luaL_error(L, "File not found");
-	GetTempFileNameW(temp_path, NULL, 0, tmp);
-	if (!(fileto = _wfopen(tmp, L"wb")))
-		luaL_error(L, "Cannot create temporary gzip file");
-	fwrite(gzip_header, 1, GZIP_HEADER_MINSIZE, fileto);
-    do {
-        stream.avail_in = fread(in, 1, CHUNK, filefrom);
-		fsize += stream.avail_in;
-		crc = mz_crc32(crc, in, stream.avail_in);
-        if (ferror(filefrom)) {
-            deflateEnd(&stream);
-            luaL_error(L, strerror(errno));
-        }
-        flush = feof(filefrom) ? Z_FINISH : Z_NO_FLUSH;
-        stream.next_in = in;
-        do {
-            stream.avail_out = CHUNK;
-            stream.next_out = out;
-            deflate(&stream, flush);
-            have = CHUNK - stream.avail_out;
-            if (fwrite(out, 1, have, fileto) != have || ferror(fileto)) {
-                deflateEnd(&stream);
-                luaL_error(L, strerror(errno));
-            }
-        } while (stream.avail_out == 0);
-    } while (flush != Z_FINISH);
-
-    deflateEnd(&stream);
-	fclose(filefrom);
-	
-	for (int i = 0; i < 4; i++)
-		fputc(crc >> (i*8), fileto);
-	for (int i = 0; i < 4; i++)
-		fputc(fsize >> (i*8), fileto);
-	fclose(fileto);
-	lua_pushwstring(L, tmp);
-	lua_pushinstance(L, File, 1);
-	free(fname);
-    return 1;
+	return gzip_stream(L, TRUE);
 }
 
 static const luaL_Reg compression_properties[] = {
@@ -190,5 +185,7 @@ static const luaL_Reg compressionlib[] = {
 LUAMOD_API int luaopen_compression(lua_State *L) {
 	lua_regmodule(L, compression);
 	lua_regobjectmt(L, Zip);
+	lua_regobjectmt(L, Deflater);
+	lua_regobjectmt(L, Inflater);
 	return 1;
 }
\ No newline at end of file
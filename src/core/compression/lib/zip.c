@@ -2184,6 +2184,61 @@ mz_uint64 zip_getsize(struct zip_t *zip) {
   return zip->archive.m_archive_size;
 }
 
+const void *zip_getmem(struct zip_t *zip, size_t *size) {
+  if (!zip->archive.m_pState || !zip->archive.m_pState->m_pMem)
+    return NULL;
+  *size = zip->archive.m_pState->m_mem_size;
+  return zip->archive.m_pState->m_pMem;
+}
+
+int zip_getlevel(struct zip_t *zip) {
+  return (int)(zip->level & 0xF);
+}
+
+int zip_entry_addraw(struct zip_t *zip, const char *entryname, const void *buf,
+                     size_t bufsize, mz_uint64 uncomp_size, mz_uint32 crc32,
+                     time_t mtime) {
+  char *name;
+  mz_bool status;
+  MZ_TIME_T t = (MZ_TIME_T)mtime;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  // buf holds raw deflated data if uncomp_size is not 0, stored data otherwise
+  if (!(name = zip_strrpl(entryname, strlen(entryname), '\\', '/'))) {
+    return ZIP_EINVENTNAME;
+  }
+  status = mz_zip_writer_add_mem_ex_v2(
+      &zip->archive, name, buf, bufsize, NULL, 0,
+      uncomp_size ? (zip->level & 0xF) | MZ_ZIP_FLAG_COMPRESSED_DATA : 0,
+      uncomp_size, crc32, &t, NULL, 0, NULL, 0);
+  CLEANUP(name);
+  return status ? 0 : ZIP_EWRTENT;
+}
+
+int zip_entry_addcfile(struct zip_t *zip, const char *entryname, FILE *stream,
+                       mz_uint64 size, time_t mtime, int level) {
+  char *name;
+  mz_bool status;
+  MZ_TIME_T t = (MZ_TIME_T)mtime;
+
+  if (!zip) {
+    // zip_t handler is not initialized
+    return ZIP_ENOINIT;
+  }
+
+  if (!(name = zip_strrpl(entryname, strlen(entryname), '\\', '/'))) {
+    return ZIP_EINVENTNAME;
+  }
+  status = mz_zip_writer_add_cfile(&zip->archive, name, stream, size, &t, NULL,
+                                   0, (mz_uint)level, 0, NULL, 0, NULL, 0);
+  CLEANUP(name);
+  return status ? 0 : ZIP_EWRTENT;
+}
+
 int zip_locatefile(struct zip_t *zip, const char *start) {
   return mz_zip_reader_locate_file(&zip->archive, start, NULL, 0);
 }
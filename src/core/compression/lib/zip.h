@@ -614,6 +614,10 @@ extern ZIP_EXPORT int zip_extract(const char *zipname, const char *dir,
 extern ZIP_EXPORT const char *zip_lasterror(struct zip_t *zip); 
 // extern ZIP_EXPORT void zip_set_last_error(struct zip_t *zip, mz_zip_error err_num);
 extern struct zip_t *zip_mem_new(void *data, size_t size);
+extern const void *zip_getmem(struct zip_t *zip, size_t *size);
+extern int zip_getlevel(struct zip_t *zip);
+extern int zip_entry_addraw(struct zip_t *zip, const char *entryname, const void *buf, size_t bufsize, uint64_t uncomp_size, uint32_t crc32, time_t mtime);
+extern int zip_entry_addcfile(struct zip_t *zip, const char *entryname, FILE *stream, uint64_t size, time_t mtime, int level);
 
 #ifdef __cplusplus
 }
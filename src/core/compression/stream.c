@@ -0,0 +1,565 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | stream.c | LuaRT streaming compression engine
+*/
+
+#define LUA_LIB
+
+#include "stream.h"
+#include <Buffer.h>
+#include "lrtapi.h"
+#include "sys\pool.h"
+
+#include <string.h>
+#include <errno.h>
+
+//--- Slices fed to miniz, as mz_stream counts bytes with unsigned int
+#define STREAM_SLICE 0x40000000
+
+const char *stream_formats[] = { "raw", "zlib", "gzip", NULL };
+
+//--- Gzip member parsing steps
+enum { GZIP_FIXED, GZIP_EXTRALEN, GZIP_EXTRA, GZIP_NAME, GZIP_COMMENT, GZIP_HCRC, GZIP_BODY, GZIP_TRAILER, GZIP_END };
+
+#define GZIP_FHCRC		0x02
+#define GZIP_FEXTRA		0x04
+#define GZIP_FNAME		0x08
+#define GZIP_FCOMMENT	0x10
+
+static const BYTE gzip_fixed[] = { 0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0x0B };
+
+//-------------------------------------[ Stream output ]
+static const char *output_write(lua_State *L, Stream *s, const BYTE *p, size_t len) {
+	Output *o = &s->output;
+
+	if (!len)
+		return NULL;
+	if (o->fp) {
+		if (fwrite(p, 1, len, o->fp) != len)
+			return strerror(errno);
+	} else if (o->file) {
+		if (!o->file->stream)
+			return "output File is closed";
+		if (file_writebytes(o->file, p, len) != len)
+			return strerror(errno);
+	} else if (o->ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, o->ref);
+		lua_pushBuffer(L, (void *)p, len);
+		lua_remove(L, -2);
+		lua_call(L, 1, 0);
+	} else {
+		if (o->len + len > o->size) {
+			size_t size = o->size ? o->size : STREAM_CHUNK;
+			while (size < o->len + len)
+				size *= 2;
+			o->bytes = realloc(o->bytes, size);
+			o->size = size;
+		}
+		memcpy(o->bytes + o->len, p, len);
+		o->len += len;
+	}
+	return NULL;
+}
+
+static const char *output_le32(lua_State *L, Stream *s, mz_ulong value) {
+	BYTE bytes[4] = { (BYTE)value, (BYTE)(value >> 8), (BYTE)(value >> 16), (BYTE)(value >> 24) };
+	return output_write(L, s, bytes, 4);
+}
+
+static mz_ulong le32(const BYTE *p) {
+	return (mz_ulong)p[0] | ((mz_ulong)p[1] << 8) | ((mz_ulong)p[2] << 16) | ((mz_ulong)p[3] << 24);
+}
+
+//--- Pushes the pending output as a Buffer, that takes ownership of the bytes
+int stream_push(lua_State *L, Stream *s) {
+	Output *o = &s->output;
+	Buffer *b;
+
+	if (o->ref != LUA_NOREF || o->fp)
+		return 0;
+	lua_pushnil(L);
+	b = lua_pushinstance(L, Buffer, 1);
+	lua_remove(L, -2);
+	b->bytes = o->bytes;
+	b->size = o->len;
+	b->capacity = o->size;
+	o->bytes = NULL;
+	o->len = o->size = 0;
+	return 1;
+}
+
+//-------------------------------------[ Stream initialization ]
+
+//--- Reads the "format" and "output" fields of the options table at idx, if any
+void stream_init(lua_State *L, Stream *s, int idx) {
+	s->format = FORMAT_ZLIB;
+	s->output.ref = LUA_NOREF;
+	s->chunk = malloc(STREAM_CHUNK*2);
+	if (lua_istable(L, idx)) {
+		if (lua_getfield(L, idx, "format") != LUA_TNIL) {
+			const char *format = luaL_checkstring(L, -1);
+			for (s->format = 0; stream_formats[s->format] && strcmp(format, stream_formats[s->format]); s->format++);
+			if (!stream_formats[s->format])
+				luaL_argerror(L, idx, lua_pushfstring(L, "invalid format '%s'", format));
+		}
+		lua_pop(L, 1);
+		if (lua_getfield(L, idx, "output") != LUA_TNIL) {
+			if (!(s->output.file = lua_iscinstance(L, -1, TFile)))
+				luaL_argcheck(L, lua_isfunction(L, -1), idx, "output must be a File or a function");
+			lua_pushvalue(L, -1);
+			s->output.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+BOOL stream_deflateinit(Stream *s) {
+	return mz_deflateInit2(&s->z, s->level, MZ_DEFLATED, s->format == FORMAT_ZLIB ? MZ_DEFAULT_WINDOW_BITS : -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY) == MZ_OK;
+}
+
+BOOL stream_inflateinit(Stream *s) {
+	s->step = s->format == FORMAT_GZIP ? GZIP_FIXED : GZIP_BODY;
+	return mz_inflateInit2(&s->z, s->format == FORMAT_ZLIB ? MZ_DEFAULT_WINDOW_BITS : -MZ_DEFAULT_WINDOW_BITS) == MZ_OK;
+}
+
+void stream_free(lua_State *L, Stream *s) {
+	if (s->input)
+		fclose(s->input);
+	if (s->output.fp)
+		fclose(s->output.fp);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->output.ref);
+	free(s->output.bytes);
+	free(s->chunk);
+}
+
+//--- Feeds the string, Buffer or File content at idx, a File being read by chunks
+void stream_feed(lua_State *L, Stream *s, int idx, const char *(*func)(lua_State *, Stream *, const BYTE *, size_t)) {
+	const char *err = NULL;
+	Buffer *b;
+	File *f;
+
+	if (s->finished)
+		luaL_error(L, "stream is already finished");
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		size_t len;
+		const char *str = lua_tolstring(L, idx, &len);
+		err = func(L, s, (const BYTE *)str, len);
+	} else if ((b = lua_iscinstance(L, idx, TBuffer)))
+		err = func(L, s, b->bytes, b->size);
+	else if ((f = lua_iscinstance(L, idx, TFile))) {
+		BYTE *in = s->chunk + STREAM_CHUNK;
+		size_t n;
+
+		if (!(s->input = _wfopen(f->fullpath, L"rb"))) {
+			lua_pushwstring(L, f->fullpath);
+			luaL_error(L, "failed to open '%s' : %s", lua_tostring(L, -1), strerror(errno));
+		}
+		while (!err && (n = fread(in, 1, STREAM_CHUNK, s->input)))
+			err = func(L, s, in, n);
+		if (!err && ferror(s->input))
+			err = strerror(errno);
+		fclose(s->input);
+		s->input = NULL;
+	} else luaL_typeerror(L, idx, "string, Buffer or File");
+	if (err)
+		luaL_error(L, "%s", err);
+}
+
+//-------------------------------------[ Compression ]
+const char *stream_deflate(lua_State *L, Stream *s, const BYTE *p, size_t len, int flush) {
+	const char *err;
+	int status;
+
+	if (!s->started) {
+		s->started = TRUE;
+		if (s->format == FORMAT_GZIP && (err = output_write(L, s, gzip_fixed, sizeof(gzip_fixed))))
+			return err;
+	}
+	s->size += len;
+	do {
+		size_t n = len > STREAM_SLICE ? STREAM_SLICE : len;
+		int f = n < len ? MZ_NO_FLUSH : flush;
+
+		if (s->format == FORMAT_GZIP)
+			s->crc = mz_crc32(s->crc, p, n);
+		s->z.next_in = p;
+		s->z.avail_in = (unsigned int)n;
+		p += n;
+		len -= n;
+		do {
+			size_t produced;
+			s->z.next_out = s->chunk;
+			s->z.avail_out = STREAM_CHUNK;
+			if ((status = mz_deflate(&s->z, f)) < MZ_OK && status != MZ_BUF_ERROR)
+				return "compression error";
+			produced = STREAM_CHUNK - s->z.avail_out;
+			s->compressed += produced;
+			if ((err = output_write(L, s, s->chunk, produced)))
+				return err;
+		} while (s->z.avail_in || !s->z.avail_out);
+	} while (len);
+	if (flush == MZ_FINISH) {
+		s->finished = TRUE;
+		if (s->format == FORMAT_GZIP && ((err = output_le32(L, s, s->crc)) || (err = output_le32(L, s, (mz_ulong)s->size))))
+			return err;
+	}
+	return NULL;
+}
+
+const char *stream_compress(lua_State *L, Stream *s, const BYTE *p, size_t len) {
+	return stream_deflate(L, s, p, len, MZ_NO_FLUSH);
+}
+
+//-------------------------------------[ Decompression ]
+
+//--- Moves to the next field present in the gzip header, returns TRUE once the header is complete
+static BOOL gzip_next(Stream *s) {
+	s->count = 0;
+	while (++s->step < GZIP_BODY)
+		if ((s->step == GZIP_EXTRALEN && (s->flags & GZIP_FEXTRA)) || (s->step == GZIP_EXTRA && s->extra) || (s->step == GZIP_NAME && (s->flags & GZIP_FNAME))
+			|| (s->step == GZIP_COMMENT && (s->flags & GZIP_FCOMMENT)) || (s->step == GZIP_HCRC && (s->flags & GZIP_FHCRC)))
+			return FALSE;
+	return TRUE;
+}
+
+//--- Parses the gzip header one byte at a time, returns 1 once complete, 0 if more bytes are needed, or -1 on error
+static int gzip_header(Stream *s, BYTE c) {
+	if (s->step != GZIP_HCRC)
+		s->hcrc = mz_crc32(s->hcrc, &c, 1);
+	switch (s->step) {
+		case GZIP_FIXED:
+			s->header[s->count++] = c;
+			if (s->count < 10)
+				return 0;
+			if (s->header[0] != 0x1F || s->header[1] != 0x8B || s->header[2] != MZ_DEFLATED || (s->header[3] & 0xE0))
+				return -1;
+			s->flags = s->header[3];
+			break;
+		case GZIP_EXTRALEN:
+			s->header[s->count++] = c;
+			if (s->count < 2)
+				return 0;
+			s->extra = s->header[0] | (s->header[1] << 8);
+			break;
+		case GZIP_EXTRA:
+			if (--s->extra)
+				return 0;
+			break;
+		case GZIP_NAME:
+		case GZIP_COMMENT:
+			if (c)
+				return 0;
+			break;
+		case GZIP_HCRC:
+			s->header[s->count++] = c;
+			if (s->count < 2)
+				return 0;
+			if ((s->header[0] | (s->header[1] << 8)) != (s->hcrc & 0xFFFF))
+				return -1;
+			break;
+	}
+	return gzip_next(s);
+}
+
+//--- Gzip members are parsed for their header and trailer, concatenated members being supported
+const char *stream_inflate(lua_State *L, Stream *s, const BYTE *p, size_t len) {
+	const char *err;
+	int status;
+
+	s->compressed += len;
+	while (len) {
+		size_t n, consumed;
+
+		if (s->step == GZIP_END) {
+			if (s->format != FORMAT_GZIP)
+				return "unexpected data after the end of the compressed stream";
+			s->step = GZIP_FIXED;
+			s->count = 0;
+			s->extra = 0;
+			s->hcrc = s->crc = 0;
+			s->isize = 0;
+			mz_inflateReset(&s->z);
+		}
+		if (s->step < GZIP_BODY) {
+			if ((status = gzip_header(s, *p++)) < 0)
+				return "invalid gzip header";
+			len--;
+			continue;
+		}
+		if (s->step == GZIP_TRAILER) {
+			s->header[s->count++] = *p++;
+			len--;
+			if (s->count == 8) {
+				if (le32(s->header) != s->crc)
+					return "gzip CRC32 mismatch";
+				if (le32(s->header+4) != s->isize)
+					return "gzip size mismatch";
+				s->step = GZIP_END;
+				s->started = TRUE;
+			}
+			continue;
+		}
+		n = len > STREAM_SLICE ? STREAM_SLICE : len;
+		s->z.next_in = p;
+		s->z.avail_in = (unsigned int)n;
+		do {
+			size_t produced;
+			s->z.next_out = s->chunk;
+			s->z.avail_out = STREAM_CHUNK;
+			status = mz_inflate(&s->z, MZ_NO_FLUSH);
+			if ((produced = STREAM_CHUNK - s->z.avail_out)) {
+				s->size += produced;
+				if (s->format == FORMAT_GZIP) {
+					s->crc = mz_crc32(s->crc, s->chunk, produced);
+					s->isize += (mz_ulong)produced;
+				}
+				if ((err = output_write(L, s, s->chunk, produced)))
+					return err;
+			}
+			if (status == MZ_STREAM_END) {
+				s->count = 0;
+				if (s->format == FORMAT_GZIP)
+					s->step = GZIP_TRAILER;
+				else {
+					s->step = GZIP_END;
+					s->started = TRUE;
+				}
+				break;
+			}
+			if (status < MZ_OK && status != MZ_BUF_ERROR)
+				return "invalid compressed data";
+		} while (status == MZ_OK && (s->z.avail_in || !s->z.avail_out));
+		consumed = n - s->z.avail_in;
+		if (!consumed && s->step == GZIP_BODY)
+			return "invalid compressed data";
+		p += consumed;
+		len -= consumed;
+	}
+	return NULL;
+}
+
+//--- Checks that the compressed stream is complete
+const char *stream_end(Stream *s) {
+	s->finished = TRUE;
+	return s->step == GZIP_END ? NULL : "unexpected end of compressed data";
+}
+
+//-------------------------------------[ Parallel compression ]
+
+//--- Blocks are compressed independently, each one primed with the last 32KB of data preceding it
+#define PARALLEL_BLOCK	131072
+#define PARALLEL_DICT	32768
+
+//--- State shared by the Blocks, released by the last running one
+typedef struct {
+	HANDLE			ready;		//--- signaled each time a Block is done
+	volatile LONG	refs;
+} Parallel;
+
+typedef struct {
+	Job				job;
+	Parallel		*parallel;
+	volatile LONG	done;
+	BOOL			failed;
+	BOOL			last;
+	int				level;
+	BYTE			*in;		//--- dictionary followed by the Block data
+	size_t			dictlen;
+	size_t			len;
+	BYTE			*out;
+	size_t			outlen;
+	mz_ulong		crc;
+} Block;
+
+static void parallel_release(Parallel *p) {
+	if (!InterlockedDecrement(&p->refs)) {
+		CloseHandle(p->ready);
+		free(p);
+	}
+}
+
+static DWORD __stdcall BlockThread(LPVOID data) {
+	Block *b = (Block *)data;
+	Parallel *p = b->parallel;
+	mz_stream z = {0};
+	size_t size = mz_deflateBound(NULL, (mz_ulong)(b->len > b->dictlen ? b->len : b->dictlen)) + 64;
+
+	b->out = malloc(size);
+	b->crc = mz_crc32(0, b->in + b->dictlen, b->len);
+	if (!(b->failed = mz_deflateInit2(&z, b->level, MZ_DEFLATED, -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY) != MZ_OK)) {
+		//--- the dictionary is compressed and its output discarded : after a sync flush, the Block output
+		//--- starts on a byte boundary and its matches may refer to the dictionary
+		if (b->dictlen) {
+			z.next_in = b->in;
+			z.avail_in = (unsigned int)b->dictlen;
+			z.next_out = b->out;
+			z.avail_out = (unsigned int)size;
+			b->failed = mz_deflate(&z, MZ_SYNC_FLUSH) != MZ_OK || z.avail_in;
+		}
+		z.next_in = b->in + b->dictlen;
+		z.avail_in = (unsigned int)b->len;
+		z.next_out = b->out;
+		z.avail_out = (unsigned int)size;
+		if (!b->failed)
+			b->failed = mz_deflate(&z, b->last ? MZ_FINISH : MZ_SYNC_FLUSH) != (b->last ? MZ_STREAM_END : MZ_OK) || z.avail_in;
+		b->outlen = size - z.avail_out;
+		mz_deflateEnd(&z);
+	}
+	//--- the Block may be released as soon as it is done
+	InterlockedExchange(&b->done, TRUE);
+	SetEvent(p->ready);
+	parallel_release(p);
+	return 0;
+}
+
+//--- Combines the CRC32 of two consecutive sequences, len2 being the length of the second one
+//--- (multiplication by x^(8*len2) in GF(2), from zlib)
+static mz_ulong gf2_times(const mz_ulong *mat, mz_ulong vec) {
+	mz_ulong sum = 0;
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_square(mz_ulong *square, const mz_ulong *mat) {
+	int n;
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+static mz_ulong crc32_combine(mz_ulong crc1, mz_ulong crc2, ULONGLONG len2) {
+	mz_ulong even[32], odd[32], row = 1;
+	int n;
+
+	if (!len2)
+		return crc1;
+	odd[0] = 0xEDB88320UL;
+	for (n = 1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+	do {
+		gf2_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_times(even, crc1);
+		if (!(len2 >>= 1))
+			break;
+		gf2_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+	return crc1 ^ crc2;
+}
+
+//--- Compresses the string, Buffer or File content at idx as a single gzip member, using up to
+//--- parallel Blocks at once. The Stream output must not be a function, as no error can be thrown
+//--- while Blocks are compressed
+//--- The call is synchronous : Blocks are compressed by the worker pool but the calling thread waits
+//--- for each one in order to write it, so a running Task is not suspended meanwhile (the wait runs
+//--- inside the protected gzip_run() call, from which a Task cannot yield)
+void stream_parallel(lua_State *L, Stream *s, int idx, size_t parallel) {
+	const BYTE *mem = NULL;
+	size_t memlen = 0, taillen = 0, next = 0, written = 0;
+	const char *err;
+	BOOL eof = FALSE;
+	Block **blocks;
+	Parallel *p;
+	BYTE *tail;
+	Buffer *b;
+	File *f;
+
+	if (lua_type(L, idx) == LUA_TSTRING)
+		mem = (const BYTE *)lua_tolstring(L, idx, &memlen);
+	else if ((b = lua_iscinstance(L, idx, TBuffer))) {
+		mem = b->bytes;
+		memlen = b->size;
+	} else if ((f = lua_iscinstance(L, idx, TFile))) {
+		if (!(s->input = _wfopen(f->fullpath, L"rb"))) {
+			lua_pushwstring(L, f->fullpath);
+			luaL_error(L, "failed to open '%s' : %s", lua_tostring(L, -1), strerror(errno));
+		}
+	} else luaL_typeerror(L, idx, "string, Buffer or File");
+	blocks = calloc(parallel, sizeof(Block *));
+	p = calloc(1, sizeof(Parallel));
+	p->ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+	p->refs = 1;
+	tail = malloc(PARALLEL_DICT);
+	s->started = TRUE;
+	err = output_write(L, s, gzip_fixed, sizeof(gzip_fixed));
+	while (!err && (!eof || written < next)) {
+		//--- at most parallel Blocks are compressed or waiting to be written, so that memory stays bounded
+		while (!eof && next - written < parallel) {
+			Block *block = calloc(1, sizeof(Block));
+			block->in = malloc(PARALLEL_DICT + PARALLEL_BLOCK);
+			memcpy(block->in, tail, taillen);
+			block->dictlen = taillen;
+			if (!s->input) {
+				block->len = memlen > PARALLEL_BLOCK ? PARALLEL_BLOCK : memlen;
+				memcpy(block->in + taillen, mem, block->len);
+				mem += block->len;
+				memlen -= block->len;
+				eof = !memlen;
+			} else {
+				block->len = fread(block->in + taillen, 1, PARALLEL_BLOCK, s->input);
+				eof = block->len < PARALLEL_BLOCK;
+			}
+			taillen = taillen + block->len > PARALLEL_DICT ? PARALLEL_DICT : taillen + block->len;
+			memcpy(tail, block->in + block->dictlen + block->len - taillen, taillen);
+			block->last = eof;
+			block->level = s->level;
+			block->parallel = p;
+			InterlockedIncrement(&p->refs);
+			block->job.func = BlockThread;
+			block->job.userdata = block;
+			blocks[next++ % parallel] = block;
+			pool_queue(&block->job);
+		}
+		if (written < next) {
+			Block *block = blocks[written % parallel];
+			while (!InterlockedCompareExchange(&block->done, 0, 0))
+				WaitForSingleObject(p->ready, INFINITE);
+			if (block->failed)
+				err = "compression error";
+			else if (!(err = output_write(L, s, block->out, block->outlen))) {
+				s->crc = crc32_combine(s->crc, block->crc, block->len);
+				s->size += block->len;
+				s->compressed += block->outlen;
+			}
+			blocks[written++ % parallel] = NULL;
+			free(block->in);
+			free(block->out);
+			free(block);
+		}
+	}
+	if (!err && s->input && ferror(s->input))
+		err = strerror(errno);
+	//--- remaining Blocks are waited for on errors
+	while (written < next) {
+		Block *block = blocks[written++ % parallel];
+		while (!InterlockedCompareExchange(&block->done, 0, 0))
+			WaitForSingleObject(p->ready, INFINITE);
+		free(block->in);
+		free(block->out);
+		free(block);
+	}
+	if (s->input) {
+		fclose(s->input);
+		s->input = NULL;
+	}
+	parallel_release(p);
+	free(blocks);
+	free(tail);
+	s->finished = TRUE;
+	if (!err && !(err = output_le32(L, s, s->crc)))
+		err = output_le32(L, s, (mz_ulong)s->size);
+	if (err)
+		luaL_error(L, "%s", err);
+}
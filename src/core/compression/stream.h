@@ -0,0 +1,90 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | stream.h | LuaRT streaming compression header
+*/
+
+#pragma once
+
+#include <luart.h>
+#include <File.h>
+#include <stdio.h>
+
+#define MINIZ_HEADER_FILE_ONLY
+#include "lib\miniz.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STREAM_CHUNK 65536		//--- size of input reads and output chunks
+
+typedef enum { FORMAT_RAW, FORMAT_ZLIB, FORMAT_GZIP } StreamFormat;
+
+extern const char *stream_formats[];
+
+//---------------------------------------- Stream output : a File, a function, or Buffers returned to the caller
+typedef struct {
+	int			ref;		//--- File instance or function, LUA_NOREF to return Buffers
+	File		*file;
+	FILE		*fp;		//--- file opened by compression.gzip() and compression.gunzip()
+	BYTE		*bytes;		//--- pending output not yet returned
+	size_t		len;
+	size_t		size;
+} Output;
+
+//---------------------------------------- State shared by Deflater and Inflater objects
+typedef struct {
+	luart_type	type;
+	mz_stream	z;
+	int			format;
+	int			level;
+	BOOL		started;	//--- FALSE until the first member header has been processed
+	BOOL		finished;
+	int			step;		//--- gzip member parsing step
+	int			count;
+	int			flags;
+	size_t		extra;
+	mz_ulong	hcrc;
+	BYTE		header[10];
+	mz_ulong	crc;		//--- CRC32 of the uncompressed data, for the gzip format
+	mz_ulong	isize;		//--- uncompressed bytes of the current gzip member, modulo 2^32
+	ULONGLONG	size;		//--- uncompressed bytes
+	ULONGLONG	compressed;	//--- compressed bytes
+	BYTE		*chunk;		//--- output chunk, followed by the input chunk
+	FILE		*input;		//--- File being read, closed on errors
+	Output		output;
+} Stream;
+
+typedef Stream Deflater;
+typedef Stream Inflater;
+
+extern luart_type TDeflater;
+extern luart_type TInflater;
+
+//---------------------------------------- Streaming functions, returning an error message or NULL
+void stream_init(lua_State *L, Stream *s, int idx);
+BOOL stream_deflateinit(Stream *s);
+BOOL stream_inflateinit(Stream *s);
+void stream_free(lua_State *L, Stream *s);
+const char *stream_deflate(lua_State *L, Stream *s, const BYTE *p, size_t len, int flush);
+const char *stream_compress(lua_State *L, Stream *s, const BYTE *p, size_t len);
+const char *stream_inflate(lua_State *L, Stream *s, const BYTE *p, size_t len);
+const char *stream_end(Stream *s);
+void stream_feed(lua_State *L, Stream *s, int idx, const char *(*func)(lua_State *, Stream *, const BYTE *, size_t));
+int stream_push(lua_State *L, Stream *s);
+void stream_parallel(lua_State *L, Stream *s, int idx, size_t parallel);
+
+LUA_CONSTRUCTOR(Deflater);
+extern const luaL_Reg Deflater_methods[];
+extern const luaL_Reg Deflater_metafields[];
+
+LUA_CONSTRUCTOR(Inflater);
+extern const luaL_Reg Inflater_methods[];
+extern const luaL_Reg Inflater_metafields[];
+
+#ifdef __cplusplus
+}
+#endif
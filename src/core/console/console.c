@@ -551,6 +551,7 @@ int create_stdfile(lua_State *L, FILE *f, wchar_t *name, int mode) {
 	free(F->fullpath);
 	F->fullpath = _wcsdup(name);
 	F->std = TRUE;
+	F->autoflush = TRUE;
 	F->mode = mode;
 	F->h = (HANDLE)_get_osfhandle(_fileno(f));
 	return luaL_ref(L, LUA_REGISTRYINDEX);
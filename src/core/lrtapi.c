@@ -12,6 +12,7 @@
 #include <Task.h>
 #include "lrtapi.h"
 #include "sys\async.h"
+#include "sys\pool.h"
 #include <windows.h>
 
 //-------------------------------------------------[UTF8 strings conversion functions]
@@ -81,6 +82,51 @@ LUA_API int lua_pushtask(lua_State *L, lua_KFunction taskfunc, void *userdata, l
 	return 1;	
 }
 
+//-------------------------------------------------[lua_pushjob() function]
+static int JobTaskContinue(lua_State *L, int status, lua_KContext ctx) {
+	Job *job = (Job *)ctx;
+	Task *t = search_task(L);
+
+	if (job->done) {
+		lua_KFunction k = job->k;
+		void *userdata = job->userdata;
+		DWORD result = job->result;
+
+		t->job = NULL;
+		free(job);
+		return k(L, (int)result, (lua_KContext)userdata);
+	}
+	if (job->period != INFINITE) {
+		int top = lua_gettop(L);
+		job->k(L, STILL_ACTIVE, (lua_KContext)job->userdata);
+		lua_settop(L, top);
+	}
+	wait_job(t, job);
+	return lua_yieldk(L, 0, ctx, JobTaskContinue);
+}
+
+LUA_API int lua_pushjob(lua_State *L, LPTHREAD_START_ROUTINE func, lua_KFunction k, void *userdata, lua_CFunction gc, DWORD period) {
+	Job *job = calloc(1, sizeof(Job));
+	Task *t;
+
+	job->func = func;
+	job->userdata = userdata;
+	job->k = k;
+	job->period = period;
+	lua_pushlightuserdata(L, job);
+	lua_pushlightuserdata(L, JobTaskContinue);
+	lua_pushcclosure(L, WaitTask, 2);
+	t = lua_pushinstance(L, Task, 1);
+	t->userdata = userdata;
+	if (gc)
+		t->gc_func = gc;
+	lua_pushvalue(L, -1);
+	lua_call(L, 0, 0);
+	wait_job(t, job);
+	queue_job(job);
+	return 1;
+}
+
 //-------------------------------------------------[LuaL_setfuncs alternative with lua_rawset]
 LUALIB_API void luaL_setrawfuncs(lua_State *L, const luaL_Reg *l) {
   for (; l->name != NULL; l++) { 
@@ -122,7 +168,7 @@ LUA_API int lua_throwevent(lua_State *L, const char *name, int nparams) {
 		lua_xmove(t->L, L, 1);
     	return -1;
 	}
-    t->status = TTerminated;
+    close_task(t);
 	lua_xmove(t->L, L, nres);
 	return nres;
   } else lua_pop(L, 1);
@@ -138,8 +184,7 @@ LUA_API int lua_wait(lua_State *L, int idx) {
 int do_sleep(lua_State *L, lua_Integer delay) {
 	Task *t = search_task(L);
 
-	t->sleep =  GetTickCount64() + delay;
-	t->status = TSleep;
+	sleep_task(t, delay);
 	if (lua_isyieldable(L))
 		return lua_yield(L, 0);
 	else while (t->status == TSleep)
@@ -151,6 +196,25 @@ LUA_API void lua_sleep(lua_State *L, lua_Integer delay) {
 	do_sleep(L, delay);
 }
 
+//-------------------------------------------------[lua_waitevent() function]
+LUA_API int lua_waitevent(lua_State *L, HANDLE h, DWORD timeout, lua_KContext ctx, lua_KFunction k) {
+	Task *t = search_task(L);
+
+	if (!t || !lua_isyieldable(L)) {
+		//--- not in a Task : block the whole Lua state
+		if (h)
+			WaitForSingleObject(h, timeout);
+		else
+			Sleep(timeout == INFINITE ? 0 : timeout);
+		return k(L, LUA_YIELD, ctx);
+	}
+	if (h)
+		wait_task(t, h, timeout);
+	else
+		sleep_task(t, timeout == INFINITE ? 0 : timeout);
+	return lua_yieldk(L, 0, ctx, k);
+}
+
 LUA_API Task *lua_gettask(lua_State *L) {
 	return search_task(L);
 }
@@ -402,6 +466,10 @@ static const luaL_Reg def_libs[] = {
 LUALIB_API void luaL_openlibs(lua_State *L) {
 	const luaL_Reg *lib;
 
+	/* threads inherit the main thread extra space : no Task is linked to them until create_task() */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	*(Task **)lua_getextraspace(lua_tothread(L, -1)) = NULL;
+	lua_pop(L, 1);
 	for (lib = def_libs; lib->func; lib++) {
 		luaL_requiref(L, lib->name, lib->func, 1);
 		lua_pop(L, 1);
@@ -19,6 +19,38 @@ extern "C" {
 //--- Utility macro to calculate UTF8 char size in bytes
 #define utf8_charsize(c) (((0xE5000000 >> ((((unsigned char)*c) >> 3) & 0x1E)) & 3) + 1)
 
+//--- UTF8 kernels, vectorized when the CPU supports it
+size_t utf8_count(const char *s, size_t len);
+size_t utf8_ascii(const char *s, size_t len);
+const char *utf8_lpos(const char *s, size_t len, size_t pos);
+BOOL utf8_valid(const char *s, size_t len);
+
+//--- Substring search engine, utf8_find() only returning matches on a character boundary
+const char *mem_find(const char *s, size_t len, const char *needle, size_t nlen);
+const char *utf8_find(const char *s, size_t len, const char *needle, size_t nlen);
+
+//--- Base64 and hexadecimal codecs, vectorized when the CPU supports it
+//--- Streaming state : pass chunks in order, then call the _end() function
+typedef struct {
+	UINT32	bits;		//--- pending bits
+	int		count;		//--- pending bytes when encoding, pending characters when decoding
+	int		padding;	//--- base64 padding state when decoding
+	BOOL	url;		//--- encode with the URL-safe base64 alphabet, without padding
+} CodecState;
+
+#define base64_encoded_size(len)	((((len)+2)/3)*4)
+#define base64_decoded_size(len)	((((len)+3)/4)*3)
+#define hex_decoded_size(len)		(((len)+1)/2)
+
+void codec_init(CodecState *st, BOOL url);
+size_t base64_encode(CodecState *st, const BYTE *src, size_t len, char *dst);
+size_t base64_encode_end(CodecState *st, char *dst);
+BOOL base64_decode(CodecState *st, const char *src, size_t len, BYTE *dst, size_t *written);
+BOOL base64_decode_end(CodecState *st, BYTE *dst, size_t *written);
+size_t hex_encode(const BYTE *src, size_t len, char *dst);
+BOOL hex_decode(CodecState *st, const char *src, size_t len, BYTE *dst, size_t *written);
+BOOL hex_decode_end(CodecState *st);
+
 //--- Utility functions for UTF8 <=> Wide string conversions
 wchar_t *utf8_towchar(const char *str, int *len);
 char *wchar_toutf8(const wchar_t *str, int *len);
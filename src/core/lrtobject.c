@@ -370,6 +370,26 @@ int usertype_constructor(lua_State *L) {
 	return 1;
 }
 
+//--- Type ids are shared by all Lua states (the main one and each Worker one), whatever their registration order
+static SRWLOCK types_lock = SRWLOCK_INIT;
+static char **types;
+static luart_type ntypes;
+
+static luart_type type_id(const char *typename) {
+	luart_type t;
+
+	AcquireSRWLockExclusive(&types_lock);
+	for (t = 0; t < ntypes; t++)
+		if (strcmp(types[t], typename) == 0)
+			break;
+	if (t == ntypes) {
+		types = realloc(types, (ntypes+1)*sizeof(char *));
+		types[ntypes++] = _strdup(typename);
+	}
+	ReleaseSRWLockExclusive(&types_lock);
+	return t+1;
+}
+
 int lua_registerobject(lua_State *L, int *type, const char *typename, lua_CFunction constructor, const luaL_Reg *methods, const luaL_Reg *mt) {
 	luart_type t;
 	int count = lua_gettop(L);
@@ -430,13 +450,16 @@ int lua_registerobject(lua_State *L, int *type, const char *typename, lua_CFunct
 	lua_pushstring(L, "Object");
 	lua_setfield(L, -2, "__name");
 	lua_setmetatable(L, -2);
-	luaL_getsubtable(L, LUA_REGISTRYINDEX, LUART_OBJECTS);
-	lua_pushstring(L, typename);
-	t = luaL_len(L, -2)+1;
-	lua_rawseti(L, -2, t);
-	lua_pop(L, 1);
+	t = typename ? type_id(typename) : 0;
+	if (t) {
+		luaL_getsubtable(L, LUA_REGISTRYINDEX, LUART_OBJECTS);
+		lua_pushstring(L, typename);
+		lua_rawseti(L, -2, t);
+		lua_pop(L, 1);
+	}
 	if (type) {
-		*type = t;
+		if (*type != t)
+			*type = t;
 		lua_pushstring(L, typename);
 		lua_pushvalue(L, -2);
 		lua_rawset(L, -4);
@@ -20,6 +20,8 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "lrtapi.h"
+
 
 #define MAXUNICODE	0x10FFFFu
 
@@ -104,6 +106,11 @@ static int utflen (lua_State *L) {
                    "initial position out of bounds");
   luaL_argcheck(L, --posj < (lua_Integer)len, 3,
                    "final position out of bounds");
+  /* LuaRT: well formed ranges are counted with the vectorized UTF8 kernels */
+  if (!lax && posi <= posj && utf8_valid(s + posi, (size_t)(posj - posi + 1))) {
+    lua_pushinteger(L, (lua_Integer)utf8_count(s + posi, (size_t)(posj - posi + 1)));
+    return 1;
+  }
   while (posi <= posj) {
     const char *s1 = utf8_decode(s + posi, NULL, !lax);
     if (s1 == NULL) {  /* conversion error? */
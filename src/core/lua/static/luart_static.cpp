@@ -59,6 +59,7 @@ extern "C" static const char* const LuaFunctionNames[] =
 	"lua_pushcclosure",
 	"lua_pushfstring",
 	"lua_pushinteger",
+	"lua_pushjob",
 	"lua_pushlightuserdata",
 	"lua_pushlstring",
 	"lua_pushlwstring",
@@ -123,7 +124,9 @@ extern "C" static const char* const LuaFunctionNames[] =
 	"lua_upvalueid",
 	"lua_upvaluejoin",
 	"lua_version",
+	"lua_viewBuffer",
 	"lua_wait",
+	"lua_waitevent",
 	"lua_warning",
 	"lua_xmove",
 	"lua_yieldk",
@@ -0,0 +1,403 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | codec.c | LuaRT base64 and hexadecimal codecs (SSE2/SSSE3 with scalar fallback)
+*/
+
+#define LUA_LIB
+
+#include "lrtapi.h"
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define CODEC_SIMD
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+		#define CODEC_SSSE3 __attribute__((target("ssse3")))
+	#endif
+	#include <immintrin.h>
+#endif
+
+#ifndef CODEC_SSSE3
+	#define CODEC_SSSE3
+#endif
+
+static const char b64std[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static const char hexdigits[] = "0123456789ABCDEF";
+
+//--- Base64 character values : both alphabets are decoded, 64 is padding, 65 is whitespace
+#define XX 0xFF
+#define PAD 64
+#define SPACE 65
+
+static const BYTE b64dec[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, 65, 65, XX, XX, 65, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	65, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, 62, XX, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, 64, XX, XX,
+	XX, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, 63,
+	XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+static int hexvalue(BYTE c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+//-------------------------------------[ Scalar kernels ]
+//--- Kernels only process whole groups (3 bytes/4 characters for base64, 1 byte/2 characters for hex)
+//--- and return the number of input bytes consumed
+
+static size_t b64enc_scalar(const BYTE *s, size_t len, char *d, BOOL url) {
+	const char *alpha = url ? b64url : b64std;
+	size_t i;
+
+	for (i = 0; len - i >= 3; i += 3) {
+		UINT32 v = ((UINT32)s[i] << 16) | ((UINT32)s[i+1] << 8) | s[i+2];
+		*d++ = alpha[v >> 18];
+		*d++ = alpha[(v >> 12) & 63];
+		*d++ = alpha[(v >> 6) & 63];
+		*d++ = alpha[v & 63];
+	}
+	return i;
+}
+
+//--- Stops at the first group containing padding, whitespace or an invalid character
+static size_t b64dec_scalar(const char *s, size_t len, BYTE *d) {
+	const BYTE *u = (const BYTE *)s;
+	size_t i;
+
+	for (i = 0; len - i >= 4; i += 4) {
+		UINT32 a = b64dec[u[i]], b = b64dec[u[i+1]], c = b64dec[u[i+2]], e = b64dec[u[i+3]], v;
+		if ((a | b | c | e) >= 64)
+			break;
+		v = (a << 18) | (b << 12) | (c << 6) | e;
+		*d++ = (BYTE)(v >> 16);
+		*d++ = (BYTE)(v >> 8);
+		*d++ = (BYTE)v;
+	}
+	return i;
+}
+
+static size_t hexenc_scalar(const BYTE *s, size_t len, char *d) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*d++ = hexdigits[s[i] >> 4];
+		*d++ = hexdigits[s[i] & 15];
+	}
+	return len;
+}
+
+static size_t hexdec_scalar(const char *s, size_t len, BYTE *d) {
+	size_t i;
+
+	for (i = 0; len - i >= 2; i += 2) {
+		int hi = hexvalue((BYTE)s[i]), lo = hexvalue((BYTE)s[i+1]);
+		if ((hi | lo) < 0)
+			break;
+		*d++ = (BYTE)((hi << 4) | lo);
+	}
+	return i;
+}
+
+#ifdef CODEC_SIMD
+
+//-------------------------------------[ SSE2 kernels ]
+static size_t hexenc_sse2(const BYTE *s, size_t len, char *d) {
+	const __m128i mask = _mm_set1_epi8(15), nine = _mm_set1_epi8(9), zero = _mm_set1_epi8('0'), letters = _mm_set1_epi8('A' - '0' - 10);
+	size_t i;
+
+	for (i = 0; len - i >= 16; i += 16, d += 32) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask), lo = _mm_and_si128(v, mask);
+		__m128i a = _mm_unpacklo_epi8(hi, lo), b = _mm_unpackhi_epi8(hi, lo);
+		a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), letters));
+		b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), letters));
+		_mm_storeu_si128((__m128i *)d, a);
+		_mm_storeu_si128((__m128i *)(d+16), b);
+	}
+	return i + hexenc_scalar(s+i, len-i, d);
+}
+
+//--- Converts 16 characters to 8 bytes at once, stops at the first block with a non hexadecimal character
+static size_t hexdec_sse2(const char *s, size_t len, BYTE *d) {
+	const __m128i before0 = _mm_set1_epi8('0'-1), after9 = _mm_set1_epi8('9'+1), beforea = _mm_set1_epi8('a'-1), afterf = _mm_set1_epi8('f'+1);
+	const __m128i lower = _mm_set1_epi8(0x20), low = _mm_set1_epi16(0xFF);
+	size_t i;
+
+	for (i = 0; len - i >= 16; i += 16, d += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s+i)), lv = _mm_or_si128(v, lower);
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, before0), _mm_cmplt_epi8(v, after9));
+		__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lv, beforea), _mm_cmplt_epi8(lv, afterf));
+		__m128i val;
+		if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xFFFF)
+			break;
+		val = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))), _mm_and_si128(letter, _mm_sub_epi8(lv, _mm_set1_epi8('a'-10))));
+		//--- the first character of each pair is in the low byte of each 16 bits lane
+		val = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(val, low), 4), _mm_srli_epi16(val, 8));
+		_mm_storel_epi64((__m128i *)d, _mm_packus_epi16(val, val));
+	}
+	return i + hexdec_scalar(s+i, len-i, d);
+}
+
+//-------------------------------------[ SSSE3 kernels ]
+//--- 12 bytes to 16 characters at once (Wojciech Mula's multiply-shift and lookup method)
+static CODEC_SSSE3 size_t b64enc_ssse3(const BYTE *s, size_t len, char *d, BOOL url) {
+	const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m128i offsets = _mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+										  url ? '-'-62 : '+'-62, url ? '_'-63 : '/'-63, 'A', 0, 0);
+	size_t i;
+
+	for (i = 0; len - i >= 16; i += 12, d += 16) {
+		__m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s+i)), shuffle);
+		__m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+		__m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+		__m128i idx = _mm_or_si128(hi, lo);
+		//--- 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+		__m128i range = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+		_mm_storeu_si128((__m128i *)d, _mm_add_epi8(idx, _mm_shuffle_epi8(offsets, range)));
+	}
+	return i + b64enc_scalar(s+i, len-i, d, url);
+}
+
+//--- 16 characters to 12 bytes at once, stops at the first block with padding, whitespace or an invalid character
+static CODEC_SSSE3 size_t b64dec_ssse3(const char *s, size_t len, BYTE *d) {
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	size_t i;
+
+	//--- 16 bytes are stored for 12 decoded bytes : keep enough input so that the output fits
+	for (i = 0; len - i >= 24; i += 16, d += 12) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z'+1)));
+		__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z'+1)));
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9'+1)));
+		__m128i c62 = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')), _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+		__m128i c63 = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+		__m128i shift;
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(c62, c63)))) != 0xFFFF)
+			break;
+		shift = _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26-'a')));
+		shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52-'0')));
+		v = _mm_add_epi8(v, shift);
+		v = _mm_or_si128(_mm_andnot_si128(_mm_or_si128(c62, c63), v), _mm_or_si128(_mm_and_si128(c62, _mm_set1_epi8(62)), _mm_and_si128(c63, _mm_set1_epi8(63))));
+		//--- merge 4 x 6 bits into 24 bits in each 32 bits lane, then gather the 3 bytes of each lane in order
+		v = _mm_madd_epi16(_mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(v, pack));
+	}
+	return i + b64dec_scalar(s+i, len-i, d);
+}
+
+#endif
+
+//-------------------------------------[ Runtime dispatch ]
+typedef struct {
+	size_t (*b64enc)(const BYTE *s, size_t len, char *d, BOOL url);
+	size_t (*b64dec)(const char *s, size_t len, BYTE *d);
+	size_t (*hexenc)(const BYTE *s, size_t len, char *d);
+	size_t (*hexdec)(const char *s, size_t len, BYTE *d);
+} Kernels;
+
+static const Kernels scalar_kernels = { b64enc_scalar, b64dec_scalar, hexenc_scalar, hexdec_scalar };
+#ifdef CODEC_SIMD
+static const Kernels sse2_kernels = { b64enc_scalar, b64dec_scalar, hexenc_sse2, hexdec_sse2 };
+static const Kernels ssse3_kernels = { b64enc_ssse3, b64dec_ssse3, hexenc_sse2, hexdec_sse2 };
+#endif
+
+static const Kernels *select_kernels(void) {
+#ifdef CODEC_SIMD
+	int regs[4];
+#ifdef _MSC_VER
+	__cpuid(regs, 1);
+#else
+	__cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	if (!(regs[3] & (1 << 26)))
+		return &scalar_kernels;
+	return (regs[2] & (1 << 9)) ? &ssse3_kernels : &sse2_kernels;
+#else
+	return &scalar_kernels;
+#endif
+}
+
+static const Kernels *kernels = NULL;
+
+//--- Concurrent first calls all select the same kernels, so no synchronization is needed
+#define K (kernels ? kernels : (kernels = select_kernels()))
+
+//-------------------------------------[ Base64 ]
+
+void codec_init(CodecState *st, BOOL url) {
+	memset(st, 0, sizeof(CodecState));
+	st->url = url;
+}
+
+//--- Encode len bytes to dst, that must hold base64_encoded_size(len) characters
+//--- Up to 2 remaining bytes are kept in the state for the next call
+size_t base64_encode(CodecState *st, const BYTE *src, size_t len, char *dst) {
+	const char *alpha = st->url ? b64url : b64std;
+	char *d = dst;
+	size_t n;
+
+	for (; st->count && len; len--) {
+		st->bits = (st->bits << 8) | *src++;
+		if (++st->count == 3) {
+			*d++ = alpha[st->bits >> 18];
+			*d++ = alpha[(st->bits >> 12) & 63];
+			*d++ = alpha[(st->bits >> 6) & 63];
+			*d++ = alpha[st->bits & 63];
+			st->bits = st->count = 0;
+		}
+	}
+	n = K->b64enc(src, len, d, st->url);
+	d += n / 3 * 4;
+	for (src += n, len -= n; len; len--) {
+		st->bits = (st->bits << 8) | *src++;
+		st->count++;
+	}
+	return d - dst;
+}
+
+//--- Flush the remaining bytes to dst (up to 4 characters), with padding for the standard alphabet
+size_t base64_encode_end(CodecState *st, char *dst) {
+	const char *alpha = st->url ? b64url : b64std;
+	UINT32 v = st->bits << (st->count == 1 ? 16 : 8);
+	char *d = dst;
+
+	if (st->count) {
+		*d++ = alpha[v >> 18];
+		*d++ = alpha[(v >> 12) & 63];
+		if (st->count == 2)
+			*d++ = alpha[(v >> 6) & 63];
+		if (!st->url) {
+			*d++ = '=';
+			if (st->count == 1)
+				*d++ = '=';
+		}
+	}
+	st->bits = st->count = 0;
+	return d - dst;
+}
+
+//--- Decode len characters to dst, that must hold base64_decoded_size(len) bytes
+//--- Both alphabets are accepted, whitespaces are skipped. Returns FALSE on invalid input
+BOOL base64_decode(CodecState *st, const char *src, size_t len, BYTE *dst, size_t *written) {
+	const char *end = src + len;
+	BYTE *d = dst;
+
+	while (src < end) {
+		BYTE c;
+		if (!st->count && !st->padding) {
+			size_t n = K->b64dec(src, end-src, d);
+			src += n;
+			d += n / 4 * 3;
+			if (src == end)
+				break;
+		}
+		c = b64dec[(BYTE)*src++];
+		if (c < 64) {
+			if (st->padding)
+				return FALSE;
+			st->bits = (st->bits << 6) | c;
+			if (++st->count == 4) {
+				*d++ = (BYTE)(st->bits >> 16);
+				*d++ = (BYTE)(st->bits >> 8);
+				*d++ = (BYTE)st->bits;
+				st->bits = st->count = 0;
+			}
+		} else if (c == PAD) {
+			//--- padding : 1 means a second '=' is expected, 2 means the data is complete
+			if (st->padding == 1)
+				st->padding = 2;
+			else if (st->padding || st->count < 2)
+				return FALSE;
+			else {
+				*d++ = (BYTE)(st->bits >> (st->count == 2 ? 4 : 10));
+				if (st->count == 3)
+					*d++ = (BYTE)(st->bits >> 2);
+				st->padding = st->count == 2 ? 1 : 2;
+				st->bits = st->count = 0;
+			}
+		} else if (c != SPACE)
+			return FALSE;
+	}
+	*written = d - dst;
+	return TRUE;
+}
+
+//--- Flush unpadded remaining characters to dst (up to 2 bytes). Returns FALSE on truncated input
+BOOL base64_decode_end(CodecState *st, BYTE *dst, size_t *written) {
+	BYTE *d = dst;
+
+	if (st->count == 1)
+		return FALSE;
+	if (st->count) {
+		*d++ = (BYTE)(st->bits >> (st->count == 2 ? 4 : 10));
+		if (st->count == 3)
+			*d++ = (BYTE)(st->bits >> 2);
+	}
+	st->bits = st->count = st->padding = 0;
+	*written = d - dst;
+	return TRUE;
+}
+
+//-------------------------------------[ Hexadecimal ]
+
+//--- Encode len bytes to dst, that must hold 2*len characters (uppercase digits)
+size_t hex_encode(const BYTE *src, size_t len, char *dst) {
+	return 2 * K->hexenc(src, len, dst);
+}
+
+//--- Decode len characters to dst, that must hold hex_decoded_size(len) bytes
+//--- An odd remaining digit is kept in the state for the next call. Returns FALSE on invalid input
+BOOL hex_decode(CodecState *st, const char *src, size_t len, BYTE *dst, size_t *written) {
+	BYTE *d = dst;
+	size_t n;
+	int v;
+
+	if (st->count && len) {
+		if ((v = hexvalue((BYTE)*src++)) < 0)
+			return FALSE;
+		*d++ = (BYTE)((st->bits << 4) | v);
+		st->count = 0;
+		len--;
+	}
+	n = K->hexdec(src, len, d);
+	d += n / 2;
+	src += n;
+	len -= n;
+	if (len == 1 && (v = hexvalue((BYTE)*src)) >= 0) {
+		st->bits = v;
+		st->count = 1;
+	} else if (len)
+		return FALSE;
+	*written = d - dst;
+	return TRUE;
+}
+
+//--- Returns FALSE if an odd number of digits has been decoded
+BOOL hex_decode_end(CodecState *st) {
+	BOOL complete = !st->count;
+	st->bits = st->count = 0;
+	return complete;
+}
@@ -25,6 +25,8 @@
 #include <lua\lauxlib.h>
 #include <lua\lualib.h>
 
+#include "lrtapi.h"
+
 
 /*
 ** maximum number of captures that a pattern can do during
@@ -477,25 +479,10 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+/* LuaRT: plain searches use the shared substring search engine */
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
-  if (l2 == 0) return s1;  /* empty strings are everywhere */
-  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
-  else {
-    const char *init;  /* to search for a '*s2' inside 's1' */
-    l2--;  /* 1st char will be checked by 'memchr' */
-    l1 = l1-l2;  /* 's2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= init-s1;
-        s1 = init;
-      }
-    }
-    return NULL;  /* not found */
-  }
+  return mem_find(s1, l1, s2, l2);
 }
 
 
@@ -0,0 +1,96 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | search.c | LuaRT substring search engine
+*/
+
+#define LUA_LIB
+
+#include "lrtapi.h"
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define SEARCH_SSE2
+	#include <emmintrin.h>
+#endif
+
+#ifdef SEARCH_SSE2
+
+static int lowestbit(unsigned int mask) {
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, mask);
+	return (int)i;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+//--- Compares the first and last bytes of the needle against 16 candidate positions at once,
+//--- only the candidates matching both are checked with memcmp()
+static const char *find_sse2(const char *s, size_t len, const char *needle, size_t nlen) {
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[nlen-1]);
+	size_t i = 0, end = len - nlen + 1;
+
+	for (; end - i >= 16; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(s+i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s+i+nlen-1));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			int bit = lowestbit(mask);
+			if (!memcmp(s+i+bit+1, needle+1, nlen-2))
+				return s+i+bit;
+			mask &= mask - 1;
+		}
+	}
+	for (; i < end; i++)
+		if (s[i] == needle[0] && s[i+nlen-1] == needle[nlen-1] && !memcmp(s+i+1, needle+1, nlen-2))
+			return s+i;
+	return NULL;
+}
+
+#else
+
+//--- Boyer-Moore-Horspool : skips up to nlen bytes at each mismatch
+static const char *find_horspool(const char *s, size_t len, const char *needle, size_t nlen) {
+	size_t skip[256], i, last = nlen - 1;
+	const unsigned char *h = (const unsigned char *)s;
+
+	for (i = 0; i < 256; i++)
+		skip[i] = nlen;
+	for (i = 0; i < last; i++)
+		skip[(unsigned char)needle[i]] = last - i;
+	for (i = 0; i + last < len; i += skip[h[i+last]])
+		if (h[i+last] == (unsigned char)needle[last] && !memcmp(s+i, needle, last))
+			return s+i;
+	return NULL;
+}
+
+#endif
+
+//--- Returns the first occurrence of needle in s, or NULL if not found
+const char *mem_find(const char *s, size_t len, const char *needle, size_t nlen) {
+	if (nlen == 0)
+		return s;
+	if (nlen > len)
+		return NULL;
+	if (nlen == 1)
+		return (const char *)memchr(s, needle[0], len);
+#ifdef SEARCH_SSE2
+	return find_sse2(s, len, needle, nlen);
+#else
+	return find_horspool(s, len, needle, nlen);
+#endif
+}
+
+//--- Same as mem_find(), but only returns occurrences starting on a UTF8 character boundary
+const char *utf8_find(const char *s, size_t len, const char *needle, size_t nlen) {
+	const char *end = s + len, *found;
+
+	while ((found = mem_find(s, end-s, needle, nlen)) && found < end && (((unsigned char)*found & 0xC0) == 0x80))
+		s = found + 1;
+	return found;
+}
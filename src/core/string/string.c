@@ -23,6 +23,7 @@
 
 #include "lrtapi.h"
 #include <luart.h>
+#include <Buffer.h>
 
 /* macro to 'unsign' a character */
 #define uchar(c)	((unsigned char)(c))
@@ -59,15 +60,7 @@ int utf8_fromcodepoint(char *utf8, UINT32 codepoint) {
 #define ONEMASK ((size_t)(-1) / 0xFF)
 
 size_t utf8_len(const char *s, size_t l) {
-	size_t len = 0, cp;
-	l = l == 0 ? strlen(s) : l;
-	while (l) {
-		cp = utf8_charsize(s);
-		s += cp;
-		l -= cp;
-		len++;
-	}
-	return len;
+	return utf8_count(s, l == 0 ? strlen(s) : l);
 }
 
 #define utf8_next(s) (s+utf8_charsize(s))
@@ -105,6 +98,108 @@ const char *utf8_pos(const void *str, size_t pos) {
   return (const char *)s;
 }
 
+// ------------------------------------------------------------------------ UTF8 index cache
+
+//--- Large strings get a side index to convert character positions to byte offsets without walking them from the start
+#define UINDEX_MINSIZE	1024		//--- smaller strings are always walked
+#define UINDEX_STEP		64			//--- number of characters between two checkpoints
+
+typedef struct {
+	size_t		size;
+	size_t		len;			//--- length in characters
+	BOOL		ascii;			//--- pure ASCII strings use byte offsets directly
+	size_t		*checkpoints;	//--- byte offset of every UINDEX_STEP characters
+} UIndex;
+
+static const char UINDEX_KEY = 'u';
+
+static int UIndex_gc(lua_State *L) {
+	free(((UIndex *)lua_touserdata(L, 1))->checkpoints);
+	return 0;
+}
+
+//--- Indexes are kept in a weak valued table keyed by the string address, and are dropped once collected
+//--- (strings are never removed from weak keyed tables, so each index references its string instead)
+static void uindex_cache(lua_State *L) {
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &UINDEX_KEY) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "v");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &UINDEX_KEY);
+	}
+}
+
+static void uindex_build(UIndex *u, const char *s, size_t size) {
+	size_t offset = utf8_ascii(s, size), len, count;
+
+	if ((u->ascii = (offset == size))) {
+		u->len = size;
+		return;
+	}
+	len = utf8_count(s, size);
+	u->checkpoints = (size_t *)malloc((len/UINDEX_STEP + 1) * sizeof(size_t));
+	for (count = 0; count*UINDEX_STEP <= offset; count++)
+		u->checkpoints[count] = count*UINDEX_STEP;
+	for (offset = u->checkpoints[count-1]; count*UINDEX_STEP <= len; count++)
+		u->checkpoints[count] = (offset = utf8_lpos(s+offset, size-offset, UINDEX_STEP) - s);
+	u->len = len;
+}
+
+//--- Get the index of the string argument #1, or NULL for small strings
+//--- The index is left on the stack above the nargs arguments of the caller, so that it cannot be collected while in use
+static UIndex *uindex(lua_State *L, int nargs, const char *s, size_t size) {
+	UIndex *u;
+
+	if (size < UINDEX_MINSIZE)
+		return NULL;
+	if (lua_gettop(L) < nargs)
+		lua_settop(L, nargs);
+	uindex_cache(L);
+	//--- an index references its string, so a live index at the same address is the index of this string
+	if (lua_rawgetp(L, -1, s) == LUA_TUSERDATA && (u = (UIndex *)lua_touserdata(L, -1))->size == size) {
+		lua_remove(L, -2);
+		return u;
+	}
+	lua_pop(L, 1);
+	u = (UIndex *)lua_newuserdatauv(L, sizeof(UIndex), 1);
+	memset(u, 0, sizeof(UIndex));
+	if (luaL_newmetatable(L, "UIndex")) {
+		lua_pushcfunction(L, UIndex_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	uindex_build(u, s, size);
+	u->size = size;
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, -2, 1);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, -3, s);
+	lua_remove(L, -2);
+	return u;
+}
+
+//--- Get the byte offset of the character at position pos (starting from 0), or the end of the string if out of range
+static const char *uindex_pos(UIndex *u, const char *s, size_t size, size_t pos) {
+	const char *end = s + size;
+
+	if (!u)
+		return utf8_lpos(s, size, pos);
+	if (pos >= u->len)
+		return end;
+	if (u->ascii)
+		return s + pos;
+	s += u->checkpoints[pos / UINDEX_STEP];
+	return utf8_lpos(s, end-s, pos % UINDEX_STEP);
+}
+
+static size_t uindex_len(UIndex *u, const char *s, size_t size) {
+	return u ? u->len : utf8_len(s, size);
+}
+
 /* ------------------------------------------------------------------------ */
 
 /*
@@ -129,7 +224,7 @@ const char *utf8_pos(const void *str, size_t pos) {
 static int str_len(lua_State *L) {
 	size_t len;
 	const char *str = luaL_checklstring(L, 1, &len);
-	lua_pushinteger(L, (lua_Integer)utf8_len(str, len));
+	lua_pushinteger(L, (lua_Integer)uindex_len(uindex(L, 1, str, len), str, len));
 	return 1;
 }
 
@@ -173,14 +268,15 @@ size_t getendpos (lua_State *L, int arg, lua_Integer def,
 static int str_sub (lua_State *L) {
   size_t len;
   const char *str, *s = luaL_checklstring(L, 1, &len);
-  size_t l = utf8_len(s, len);
+  UIndex *u = uindex(L, 3, s, len);
+  size_t l = uindex_len(u, s, len);
   size_t start;
   size_t end;
   start = posrelatI(luaL_checkinteger(L, 2), l);
   end = getendpos(L, 3, -1, l);
   if (start <= end) {
-	  str = utf8_pos(s, start - 1);
-	lua_pushlstring(L, str, utf8_pos(str, (end - start) + 1)-str);
+	str = uindex_pos(u, s, len, start - 1);
+	lua_pushlstring(L, str, (u ? uindex_pos(u, s, len, end) : utf8_lpos(str, len-(str-s), (end - start) + 1))-str);
   }
   else lua_pushliteral(L, "");
   return 1;
@@ -265,14 +361,18 @@ static int str_rep (lua_State *L) {
 
 static int str_byte(lua_State *L) {
 	size_t l;
-	const char *str = luaL_checklstring(L, 1, &l);
-	size_t len = utf8_len(str, l);
+	const char *s = luaL_checklstring(L, 1, &l), *str;
+	UIndex *u = uindex(L, 3, s, l);
+	size_t len = uindex_len(u, s, l);
 	lua_Integer pi = luaL_optinteger(L, 2, 1);
 	size_t start = posrelatI(pi, len)-1;
 	size_t stop = getendpos(L, 3, pi, len);
 	size_t i, size = 0, n = lua_gettop(L);
-	str = utf8_pos(str, start);
-	lua_checkstack(L, utf8_pos(str, stop)-str);
+	if (start < stop) {
+		str = uindex_pos(u, s, l, start);
+		if (!lua_checkstack(L, (int)(uindex_pos(u, s, l, stop)-str)))
+			luaL_error(L, "string slice too long");
+	}
 	while (start++ < stop) {
 		str += size;
 		size = utf8_charsize(str);
@@ -300,26 +400,68 @@ static int str_search(lua_State *L) {
 	size_t nlen, len;
 	const char *str = luaL_checklstring(L, 1, &len);
 	const char *needle = luaL_checklstring(L, 2, &nlen);
-	lua_Integer pi = luaL_optinteger(L, 3, 1);
-	size_t start = posrelatI(pi, len)-1;
-	const char *result;
-	lua_Integer i = 0;
-
-	if ((result = strstr(utf8_pos(str, start), needle))) {
-		UINT32 cp;
-		while (str != result) {
-			i++;
-			cp = utf8_charsize(str);
-			str += cp;
-		}
-		lua_pushinteger(L, i+1);
-		lua_pushinteger(L, i+utf8_len(needle, nlen));
+	UIndex *u = uindex(L, 3, str, len);
+	size_t start = posrelatI(luaL_optinteger(L, 3, 1), uindex_len(u, str, len))-1;
+	const char *from, *result;
+
+	//--- an empty needle still matches right after the last character
+	if (start > uindex_len(u, str, len)) {
+		luaL_pushfail(L);
+		return 1;
+	}
+	from = uindex_pos(u, str, len, start);
+	if ((result = utf8_find(from, len-(from-str), needle, nlen))) {
+		start += utf8_count(from, result-from);
+		lua_pushinteger(L, start+1);
+		lua_pushinteger(L, start+utf8_count(needle, nlen));
 		return 2;
 	}
 	luaL_pushfail(L);
 	return 1;
 }
 
+//--- upvalues : string, needle, byte offset and character position of the next search
+static int gsearch_iter(lua_State *L) {
+	size_t len, nlen, offset = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+	lua_Integer pos = lua_tointeger(L, lua_upvalueindex(4));
+	const char *str = lua_tolstring(L, lua_upvalueindex(1), &len);
+	const char *needle = lua_tolstring(L, lua_upvalueindex(2), &nlen);
+	const char *result;
+	size_t count;
+
+	if (offset > len || !(result = utf8_find(str+offset, len-offset, needle, nlen)))
+		return 0;
+	pos += utf8_count(str+offset, result-(str+offset));
+	count = utf8_count(needle, nlen);
+	lua_pushinteger(L, pos+1);
+	lua_pushinteger(L, pos+count);
+	//--- an empty needle matches once at each character position, and at the end of the string
+	if (!nlen) {
+		count = result < str+len ? 1 : 0;
+		nlen = result < str+len ? utf8_charsize(result) : 1;
+	}
+	lua_pushinteger(L, (lua_Integer)(result-str+nlen));
+	lua_replace(L, lua_upvalueindex(3));
+	lua_pushinteger(L, pos+count);
+	lua_replace(L, lua_upvalueindex(4));
+	return 2;
+}
+
+static int str_gsearch(lua_State *L) {
+	size_t len;
+	const char *str = luaL_checklstring(L, 1, &len);
+	UIndex *u = uindex(L, 3, str, len);
+	size_t start = posrelatI(luaL_optinteger(L, 3, 1), uindex_len(u, str, len))-1;
+	lua_Integer offset = (lua_Integer)(uindex_pos(u, str, len, start)-str);
+
+	luaL_checkstring(L, 2);
+	lua_settop(L, 2);
+	lua_pushinteger(L, offset);
+	lua_pushinteger(L, (lua_Integer)start);
+	lua_pushcclosure(L, gsearch_iter, 4);
+	return 1;
+}
+
 static int str_similarity(lua_State *L) {
 	size_t l1, l2;
   int len;
@@ -485,19 +627,22 @@ static int arith_unm (lua_State *L) {
   return arith(L, LUA_OPUNM, "__unm");
 }
 
+//--- the second upvalue holds the byte offset of the next character
 static int str_iter(lua_State *L) {
-	int len, result = 0;
-	wchar_t *str = lua_tolwstring(L, lua_upvalueindex(1), &len);
-	lua_Integer pos = lua_tointeger(L, lua_upvalueindex(2));
+	size_t len, size;
+	const char *str = lua_tolstring(L, lua_upvalueindex(1), &len);
+	size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(2));
 	
 	if (pos < len) { 
-		lua_pushinteger(L, pos+1);
+		size = utf8_charsize((str+pos));
+		if (size > len-pos)
+			size = len-pos;
+		lua_pushinteger(L, (lua_Integer)(pos+size));
 		lua_replace(L, lua_upvalueindex(2));
-		lua_pushlwstring(L, str+pos, 1);
-		result = 1;
+		lua_pushlstring(L, str+pos, size);
+		return 1;
 	}
-  free(str);
-	return result;	
+	return 0;	
 }
 
 static int str_iterate(lua_State *L) {
@@ -536,10 +681,36 @@ static const luaL_Reg stringmetamethods[] = {
 #define CAP_POSITION	(-2)
 
 
+/*
+** Patterns are parsed once into a sequence of items (see COMPILED PATTERNS
+** below). Single character classes ('.', '%x' and '[set]') are tested on
+** the first byte of the subject character, and are compiled to the set of
+** bytes they match.
+*/
+#define PI_END		0	/* end of pattern */
+#define PI_CHAR		1	/* literal character */
+#define PI_SET		2	/* single character class */
+#define PI_OPEN		3	/* '(' or position capture '()' */
+#define PI_CLOSE	4	/* ')' */
+#define PI_EOS		5	/* '$' at the end of the pattern */
+#define PI_BALANCE	6	/* '%bxy' */
+#define PI_FRONTIER	7	/* '%f[set]' */
+#define PI_BACKREF	8	/* '%1' to '%9' */
+
+typedef struct PItem {
+  unsigned char op;  /* PI_xxx kind of item */
+  unsigned char rep;  /* PI_CHAR and PI_SET suffix : '*', '+', '-', '?' or 0 */
+  unsigned char len;  /* literal size, capture digit or position capture flag */
+  char lit[4];  /* literal character, or '%b' delimiters */
+  unsigned char set[32];  /* PI_SET and PI_FRONTIER matching bytes */
+} PItem;
+
+#define inset(set, c)	((set)[(c) >> 3] & (1 << ((c) & 7)))
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
-  const char *p_end;  /* end ('\0') of pattern */
   lua_State *L;
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
   unsigned char level;  /* total number of captures (finished or unfinished) */
@@ -551,7 +722,7 @@ typedef struct MatchState {
 
 
 /* recursive function */
-static const char *match (MatchState *ms, const char *s, const char *p);
+static const char *match (MatchState *ms, const char *s, const PItem *p);
 
 
 /* maximum recursion depth for 'match' */
@@ -580,32 +751,6 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
-  const char *n = utf8_next(p);
-  switch (*p) {
-    case L_ESC: {
-      if (*n == '\0')
-        luaL_error(ms->L, "malformed pattern (ends with '%%')");
-      return utf8_next(n);
-    }
-    case '[': {
-      if (*n == '^') n = utf8_next(n);
-      do {  /* look for a ']' */
-        if (n == ms->p_end)
-          luaL_error(ms->L, "malformed pattern (missing ']')");
-	    p = n;
-		n = utf8_next(p);
-		if (*p == L_ESC && *n != '\0')
-          n = utf8_next(n);  /* skip escapes (e.g. '%]') */
-      } while (*n != ']');
-      return utf8_next(n);
-    }
-    default: {
-      return n;
-    }
-  }
-}
-
 const UINT8 char_bits[257] = {
   0,
   1,  1,  1,  1,  1,  1,  1,  1,  1,  3,  3,  3,  3,  3,  1,  1,
@@ -688,29 +833,20 @@ static int matchbracketclass (int c, const char *p, const char *ec) {
 }
 
 
-static int singlematch (MatchState *ms, const char *s, const char *p,
-                        const char *ep) {
+static int singlematch (MatchState *ms, const char *s, const PItem *p) {
   if (s >= ms->src_end)
     return 0;
-  else {
-	  int c = uchar(*s);
-	  switch (*p) {
-		case '.': return 1;  /* matches any char */
-		case L_ESC: return match_class(c, uchar(*(utf8_next(p))));
-		case '[': return matchbracketclass(c, p, utf8_prev(ep));
-		default: return utf8_charcmp(s, p);
-	  }
-  }
+  if (p->op == PI_CHAR)
+    return utf8_charcmp(s, p->lit);
+  return inset(p->set, uchar(*s));
 }
 
 
-static const char *matchbalance (MatchState *ms, const char *s, const char *p) {
-  if (p >= ms->p_end - 1)
-    luaL_error(ms->L, "malformed pattern (missing arguments to '%%b')");
-  if (*s != *p) return NULL;
-else {
-    int b = *p;
-    int e = *(utf8_next(p));
+static const char *matchbalance (MatchState *ms, const char *s, const PItem *p) {
+  if (*s != p->lit[0]) return NULL;
+  else {
+    int b = p->lit[0];
+    int e = p->lit[1];
     int cont = 1;
     while ((s = utf8_next(s)) < ms->src_end) {
       if (*s == e) {
@@ -724,14 +860,18 @@ else {
 }
 
 
-static const char *max_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+static const char *max_expand (MatchState *ms, const char *s, const PItem *p) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
-  while (singlematch(ms, utf8_pos(s,  i), p, ep))
+  const char *e = s;
+  int bytes;
+  while (singlematch(ms, e, p)) {
+    e = utf8_next(e);
     i++;
+  }
+  bytes = (e - s == i);  /* only single byte characters matched? */
   /* keeps trying to match with the maximum repetitions */
   while (i>=0) {
-    const char *res = match(ms, utf8_pos(s, i), utf8_next(ep));
+    const char *res = match(ms, bytes ? s + i : utf8_pos(s, i), p + 1);
     if (res) return res;
     i--;  /* else didn't match; reduce 1 repetition to try again */
   }
@@ -739,13 +879,12 @@ static const char *max_expand (MatchState *ms, const char *s,
 }
 
 
-static const char *min_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+static const char *min_expand (MatchState *ms, const char *s, const PItem *p) {
   for (;;) {
-    const char *res = match(ms, s, utf8_next(ep));
+    const char *res = match(ms, s, p + 1);
     if (res != NULL)
       return res;
-    else if (singlematch(ms, s, p, ep))
+    else if (singlematch(ms, s, p))
       s = utf8_next(s);  /* try with one more repetition */
     else return NULL;
   }
@@ -753,7 +892,7 @@ static const char *min_expand (MatchState *ms, const char *s,
 
 
 static const char *start_capture (MatchState *ms, const char *s,
-                                    const char *p, int what) {
+                                    const PItem *p, int what) {
   const char *res;
   int level = ms->level;
   if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
@@ -767,7 +906,7 @@ static const char *start_capture (MatchState *ms, const char *s,
 
 
 static const char *end_capture (MatchState *ms, const char *s,
-                                  const char *p) {
+                                  const PItem *p) {
   int l = capture_to_close(ms);
   const char *res;
   ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
@@ -788,135 +927,87 @@ static const char *match_capture (MatchState *ms, const char *s, int l) {
 }
 
 
-static const char *match (MatchState *ms, const char *s, const char *p) {
-  const char *n;
+static const char *match (MatchState *ms, const char *s, const PItem *p) {
   if (ms->matchdepth-- == 0)
     luaL_error(ms->L, "pattern too complex");
   init: /* using goto's to optimize tail recursion */
-  if (p != ms->p_end) {  /* end of pattern? */
-	n = utf8_next(p);
-    switch (*p) {
-      case '(': {  /* start capture */
-        if (*n == ')')  /* position capture? */
-          s = start_capture(ms, s, utf8_next(n), CAP_POSITION);
-        else
-          s = start_capture(ms, s, n, CAP_UNFINISHED);
-        break;
+  switch (p->op) {
+    case PI_END:  /* end of pattern */
+      break;
+    case PI_OPEN: {  /* start capture */
+      s = start_capture(ms, s, p + 1, p->len ? CAP_POSITION : CAP_UNFINISHED);
+      break;
+    }
+    case PI_CLOSE: {  /* end capture */
+      s = end_capture(ms, s, p + 1);
+      break;
+    }
+    case PI_EOS: {  /* check end of string */
+      s = (s == ms->src_end) ? s : NULL;
+      break;
+    }
+    case PI_BALANCE: {  /* balanced string */
+      s = matchbalance(ms, s, p);
+      if (s != NULL) {
+        p++; goto init;  /* return match(ms, s, p + 1); */
+      }  /* else fail (s == NULL) */
+      break;
+    }
+    case PI_FRONTIER: {
+      int previous = (s == ms->src_init) ? '\0' : uchar(*utf8_prev(s));
+      if (!inset(p->set, previous) && inset(p->set, uchar(*s))) {
+        p++; goto init;  /* return match(ms, s, p + 1); */
       }
-      case ')': {  /* end capture */
-        s = end_capture(ms, s, n);
-        break;
+      s = NULL;  /* match failed */
+      break;
+    }
+    case PI_BACKREF: {  /* capture results (%1-%9) */
+      s = match_capture(ms, s, p->len);
+      if (s != NULL) {
+        p++; goto init;  /* return match(ms, s, p + 1) */
       }
-      case '$': {
-        if (n != ms->p_end)  /* is the '$' the last char in pattern? */
-          goto dflt;  /* no; go to default */
-        s = (s == ms->src_end) ? s : NULL;  /* check end of string */
-        break;
+      break;
+    }
+    default: {  /* pattern class plus optional suffix */
+      /* does not match at least once? */
+      if (!singlematch(ms, s, p)) {
+        if (p->rep == '*' || p->rep == '?' || p->rep == '-') {  /* accept empty? */
+          p++; goto init;  /* return match(ms, s, p + 1); */
+        }
+        else  /* '+' or no suffix */
+          s = NULL;  /* fail */
       }
-      case L_ESC: {  /* escaped sequences not in the format class[*+?-]? */
-        switch (*n) {
-          case 'b': {  /* balanced string? */
-            s = matchbalance(ms, s, utf8_nexti(p, 2));
-            if (s != NULL) {
-              p = utf8_nexti(p, 4); goto init;  /* return match(ms, s, p + 4); */
-            }  /* else fail (s == NULL) */
-            break;
-          }
-          case 'f': {  /* frontier? */
-            const char *ep; char previous;
-            p = utf8_nexti(p, 2);
-            if (*p != '[')
-              luaL_error(ms->L, "missing '[' after '%%f' in pattern");
-            ep = classend(ms, p);  /* points to what is next */
-            previous = (s == ms->src_init) ? '\0' : *utf8_prev(s);
-            if (!matchbracketclass(uchar(previous), p, utf8_prev(ep)) &&
-               matchbracketclass(uchar(*s), p, utf8_prev(ep))) {
-              p = ep; goto init;  /* return match(ms, s, ep); */
+      else {  /* matched once */
+        switch (p->rep) {  /* handle optional suffix */
+          case '?': {  /* optional */
+            const char *res;
+            if ((res = match(ms, utf8_next(s), p + 1)) != NULL)
+              s = res;
+            else {
+              p++; goto init;  /* else return match(ms, s, p + 1); */
             }
-            s = NULL;  /* match failed */
             break;
           }
-		  default:
-			  if (char_isdigit(uchar(*utf8_next(p)))) {  /* capture results (%0-%9)? */
-				 s = match_capture(ms, s, uchar(*(utf8_next(p))));
-				if (s != NULL) {
-					p = utf8_nexti(p, 2); goto init;  /* return match(ms, s, p + 2) */
-				}
-			  }
-			  goto dflt;
-		}
-        break;
-      }
-      default: dflt: {  /* pattern class plus optional suffix */
-        const char *ep = classend(ms, p);  /* points to optional suffix */
-        /* does not match at least once? */
-        if (!singlematch(ms, s, p, ep)) {
-          if (*ep == '*' || *ep == '?' || *ep == '-') {  /* accept empty? */
-            p = utf8_next(ep); goto init;  /* return match(ms, s, ep + 1); */
-          }
-          else  /* '+' or no suffix */
-            s = NULL;  /* fail */
-        }
-        else {  /* matched once */
-          switch (*ep) {  /* handle optional suffix */
-            case '?': {  /* optional */
-              const char *res;
-              if ((res = match(ms, utf8_next(s), utf8_next(ep))) != NULL)
-                s = res;
-              else {
-                p = utf8_next(ep); goto init;  /* else return match(ms, s, ep + 1); */
-              }
-              break;
-            }
-            case '+':  /* 1 or more repetitions */
-              s = utf8_next(s);  /* 1 match already done */
-              /* FALLTHROUGH */
-            case '*':  /* 0 or more repetitions */
-              s = max_expand(ms, s, p, ep);
-              break;
-            case '-':  /* 0 or more repetitions (minimum) */
-              s = min_expand(ms, s, p, ep);
-              break;
-            default:  /* no suffix */
-              s = utf8_next(s); p = ep; goto init;  /* return match(ms, s + 1, ep); */
-          }
+          case '+':  /* 1 or more repetitions */
+            s = utf8_next(s);  /* 1 match already done */
+            /* FALLTHROUGH */
+          case '*':  /* 0 or more repetitions */
+            s = max_expand(ms, s, p);
+            break;
+          case '-':  /* 0 or more repetitions (minimum) */
+            s = min_expand(ms, s, p);
+            break;
+          default:  /* no suffix */
+            s = utf8_next(s); p++; goto init;  /* return match(ms, s + 1, p + 1); */
         }
-        break;
       }
+      break;
     }
   }
   ms->matchdepth++;
   return s;
 }
 
-static size_t cmp(const char *s1, const char *s2) {
-	while (*s1 && *s2) {
-		if (!utf8_charcmp(s1, s2))
-			return 0;
-		s1 = utf8_next(s1);
-		s2 = utf8_next(s2);
-	}
-	return *s2 == 0;
-}
-
-static size_t utf8_find (const char *s1, const char *s2, size_t l2, const char *result) {
-  size_t pos = 0;
-  if (l2 == 0) {
-	  result = s1;
-	  return 1;  /* empty strings are everywhere */
-  }
-  else if (l2 >  utf8_len(s1, 0)) return 0;  /* avoids a negative 'l1' */
-  else 
-	  while(*s1 && *s2) {
-		if (cmp(s1, s2))
-			return ++pos;
-		s1 = utf8_next(s1);
-		pos++;
-  }
-  return 0;  /* not found */
-}
-
-
 /*
 ** get information about the i-th capture. If there are no captures
 ** and 'i==0', return information about the whole match, which
@@ -980,12 +1071,11 @@ static int nospecials (const char *p, size_t l) {
 
 
 static void prepstate (MatchState *ms, lua_State *L,
-                       const char *s, size_t ls, const char *p, size_t lp) {
+                       const char *s, size_t ls) {
   ms->L = L;
   ms->matchdepth = MAXCCALLS;
   ms->src_init = s;
   ms->src_end = s + ls;
-  ms->p_end = p + lp;
 }
 
 
@@ -995,41 +1085,362 @@ static void reprepstate (MatchState *ms) {
 }
 
 
-static int str_find_aux (lua_State *L, int find) {
-  size_t ls, lp;
-  const char *s = luaL_checklstring(L, 1, &ls);
-  const char *p = luaL_checklstring(L, 2, &lp);
+/*
+** {======================================================
+** COMPILED PATTERNS
+** =======================================================
+*/
+
+#define PATTERN_PREFIX	32		/* maximum literal prefix length */
+#define PATTERN_CACHED	16		/* number of compiled patterns kept in the cache */
+
+/*
+** Compiled pattern, a userdata followed by its items, with the pattern
+** string as uservalue
+*/
+typedef struct CPattern {
+  const char *p;  /* pattern, including the anchor */
+  size_t lp;
+  int anchor;  /* pattern starts with '^' */
+  int plain;  /* no special characters */
+  const PItem *items;  /* items after the anchor */
+  const PItem *gitems;  /* items for 'gmatch', where '^' is a literal character */
+  size_t lprefix;  /* literal bytes any match (after the anchor) starts with */
+  char prefix[PATTERN_PREFIX];
+} CPattern;
+
+
+/* next pattern character, without going past the end of the pattern */
+static const char *pattern_next (const char *p, const char *end) {
+  p += utf8_charsize(p);
+  return p > end ? end : p;
+}
+
+
+static const char *pattern_classend (lua_State *L, const char *p, const char *end) {
+  const char *n = pattern_next(p, end);
+  switch (*p) {
+    case L_ESC: {
+      if (n == end)
+        luaL_error(L, "malformed pattern (ends with '%%')");
+      return pattern_next(n, end);
+    }
+    case '[': {
+      if (n < end && *n == '^') n = pattern_next(n, end);
+      do {  /* look for a ']' */
+        if (n == end)
+          luaL_error(L, "malformed pattern (missing ']')");
+        p = n;
+        n = pattern_next(p, end);
+        if (*p == L_ESC && n < end)
+          n = pattern_next(n, end);  /* skip escapes (e.g. '%]') */
+      } while (n == end || *n != ']');
+      return n + 1;
+    }
+    default: {
+      return n;
+    }
+  }
+}
+
+
+/* single character class item from 'p' to 'ep' */
+static void pattern_single (PItem *item, const char *p, const char *ep) {
+  int c, count = 0, last = 0;
+  item->op = PI_SET;
+  for (c = 0; c < 256; c++) {
+    int in;
+    switch (*p) {
+      case '.': in = 1; break;
+      case L_ESC: in = match_class(c, uchar(p[1])); break;
+      case '[': in = matchbracketclass(c, p, ep - 1); break;
+      default: {  /* literal character */
+        size_t size = utf8_charsize(p);
+        item->op = PI_CHAR;
+        item->len = (unsigned char)size;
+        memcpy(item->lit, p, (size_t)(ep - p) < size ? (size_t)(ep - p) : size);
+        return;
+      }
+    }
+    if (in) {
+      item->set[c >> 3] |= 1 << (c & 7);
+      count++;
+      last = c;
+    }
+  }
+  /* a class matching only one byte that is not a lead byte is a literal */
+  if (count == 1 && last < 0xC0) {
+    item->op = PI_CHAR;
+    item->len = 1;
+    item->lit[0] = (char)last;
+  }
+}
+
+
+/*
+** Parses the pattern from 'p' to 'end' into 'items' (if not NULL), and
+** returns the number of items, including the PI_END item.
+*/
+static size_t pattern_parse (lua_State *L, const char *p, const char *end, PItem *items) {
+  size_t n = 0;
+  while (p < end) {
+    const char *next = pattern_next(p, end);
+    PItem item;
+    memset(&item, 0, sizeof(PItem));
+    switch (*p) {
+      case '(': {
+        item.op = PI_OPEN;
+        if (next < end && *next == ')') {  /* position capture? */
+          item.len = 1;
+          next++;
+        }
+        p = next;
+        goto add;
+      }
+      case ')': {
+        item.op = PI_CLOSE;
+        p = next;
+        goto add;
+      }
+      case '$': {
+        if (next != end)  /* is the '$' the last char in pattern? */
+          break;  /* no; a class */
+        item.op = PI_EOS;
+        p = next;
+        goto add;
+      }
+      case L_ESC: {
+        if (next == end)
+          luaL_error(L, "malformed pattern (ends with '%%')");
+        if (*next == 'b') {  /* balanced string? */
+          const char *b = next + 1, *e;
+          if (b >= end - 1)
+            luaL_error(L, "malformed pattern (missing arguments to '%%b')");
+          e = pattern_next(b, end);
+          if (e == end)
+            luaL_error(L, "malformed pattern (missing arguments to '%%b')");
+          item.op = PI_BALANCE;
+          item.lit[0] = *b;
+          item.lit[1] = *e;
+          p = pattern_next(e, end);
+          goto add;
+        }
+        if (*next == 'f') {  /* frontier? */
+          const char *ep;
+          int c;
+          p = next + 1;
+          if (p == end || *p != '[')
+            luaL_error(L, "missing '[' after '%%f' in pattern");
+          ep = pattern_classend(L, p, end);
+          item.op = PI_FRONTIER;
+          for (c = 0; c < 256; c++)
+            if (matchbracketclass(c, p, ep - 1))
+              item.set[c >> 3] |= 1 << (c & 7);
+          p = ep;
+          goto add;
+        }
+        if (char_isdigit(uchar(*next))) {  /* capture results (%0-%9)? */
+          item.op = PI_BACKREF;
+          item.len = uchar(*next);
+          p = next + 1;
+          goto add;
+        }
+        break;
+      }
+    }
+    {  /* pattern class plus optional suffix */
+      const char *ep = pattern_classend(L, p, end);
+      pattern_single(&item, p, ep);
+      if (ep < end && (*ep == '*' || *ep == '+' || *ep == '-' || *ep == '?'))
+        item.rep = *ep++;
+      p = ep;
+    }
+add:
+    if (items)
+      items[n] = item;
+    n++;
+  }
+  if (items)
+    memset(&items[n], 0, sizeof(PItem));  /* PI_END */
+  return n + 1;
+}
+
+
+/* compiles the pattern string at index idx, and pushes the compiled pattern */
+static CPattern *pattern_new (lua_State *L, int idx) {
+  size_t lp, n, gn = 0;
+  const char *p = luaL_checklstring(L, idx, &lp);
+  const char *end = p + lp;
+  int anchor = (*p == '^');
+  CPattern *cp;
+  PItem *items;
+  const PItem *item;
+  idx = lua_absindex(L, idx);
+  n = pattern_parse(L, p + anchor, end, NULL);
+  if (anchor)  /* 'gmatch' parses '^' as a literal character */
+    gn = pattern_parse(L, p, end, NULL);
+  cp = (CPattern *)lua_newuserdatauv(L, sizeof(CPattern) + (n + gn) * sizeof(PItem), 1);
+  lua_pushvalue(L, idx);
+  lua_setiuservalue(L, -2, 1);
+  items = (PItem *)(cp + 1);
+  pattern_parse(L, p + anchor, end, items);
+  if (anchor)
+    pattern_parse(L, p, end, items + n);
+  cp->p = p;
+  cp->lp = lp;
+  cp->anchor = anchor;
+  cp->plain = nospecials(p, lp);
+  cp->items = items;
+  cp->gitems = items + (anchor ? n : 0);
+  cp->lprefix = 0;
+  /* leading literal characters, up to the first optional one */
+  for (item = items; item->op == PI_CHAR && (!item->rep || item->rep == '+'); item++) {
+    if (cp->lprefix + item->len > PATTERN_PREFIX)
+      break;
+    memcpy(cp->prefix + cp->lprefix, item->lit, item->len);
+    cp->lprefix += item->len;
+    if (item->rep == '+')
+      break;
+  }
+  return cp;
+}
+
+
+/*
+** Returns the first position from 's' where the pattern may match, or NULL.
+** Anchored patterns can only match at 's'.
+*/
+static const char *pattern_skip (const CPattern *cp, const char *s,
+                                 const char *end, int anchor) {
+  if (!cp->lprefix)
+    return s;
+  if (anchor)
+    return ((size_t)(end - s) >= cp->lprefix &&
+            memcmp(s, cp->prefix, cp->lprefix) == 0) ? s : NULL;
+  return utf8_find(s, end - s, cp->prefix, cp->lprefix);
+}
+
+
+typedef struct PatternCache {
+  const CPattern *entries[PATTERN_CACHED];
+  ULONGLONG used[PATTERN_CACHED];
+  ULONGLONG clock;
+} PatternCache;
+
+static const char PATTERN_KEY = 'p';
+
+/*
+** Compiled patterns of pattern strings are kept in a LRU cache stored in
+** the registry, the cache uservalue keeping the compiled patterns alive.
+** Pushes the compiled pattern.
+*/
+static const CPattern *pattern_cached (lua_State *L, int idx) {
+  size_t lp;
+  const char *p = luaL_checklstring(L, idx, &lp);
+  PatternCache *c;
+  const CPattern *cp;
+  int i, slot = 0;
+  idx = lua_absindex(L, idx);
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, &PATTERN_KEY) == LUA_TUSERDATA)
+    c = (PatternCache *)lua_touserdata(L, -1);
+  else {
+    lua_pop(L, 1);
+    c = (PatternCache *)lua_newuserdatauv(L, sizeof(PatternCache), 1);
+    memset(c, 0, sizeof(PatternCache));
+    lua_createtable(L, PATTERN_CACHED, 0);
+    lua_setiuservalue(L, -2, 1);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &PATTERN_KEY);
+  }
+  lua_getiuservalue(L, -1, 1);
+  lua_remove(L, -2);
+  for (i = 0; i < PATTERN_CACHED; i++) {
+    if (c->entries[i] && c->entries[i]->p == p && c->entries[i]->lp == lp) {
+      c->used[i] = ++c->clock;
+      lua_rawgeti(L, -1, i + 1);
+      lua_remove(L, -2);
+      return c->entries[i];
+    }
+    if (c->used[i] < c->used[slot])
+      slot = i;
+  }
+  cp = pattern_new(L, idx);
+  c->entries[slot] = cp;
+  c->used[slot] = ++c->clock;
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, slot + 1);
+  lua_remove(L, -2);
+  return cp;
+}
+
+
+/* Pattern object */
+typedef struct {
+  luart_type type;
+  const CPattern *cp;
+  int ref;  /* compiled pattern reference */
+} Pattern;
+
+luart_type TPattern;
+
+/*
+** Get the compiled pattern at index idx, either a Pattern instance or a
+** pattern string. The compiled pattern is pushed to keep it alive while in use.
+*/
+static const CPattern *pattern_get (lua_State *L, int idx) {
+  Pattern *pat = (Pattern *)lua_iscinstance(L, idx, TPattern);
+  if (pat) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pat->ref);
+    return pat->cp;
+  }
+  return pattern_cached(L, idx);
+}
+
+/* }====================================================== */
+
+
+/*
+** Arguments after the subject and the pattern are always at index 3 and
+** above, both for the string functions and for the Pattern methods. The
+** pattern is at index 'pidx', the subject at index 'sidx'.
+*/
+static int find_aux (lua_State *L, int find, int sidx, int pidx) {
+  size_t ls;
+  const char *s = luaL_checklstring(L, sidx, &ls);
   size_t init = posrelatI(luaL_optinteger(L, 3, 1), utf8_len(s, ls))-1;
+  int plain = sidx == 1 && lua_toboolean(L, 4);
+  const CPattern *cp = pattern_get(L, pidx);
   if (init > ls) {  /* start after string's end? */
     luaL_pushfail(L);  /* cannot find anything */
     return 1;
   }
   /* explicit request or no special characters? */
-  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
+  if (find && (plain || cp->plain)) {
     /* do a plain search */
-	const char *result = NULL;
-    size_t pos = utf8_find(utf8_pos(s, init), p, utf8_len(p, lp), result);//utf8_find(utf8_pos(s, init), p, utf8_len(p, lp), result);
-    if (pos || result) {
-      lua_pushinteger(L, init + pos);
-      lua_pushinteger(L, init + pos + utf8_len(p, 0)-1); //0
+    const char *s1 = utf8_lpos(s, ls, init);
+    const char *s2 = utf8_find(s1, ls - (s1 - s), cp->p, cp->lp);
+    if (s2) {
+      size_t pos = init + utf8_count(s1, s2 - s1) + 1;
+      lua_pushinteger(L, pos);
+      lua_pushinteger(L, pos + utf8_count(cp->p, cp->lp) - 1);
       return 2;
     }
   }
   else {
     MatchState ms;
-    const char *s1 = utf8_pos(s, init);
-    int anchor = (*p == '^');
-    if (anchor) {
-      p++; lp--;  /* skip anchor character */
-    }
-    prepstate(&ms, L, s, ls, p, lp);
+    const char *s1 = utf8_lpos(s, ls, init);
+    int anchor = cp->anchor;
+    prepstate(&ms, L, s, ls);
     do {
       const char *res;
+      /* skip the positions that don't start with the pattern literal prefix */
+      if ((s1 = pattern_skip(cp, s1, ms.src_end, anchor)) == NULL)
+        break;
       reprepstate(&ms);
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=match(&ms, s1, cp->items)) != NULL) {
         if (find) {
-          lua_pushinteger(L, (s1 - s) + 1);  /* start */
-          lua_pushinteger(L, utf8_len(s, res - s));   /* end */
+          lua_pushinteger(L, utf8_count(s, s1 - s) + 1);  /* start */
+          lua_pushinteger(L, utf8_count(s, res - s));   /* end */
           return push_captures(&ms, NULL, 0) + 2;
         }
         else
@@ -1042,6 +1453,11 @@ static int str_find_aux (lua_State *L, int find) {
 }
 
 
+static int str_find_aux (lua_State *L, int find) {
+  return find_aux(L, find, 1, 2);
+}
+
+
 static int str_find (lua_State *L) {
   return str_find_aux(L, 1);
 }
@@ -1055,20 +1471,23 @@ static int str_match (lua_State *L) {
 /* state for 'gmatch' */
 typedef struct GMatchState {
   const char *src;  /* current position */
-  const char *p;  /* pattern */
   const char *lastmatch;  /* end of last match */
+  const CPattern *cp;  /* compiled pattern */
   MatchState ms;  /* match state */
 } GMatchState;
 
 
 static int gmatch_aux (lua_State *L) {
-  GMatchState *gm = (GMatchState *)lua_touserdata(L, lua_upvalueindex(3));
+  GMatchState *gm = (GMatchState *)lua_touserdata(L, lua_upvalueindex(4));
   const char *src;
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src = utf8_next(src)) {
     const char *e;
+    /* 'gmatch' has no anchor : '^' is a literal character there */
+    if (!gm->cp->anchor && (src = pattern_skip(gm->cp, src, gm->ms.src_end, 0)) == NULL)
+      break;
     reprepstate(&gm->ms);
-    if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
+    if ((e = match(&gm->ms, src, gm->cp->gitems)) != NULL && e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
       return push_captures(&gm->ms, src, e);
     }
@@ -1077,23 +1496,30 @@ static int gmatch_aux (lua_State *L) {
 }
 
 
-static int gmatch (lua_State *L) {
-  size_t ls, lp;
-  const char *s = luaL_checklstring(L, 1, &ls);
-  const char *p = luaL_checklstring(L, 2, &lp);
+static int gmatch_push (lua_State *L, int sidx, int pidx) {
+  size_t ls;
+  const char *s = luaL_checklstring(L, sidx, &ls);
   size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+  const CPattern *cp = pattern_get(L, pidx);
   GMatchState *gm;
-  lua_settop(L, 2);  /* keep strings on closure to avoid being collected */
+  lua_copy(L, -1, 3);
+  lua_settop(L, 3);  /* keep strings and compiled pattern on closure to avoid being collected */
   gm = (GMatchState *)lua_newuserdatauv(L, sizeof(GMatchState), 0);
   if (init > ls)  /* start after string's end? */
     init = ls + 1;  /* avoid overflows in 's + init' */
-  prepstate(&gm->ms, L, s, ls, p, lp);
-  gm->src = s + init; gm->p = p; gm->lastmatch = NULL;
-  lua_pushcclosure(L, gmatch_aux, 3);
+  prepstate(&gm->ms, L, s, ls);
+  gm->src = s + init; gm->lastmatch = NULL;
+  gm->cp = cp;
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
 
+static int gmatch (lua_State *L) {
+  return gmatch_push(L, 1, 2);
+}
+
+
 static void add_s (MatchState *ms, luaL_Buffer *b, const char *s,
                                                    const char *e) {
   size_t l;
@@ -1165,14 +1591,15 @@ static int add_value (MatchState *ms, luaL_Buffer *b, const char *s,
 }
 
 
-static int str_gsub (lua_State *L) {
-  size_t srcl, lp;
-  const char *src = luaL_checklstring(L, 1, &srcl);  /* subject */
-  const char *p = luaL_checklstring(L, 2, &lp);  /* pattern */
+static int gsub_aux (lua_State *L, int sidx, int pidx) {
+  size_t srcl;
+  const char *src = luaL_checklstring(L, sidx, &srcl);  /* subject */
   const char *lastmatch = NULL;  /* end of last match */
   int tr = lua_type(L, 3);  /* replacement type */
   lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);  /* max replacements */
-  int anchor = (*p == '^');
+  /* stays on the stack, the replacement function may evict the cached pattern */
+  const CPattern *cp = pattern_get(L, pidx);
+  int anchor = cp->anchor;
   lua_Integer n = 0;  /* replacement count */
   int changed = 0;  /* change flag */
   MatchState ms;
@@ -1181,27 +1608,30 @@ static int str_gsub (lua_State *L) {
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table");
   luaL_buffinit(L, &b);
-  if (anchor) {
-    p++; lp--;  /* skip anchor character */
-  }
-  prepstate(&ms, L, src, srcl, p, lp);
+  prepstate(&ms, L, src, srcl);
   while (n < max_s) {
     const char *e;
     reprepstate(&ms);  /* (re)prepare state for new match */
-    if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
+    if ((e = match(&ms, src, cp->items)) != NULL && e != lastmatch) {  /* match? */
       n++;
       changed = add_value(&ms, &b, src, e, tr) | changed;
       src = lastmatch = e;
     }
-	else if (src < ms.src_end) {  /* otherwise, skip one character */
-		luaL_addchar(&b, *src);
-        src = utf8_next(src);
-	}
+    else if (src < ms.src_end) {  /* otherwise, skip one character */
+      const char *next = utf8_next(src);
+      if (next > ms.src_end)
+        next = ms.src_end;
+      /* and the following ones that can't start a match */
+      if (!anchor && cp->lprefix && (next = pattern_skip(cp, next, ms.src_end, 0)) == NULL)
+        next = ms.src_end;
+      luaL_addlstring(&b, src, next - src);
+      src = next;
+    }
     else break;  /* end of subject */
     if (anchor) break;
   }
   if (!changed)  /* no changes? */
-    lua_pushvalue(L, 1);  /* return original string */
+    lua_pushvalue(L, sidx);  /* return original string */
   else {  /* something changed */
     luaL_addlstring(&b, src, ms.src_end-src);
     luaL_pushresult(&b);  /* create and return new string */
@@ -1210,6 +1640,81 @@ static int str_gsub (lua_State *L) {
   return 2;
 }
 
+
+static int str_gsub (lua_State *L) {
+  return gsub_aux(L, 1, 2);
+}
+
+
+/*
+** {======================================================
+** PATTERN OBJECT
+** =======================================================
+*/
+
+LUA_CONSTRUCTOR(Pattern) {
+  const CPattern *cp = pattern_new(L, 2);
+  Pattern *pat = (Pattern *)calloc(1, sizeof(Pattern));
+  pat->cp = cp;
+  pat->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newinstance(L, pat, Pattern);
+  return 1;
+}
+
+static int str_compile (lua_State *L) {
+  luaL_checkstring(L, 1);
+  lua_settop(L, 1);
+  lua_pushinstance(L, Pattern, 1);
+  return 1;
+}
+
+LUA_METHOD(Pattern, find) {
+  lua_self(L, 1, Pattern);
+  return find_aux(L, 1, 2, 1);
+}
+
+LUA_METHOD(Pattern, match) {
+  lua_self(L, 1, Pattern);
+  return find_aux(L, 0, 2, 1);
+}
+
+LUA_METHOD(Pattern, gmatch) {
+  lua_self(L, 1, Pattern);
+  return gmatch_push(L, 2, 1);
+}
+
+LUA_METHOD(Pattern, gsub) {
+  lua_self(L, 1, Pattern);
+  return gsub_aux(L, 2, 1);
+}
+
+LUA_PROPERTY_GET(Pattern, pattern) {
+  Pattern *pat = lua_self(L, 1, Pattern);
+  lua_pushlstring(L, pat->cp->p, pat->cp->lp);
+  return 1;
+}
+
+LUA_METHOD(Pattern, __gc) {
+  Pattern *pat = lua_self(L, 1, Pattern);
+  luaL_unref(L, LUA_REGISTRYINDEX, pat->ref);
+  free(pat);
+  return 0;
+}
+
+OBJECT_MEMBERS(Pattern)
+  READONLY_PROPERTY(Pattern, pattern)
+  METHOD(Pattern, find)
+  METHOD(Pattern, match)
+  METHOD(Pattern, gmatch)
+  METHOD(Pattern, gsub)
+END
+
+OBJECT_METAFIELDS(Pattern)
+  METHOD(Pattern, __gc)
+END
+
+/* }====================================================== */
+
 /* }====================================================== */
 
 
@@ -1711,15 +2216,15 @@ static KOption getoption (Header *h, const char **fmt, int *size) {
 
 /*
 ** Read, classify, and fill other details about the next option.
-** 'psize' is filled with option's size, 'notoalign' with its
-** alignment requirements.
-** Local variable 'size' gets the size to be aligned. (Kpadal option
+** 'psize' is filled with option's size, 'palign' with its
+** alignment requirements (0 if none).
+** Local variable 'align' gets the size to be aligned. (Kpadal option
 ** always gets its full alignment, other options are limited by
 ** the maximum alignment ('maxalign'). Kchar option needs no alignment
 ** despite its size.
 */
-static KOption getdetails (Header *h, size_t totalsize,
-                           const char **fmt, int *psize, int *ntoalign) {
+static KOption getformat (Header *h, const char **fmt, int *psize,
+                          int *palign) {
   KOption opt = getoption(h, fmt, psize);
   int align = *psize;  /* usually, alignment follows size */
   if (opt == Kpaddalign) {  /* 'X' gets alignment from following option */
@@ -1727,18 +2232,36 @@ static KOption getdetails (Header *h, size_t totalsize,
       luaL_argerror(h->L, 1, "invalid next option for option 'X'");
   }
   if (align <= 1 || opt == Kchar)  /* need no alignment? */
-    *ntoalign = 0;
+    *palign = 0;
   else {
     if (align > h->maxalign)  /* enforce maximum alignment */
       align = h->maxalign;
     if ((align & (align - 1)) != 0)  /* is 'align' not a power of 2? */
       luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
-    *ntoalign = (align - (int)(totalsize & (align - 1))) & (align - 1);
+    *palign = align;
   }
   return opt;
 }
 
 
+/* number of padding bytes to align 'totalsize' on 'align' */
+#define topad(align, totalsize) \
+  ((align) > 1 ? ((align) - (int)((totalsize) & ((align) - 1))) & ((align) - 1) : 0)
+
+
+/*
+** Same as 'getformat', 'ntoalign' being filled with the number of
+** padding bytes needed at 'totalsize'
+*/
+static KOption getdetails (Header *h, size_t totalsize,
+                           const char **fmt, int *psize, int *ntoalign) {
+  int align;
+  KOption opt = getformat(h, fmt, psize, &align);
+  *ntoalign = topad(align, totalsize);
+  return opt;
+}
+
+
 /*
 ** Pack integer 'n' with 'size' bytes and 'islittle' endianness.
 ** The final 'if' handles the case when 'size' is larger than
@@ -1780,11 +2303,87 @@ static void copywithendian (volatile char *dest, volatile const char *src,
 }
 
 
-int str_pack (lua_State *L) {
+/*
+** Pack argument 'arg' for one option, after 'ntoalign' padding bytes.
+** Returns the number of arguments used (0 or 1).
+*/
+static int packoption (lua_State *L, luaL_Buffer *b, KOption opt, int size,
+                       int ntoalign, int islittle, int arg,
+                       size_t *totalsize) {
+  *totalsize += ntoalign + size;
+  while (ntoalign-- > 0)
+   luaL_addchar(b, LUAL_PACKPADBYTE);  /* fill alignment */
+  switch (opt) {
+    case Kint: {  /* signed integers */
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (size < SZINT) {  /* need overflow check? */
+        lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
+        luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
+      }
+      packint(b, (lua_Unsigned)n, islittle, size, (n < 0));
+      break;
+    }
+    case Kuint: {  /* unsigned integers */
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (size < SZINT)  /* need overflow check? */
+        luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
+                         arg, "unsigned overflow");
+      packint(b, (lua_Unsigned)n, islittle, size, 0);
+      break;
+    }
+    case Kfloat: {  /* floating-point options */
+      volatile Ftypes u;
+      char *buff = luaL_prepbuffsize(b, size);
+      lua_Number n = luaL_checknumber(L, arg);  /* get argument */
+      if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
+      else if (size == sizeof(u.d)) u.d = (double)n;
+      else u.n = n;
+      /* move 'u' to final result, correcting endianness if needed */
+      copywithendian(buff, u.buff, size, islittle);
+      luaL_addsize(b, size);
+      break;
+    }
+    case Kchar: {  /* fixed-size string */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, len <= (size_t)size, arg,
+                       "string longer than given size");
+      luaL_addlstring(b, s, len);  /* add string */
+      while (len++ < (size_t)size)  /* pad extra space */
+        luaL_addchar(b, LUAL_PACKPADBYTE);
+      break;
+    }
+    case Kstring: {  /* strings with length count */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, size >= (int)sizeof(size_t) ||
+                       len < ((size_t)1 << (size * NB)),
+                       arg, "string length does not fit in given size");
+      packint(b, (lua_Unsigned)len, islittle, size, 0);  /* pack length */
+      luaL_addlstring(b, s, len);
+      *totalsize += len;
+      break;
+    }
+    case Kzstr: {  /* zero-terminated string */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
+      luaL_addlstring(b, s, len);
+      luaL_addchar(b, '\0');  /* add zero at the end */
+      *totalsize += len + 1;
+      break;
+    }
+    case Kpadding: luaL_addchar(b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
+    case Kpaddalign: case Knop:
+      return 0;
+  }
+  return 1;
+}
+
+
+static int str_packstring (lua_State *L, const char *fmt, int arg) {
   luaL_Buffer b;
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
-  int arg = 1;  /* current argument to pack */
   size_t totalsize = 0;  /* accumulate total size of result */
   initheader(L, &h);
   lua_pushnil(L);  /* mark to separate arguments from string buffer */
@@ -1792,75 +2391,7 @@ int str_pack (lua_State *L) {
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
-    totalsize += ntoalign + size;
-    while (ntoalign-- > 0)
-     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
-    arg++;
-    switch (opt) {
-      case Kint: {  /* signed integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT) {  /* need overflow check? */
-          lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
-          luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
-        }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
-        break;
-      }
-      case Kuint: {  /* unsigned integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT)  /* need overflow check? */
-          luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
-                           arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
-        break;
-      }
-      case Kfloat: {  /* floating-point options */
-        volatile Ftypes u;
-        char *buff = luaL_prepbuffsize(&b, size);
-        lua_Number n = luaL_checknumber(L, arg);  /* get argument */
-        if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
-        else if (size == sizeof(u.d)) u.d = (double)n;
-        else u.n = n;
-        /* move 'u' to final result, correcting endianness if needed */
-        copywithendian(buff, u.buff, size, h.islittle);
-        luaL_addsize(&b, size);
-        break;
-      }
-      case Kchar: {  /* fixed-size string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, len <= (size_t)size, arg,
-                         "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
-        while (len++ < (size_t)size)  /* pad extra space */
-          luaL_addchar(&b, LUAL_PACKPADBYTE);
-        break;
-      }
-      case Kstring: {  /* strings with length count */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, size >= (int)sizeof(size_t) ||
-                         len < ((size_t)1 << (size * NB)),
-                         arg, "string length does not fit in given size");
-        packint(&b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
-        luaL_addlstring(&b, s, len);
-        totalsize += len;
-        break;
-      }
-      case Kzstr: {  /* zero-terminated string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
-        totalsize += len + 1;
-        break;
-      }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
-      case Kpaddalign: case Knop:
-        arg--;  /* undo increment */
-        break;
-    }
+    arg += packoption(L, &b, opt, size, ntoalign, h.islittle, arg, &totalsize);
   }
   luaL_pushresult(&b);
   return 1;
@@ -1920,71 +2451,268 @@ static lua_Integer unpackint (lua_State *L, const char *str,
   return (lua_Integer)res;
 }
 
-int str_unpack (lua_State *L) {
+
+/*
+** Unpack one option from ld bytes of data at *pos (from 0), after
+** 'ntoalign' padding bytes. Returns the number of values pushed (0 or 1).
+*/
+static int unpackoption (lua_State *L, KOption opt, int size, int ntoalign,
+                         int islittle, const char *data, size_t ld,
+                         size_t *ppos) {
+  size_t pos = *ppos;
+  int n = 1;
+  luaL_argcheck(L, (size_t)ntoalign + size <= ld - pos, 2,
+                  "data string too short");
+  pos += ntoalign;  /* skip alignment */
+  /* stack space for item + next position */
+  luaL_checkstack(L, 2, "too many results");
+  switch (opt) {
+    case Kint:
+    case Kuint: {
+      lua_Integer res = unpackint(L, data + pos, islittle, size,
+                                     (opt == Kint));
+      lua_pushinteger(L, res);
+      break;
+    }
+    case Kfloat: {
+      volatile Ftypes u;
+      lua_Number num;
+      copywithendian(u.buff, data + pos, size, islittle);
+      if (size == sizeof(u.f)) num = (lua_Number)u.f;
+      else if (size == sizeof(u.d)) num = (lua_Number)u.d;
+      else num = u.n;
+      lua_pushnumber(L, num);
+      break;
+    }
+    case Kchar: {
+      lua_pushlstring(L, data + pos, size);
+      break;
+    }
+    case Kstring: {
+      size_t len = (size_t)unpackint(L, data + pos, islittle, size, 0);
+      luaL_argcheck(L, len <= ld - pos - size, 2, "data string too short");
+      lua_pushlstring(L, data + pos + size, len);
+      pos += len;  /* skip string */
+      break;
+    }
+    case Kzstr: {
+      /* data does not need to be zero-terminated */
+      const char *z = (const char *)memchr(data + pos, '\0', ld - pos);
+      size_t len = z ? (size_t)(z - data - pos) : ld - pos;
+      luaL_argcheck(L, pos + len < ld, 2,
+                       "unfinished string for format 'z'");
+      lua_pushlstring(L, data + pos, len);
+      pos += len + 1;  /* skip string plus final '\0' */
+      break;
+    }
+    case Kpaddalign: case Kpadding: case Knop:
+      n = 0;
+      break;
+  }
+  *ppos = pos + size;
+  return n;
+}
+
+
+static int str_unpackstring (lua_State *L, const char *fmt, const char *data,
+                             size_t ld, size_t pos) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
-  size_t pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
   int n = 0;  /* number of results */
-  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
   initheader(L, &h);
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
-    luaL_argcheck(L, (size_t)ntoalign + size <= ld - pos, 2,
-                    "data string too short");
-    pos += ntoalign;  /* skip alignment */
-    /* stack space for item + next position */
-    luaL_checkstack(L, 2, "too many results");
-    n++;
-    switch (opt) {
-      case Kint:
-      case Kuint: {
-        lua_Integer res = unpackint(L, data + pos, h.islittle, size,
-                                       (opt == Kint));
-        lua_pushinteger(L, res);
-        break;
-      }
-      case Kfloat: {
-        volatile Ftypes u;
-        lua_Number num;
-        copywithendian(u.buff, data + pos, size, h.islittle);
-        if (size == sizeof(u.f)) num = (lua_Number)u.f;
-        else if (size == sizeof(u.d)) num = (lua_Number)u.d;
-        else num = u.n;
-        lua_pushnumber(L, num);
-        break;
-      }
-      case Kchar: {
-        lua_pushlstring(L, data + pos, size);
-        break;
-      }
-      case Kstring: {
-        size_t len = (size_t)unpackint(L, data + pos, h.islittle, size, 0);
-        luaL_argcheck(L, len <= ld - pos - size, 2, "data string too short");
-        lua_pushlstring(L, data + pos + size, len);
-        pos += len;  /* skip string */
-        break;
-      }
-      case Kzstr: {
-        size_t len = (int)strlen(data + pos);
-        luaL_argcheck(L, pos + len < ld, 2,
-                         "unfinished string for format 'z'");
-        lua_pushlstring(L, data + pos, len);
-        pos += len + 1;  /* skip string plus final '\0' */
-        break;
-      }
-      case Kpaddalign: case Kpadding: case Knop:
-        n--;  /* undo increment */
-        break;
+    n += unpackoption(L, opt, size, ntoalign, h.islittle, data, ld, &pos);
+  }
+  lua_pushinteger(L, pos + 1);  /* next position */
+  return n + 1;
+}
+
+
+/*
+** {======================================================
+** PACKFORMAT OBJECT
+** A format string parsed once in a list of options
+** =======================================================
+*/
+
+typedef struct PackOption {
+  KOption opt;
+  int size;
+  int align;  /* alignment, or 0 if none */
+  int islittle;
+} PackOption;
+
+typedef struct PackFormat {
+  luart_type type;
+  int ref;  /* reference to the format string */
+  int nopts;
+  size_t size;  /* packed size, or MAXSIZE for variable-length formats */
+  PackOption *opts;
+} PackFormat;
+
+luart_type TPackFormat;
+
+static void packformat_compile (lua_State *L, PackFormat *pf, const char *fmt) {
+  Header h;
+  initheader(L, &h);
+  pf->opts = (PackOption *)malloc(sizeof(PackOption) * (strlen(fmt) + 1));
+  while (*fmt != '\0') {
+    PackOption *o = &pf->opts[pf->nopts];
+    KOption opt = getformat(&h, &fmt, &o->size, &o->align);
+    if (opt == Knop)
+      continue;
+    o->opt = opt;
+    o->islittle = h.islittle;
+    pf->nopts++;
+    if (pf->size != MAXSIZE) {
+      if (opt == Kstring || opt == Kzstr ||
+          pf->size > MAXSIZE - (o->size + topad(o->align, pf->size)))
+        pf->size = MAXSIZE;
+      else pf->size += o->size + topad(o->align, pf->size);
     }
-    pos += size;
+  }
+}
+
+static int packformat_pack (lua_State *L, const PackFormat *pf, int arg) {
+  luaL_Buffer b;
+  size_t totalsize = 0;
+  int i;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b);
+  for (i = 0; i < pf->nopts; i++) {
+    const PackOption *o = &pf->opts[i];
+    arg += packoption(L, &b, o->opt, o->size, topad(o->align, totalsize),
+                      o->islittle, arg, &totalsize);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int packformat_unpack (lua_State *L, const PackFormat *pf,
+                              const char *data, size_t ld, size_t pos) {
+  int i, n = 0;
+  for (i = 0; i < pf->nopts; i++) {
+    const PackOption *o = &pf->opts[i];
+    n += unpackoption(L, o->opt, o->size, topad(o->align, pos), o->islittle,
+                      data, ld, &pos);
   }
   lua_pushinteger(L, pos + 1);  /* next position */
   return n + 1;
 }
 
+
+/*
+** pack the arguments from 'arg', using the PackFormat instance or
+** the format string at index 'fmt'
+*/
+int pack_format (lua_State *L, int fmt, int arg) {
+  PackFormat *pf = (PackFormat *)lua_iscinstance(L, fmt, TPackFormat);
+  return pf ? packformat_pack(L, pf, arg)
+            : str_packstring(L, luaL_checkstring(L, fmt), arg);
+}
+
+
+/*
+** unpack values from ld bytes of data, starting at pos (from 0), using
+** the PackFormat instance or the format string at index 'fmt'.
+** data does not need to be a Lua string.
+*/
+int unpack_format (lua_State *L, int fmt, const char *data, size_t ld,
+                   size_t pos) {
+  PackFormat *pf = (PackFormat *)lua_iscinstance(L, fmt, TPackFormat);
+  return pf ? packformat_unpack(L, pf, data, ld, pos)
+            : str_unpackstring(L, luaL_checkstring(L, fmt), data, ld, pos);
+}
+
+
+int str_pack (lua_State *L) {
+  return pack_format(L, 1, 2);
+}
+
+
+int str_unpack (lua_State *L) {
+  size_t ld;
+  const char *data = luaL_checklstring(L, 2, &ld);
+  size_t pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
+  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
+  return unpack_format(L, 1, data, ld, pos);
+}
+
+
+LUA_CONSTRUCTOR(PackFormat) {
+  const char *fmt = luaL_checkstring(L, 2);
+  PackFormat *pf = (PackFormat *)calloc(1, sizeof(PackFormat));
+  lua_pushvalue(L, 2);
+  pf->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* create the instance first, so that it gets released on format errors */
+  lua_newinstance(L, pf, PackFormat);
+  packformat_compile(L, pf, fmt);
+  return 1;
+}
+
+static int str_packformat (lua_State *L) {
+  luaL_checkstring(L, 1);
+  lua_settop(L, 1);
+  lua_pushinstance(L, PackFormat, 1);
+  return 1;
+}
+
+LUA_METHOD(PackFormat, pack) {
+  return packformat_pack(L, lua_self(L, 1, PackFormat), 2);
+}
+
+/* data can be a string or a Buffer */
+LUA_METHOD(PackFormat, unpack) {
+  PackFormat *pf = lua_self(L, 1, PackFormat);
+  size_t ld, pos;
+  const char *data;
+  Buffer *b = (Buffer *)lua_iscinstance(L, 2, TBuffer);
+  if (b) {
+    data = (const char *)b->bytes;
+    ld = b->size;
+  }
+  else data = luaL_checklstring(L, 2, &ld);
+  pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
+  luaL_argcheck(L, pos <= ld, 3, "initial position out of data");
+  return packformat_unpack(L, pf, data, ld, pos);
+}
+
+LUA_PROPERTY_GET(PackFormat, size) {
+  PackFormat *pf = lua_self(L, 1, PackFormat);
+  if (pf->size == MAXSIZE)
+    lua_pushnil(L);
+  else lua_pushinteger(L, (lua_Integer)pf->size);
+  return 1;
+}
+
+LUA_PROPERTY_GET(PackFormat, format) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, lua_self(L, 1, PackFormat)->ref);
+  return 1;
+}
+
+LUA_METHOD(PackFormat, __gc) {
+  PackFormat *pf = lua_self(L, 1, PackFormat);
+  luaL_unref(L, LUA_REGISTRYINDEX, pf->ref);
+  free(pf->opts);
+  free(pf);
+  return 0;
+}
+
+OBJECT_MEMBERS(PackFormat)
+  READONLY_PROPERTY(PackFormat, size)
+  READONLY_PROPERTY(PackFormat, format)
+  METHOD(PackFormat, pack)
+  METHOD(PackFormat, unpack)
+END
+
+OBJECT_METAFIELDS(PackFormat)
+  METHOD(PackFormat, __gc)
+END
+
+/* }====================================================== */
+
+
 int str_split(lua_State *L) {
     int len = 0;
     wchar_t *string = lua_towstring(L, 1);
@@ -2027,6 +2755,7 @@ static const luaL_Reg wstrlib[] = {
   {"ubyte", str_byte},
   {"uchar", str_char},
   {"capitalize", str_capitalize},
+  {"compile", str_compile},
   {"dump", str_dump},
   {"ufind", str_find},
   {"format", str_format},
@@ -2042,8 +2771,10 @@ static const luaL_Reg wstrlib[] = {
   {"upper", str_upper},
   {"pack", str_pack},
   {"packsize", str_packsize},
+  {"packformat", str_packformat},
   {"unpack", str_unpack},
   {"usearch", str_search},
+  {"gusearch", str_gsearch},
   {"split", str_split},
   {"normalize", str_normalize},
   {NULL, NULL}
@@ -2071,6 +2802,8 @@ LUAMOD_API int luaopen_string (lua_State *L) {
   luaL_newlib(L, wstrlib);
   luaL_setfuncs(L, strlib, 0);
   createmetatable(L);
+  lua_regobjectmt(L, Pattern);
+  lua_regobjectmt(L, PackFormat);
   return 1;
 }
 
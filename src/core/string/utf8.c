@@ -0,0 +1,375 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | utf8.c | LuaRT UTF8 kernels (SSE2/AVX2 with scalar fallback)
+*/
+
+#define LUA_LIB
+
+#include "lrtapi.h"
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define UTF8_SIMD
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+		#define UTF8_AVX2 __attribute__((target("avx2")))
+	#endif
+	#include <immintrin.h>
+#endif
+
+#ifndef UTF8_AVX2
+	#define UTF8_AVX2
+#endif
+
+//--- Leading bytes are all bytes except the 10xxxxxx continuation bytes, that is signed bytes greater than -65 (0xBF)
+#define islead(c) (((unsigned char)(c) & 0xC0) != 0x80)
+
+static int popcount32(UINT32 x) {
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (int)((((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+}
+
+//--- Returns the index of the n-th (from 0) bit set in mask
+static int nthbit(UINT32 mask, size_t n) {
+	while (n--)
+		mask &= mask - 1;
+	return popcount32((mask & (0 - mask)) - 1);
+}
+
+//--- Count and locate kernels also check the structure of leading and continuation bytes : each leading byte
+//--- of utf8_charsize() n must be followed by exactly n-1 continuation bytes. When it holds, leading bytes are
+//--- the characters found by walking the string with utf8_charsize(), as character iterators do
+#define UTF8_MALFORMED ((size_t)-1)
+
+//--- Returns the number of continuation bytes still expected at s, the structure being valid before s
+static size_t pending(const char *s) {
+	size_t need = 0;
+	int k;
+
+	for (k = 3; k; k--)
+		if (islead(s[-k]))
+			need = utf8_charsize(&s[-k]) - 1;
+		else if (need)
+			need--;
+	return need;
+}
+
+//-------------------------------------[ Scalar kernels ]
+static size_t count_tail(const char *s, size_t len, size_t need) {
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++)
+		if (islead(s[i])) {
+			if (need)
+				return UTF8_MALFORMED;
+			need = utf8_charsize(&s[i]) - 1;
+			n++;
+		} else if (!need--)
+			return UTF8_MALFORMED;
+	return n;
+}
+
+static size_t locate_tail(const char *s, size_t len, size_t *pos, size_t need) {
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (islead(s[i])) {
+			if (need)
+				return UTF8_MALFORMED;
+			if (!(*pos)--)
+				return i;
+			need = utf8_charsize(&s[i]) - 1;
+		} else if (!need--)
+			return UTF8_MALFORMED;
+	return len;
+}
+
+static size_t count_scalar(const char *s, size_t len) {
+	return count_tail(s, len, 0);
+}
+
+static size_t ascii_scalar(const char *s, size_t len) {
+	size_t i = 0;
+	while (i < len && !((unsigned char)s[i] & 0x80))
+		i++;
+	return i;
+}
+
+static size_t locate_scalar(const char *s, size_t len, size_t *pos) {
+	return locate_tail(s, len, pos, 0);
+}
+
+//--- Resumes a scalar kernel after i bytes checked by a vectorized one
+#define count_resume(s, i, len) count_tail(s+i, len-i, i ? pending(s+i) : 0)
+#define locate_resume(s, i, len, pos) locate_tail(s+i, len-i, pos, i ? pending(s+i) : 0)
+
+#ifdef UTF8_SIMD
+
+//-------------------------------------[ SSE2 kernels ]
+
+//--- Marks continuation bytes not expected after the 3 previous bytes, and other bytes where one is expected
+static __m128i malformed_sse2(__m128i v, __m128i prev) {
+	__m128i p1 = _mm_or_si128(_mm_slli_si128(v, 1), _mm_srli_si128(prev, 15));
+	__m128i p2 = _mm_or_si128(_mm_slli_si128(v, 2), _mm_srli_si128(prev, 14));
+	__m128i p3 = _mm_or_si128(_mm_slli_si128(v, 3), _mm_srli_si128(prev, 13));
+	__m128i expected = _mm_or_si128(_mm_or_si128(_mm_subs_epu8(p1, _mm_set1_epi8((char)0xBF)), _mm_subs_epu8(p2, _mm_set1_epi8((char)0xDF))), _mm_subs_epu8(p3, _mm_set1_epi8((char)0xEF)));
+	__m128i cont = _mm_cmplt_epi8(v, _mm_set1_epi8(-64));
+	return _mm_cmpeq_epi8(_mm_cmpeq_epi8(expected, _mm_setzero_si128()), cont);
+}
+
+static size_t count_sse2(const char *s, size_t len) {
+	const __m128i lead = _mm_set1_epi8(-65);
+	__m128i prev = _mm_setzero_si128(), bad = _mm_setzero_si128();
+	size_t i = 0, n = 0, tail;
+
+	while (len - i >= 16) {
+		__m128i acc = _mm_setzero_si128();
+		//--- byte counters can hold up to 255 blocks before being summed
+		size_t blocks = (len - i) / 16, b;
+		if (blocks > 255)
+			blocks = 255;
+		for (b = 0; b < blocks; b++, i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+			acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(v, lead));
+			bad = _mm_or_si128(bad, malformed_sse2(v, prev));
+			prev = v;
+		}
+		if (_mm_movemask_epi8(bad))
+			return UTF8_MALFORMED;
+		acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+		n += (size_t)_mm_cvtsi128_si32(acc) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	}
+	return (tail = count_resume(s, i, len)) == UTF8_MALFORMED ? tail : n + tail;
+}
+
+static size_t ascii_sse2(const char *s, size_t len) {
+	size_t i = 0;
+	int mask;
+
+	for (; len - i >= 16; i += 16)
+		if ((mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s+i)))))
+			return i + nthbit((UINT32)mask, 0);
+	return i + ascii_scalar(s+i, len-i);
+}
+
+static size_t locate_sse2(const char *s, size_t len, size_t *pos) {
+	const __m128i lead = _mm_set1_epi8(-65);
+	__m128i prev = _mm_setzero_si128();
+	size_t i = 0, offset;
+
+	for (; len - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+		UINT32 mask = (UINT32)_mm_movemask_epi8(_mm_cmpgt_epi8(v, lead));
+		size_t n = (size_t)popcount32(mask);
+		if (_mm_movemask_epi8(malformed_sse2(v, prev)))
+			return UTF8_MALFORMED;
+		if (*pos < n)
+			return i + nthbit(mask, *pos);
+		*pos -= n;
+		prev = v;
+	}
+	return (offset = locate_resume(s, i, len, pos)) == UTF8_MALFORMED ? offset : i + offset;
+}
+
+//-------------------------------------[ AVX2 kernels ]
+static UTF8_AVX2 __m256i malformed_avx2(__m256i v, __m256i prev) {
+	//--- the last 16 bytes of prev followed by the first 16 bytes of v
+	__m256i carry = _mm256_permute2x128_si256(prev, v, 0x21);
+	__m256i p1 = _mm256_alignr_epi8(v, carry, 15);
+	__m256i p2 = _mm256_alignr_epi8(v, carry, 14);
+	__m256i p3 = _mm256_alignr_epi8(v, carry, 13);
+	__m256i expected = _mm256_or_si256(_mm256_or_si256(_mm256_subs_epu8(p1, _mm256_set1_epi8((char)0xBF)), _mm256_subs_epu8(p2, _mm256_set1_epi8((char)0xDF))), _mm256_subs_epu8(p3, _mm256_set1_epi8((char)0xEF)));
+	__m256i cont = _mm256_cmpgt_epi8(_mm256_set1_epi8(-64), v);
+	return _mm256_cmpeq_epi8(_mm256_cmpeq_epi8(expected, _mm256_setzero_si256()), cont);
+}
+
+static UTF8_AVX2 size_t count_avx2(const char *s, size_t len) {
+	const __m256i lead = _mm256_set1_epi8(-65);
+	__m256i prev = _mm256_setzero_si256(), bad = _mm256_setzero_si256();
+	size_t i = 0, n = 0, tail;
+
+	while (len - i >= 32) {
+		__m256i acc = _mm256_setzero_si256();
+		size_t blocks = (len - i) / 32, b;
+		if (blocks > 255)
+			blocks = 255;
+		for (b = 0; b < blocks; b++, i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(s+i));
+			acc = _mm256_sub_epi8(acc, _mm256_cmpgt_epi8(v, lead));
+			bad = _mm256_or_si256(bad, malformed_avx2(v, prev));
+			prev = v;
+		}
+		if (_mm256_movemask_epi8(bad))
+			return UTF8_MALFORMED;
+		acc = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+		n += (size_t)_mm256_extract_epi32(acc, 0) + (size_t)_mm256_extract_epi32(acc, 2) + (size_t)_mm256_extract_epi32(acc, 4) + (size_t)_mm256_extract_epi32(acc, 6);
+	}
+	return (tail = count_resume(s, i, len)) == UTF8_MALFORMED ? tail : n + tail;
+}
+
+static UTF8_AVX2 size_t ascii_avx2(const char *s, size_t len) {
+	size_t i = 0;
+	int mask;
+
+	for (; len - i >= 32; i += 32)
+		if ((mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s+i)))))
+			return i + nthbit((UINT32)mask, 0);
+	return i + ascii_sse2(s+i, len-i);
+}
+
+static UTF8_AVX2 size_t locate_avx2(const char *s, size_t len, size_t *pos) {
+	const __m256i lead = _mm256_set1_epi8(-65);
+	__m256i prev = _mm256_setzero_si256();
+	size_t i = 0, offset;
+
+	for (; len - i >= 32; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s+i));
+		UINT32 mask = (UINT32)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, lead));
+		size_t n = (size_t)popcount32(mask);
+		if (_mm256_movemask_epi8(malformed_avx2(v, prev)))
+			return UTF8_MALFORMED;
+		if (*pos < n)
+			return i + nthbit(mask, *pos);
+		*pos -= n;
+		prev = v;
+	}
+	return (offset = locate_resume(s, i, len, pos)) == UTF8_MALFORMED ? offset : i + offset;
+}
+
+#endif
+
+//-------------------------------------[ Runtime dispatch ]
+typedef struct {
+	size_t (*count)(const char *s, size_t len);
+	size_t (*ascii)(const char *s, size_t len);
+	size_t (*locate)(const char *s, size_t len, size_t *pos);
+} Kernels;
+
+static const Kernels scalar_kernels = { count_scalar, ascii_scalar, locate_scalar };
+#ifdef UTF8_SIMD
+static const Kernels sse2_kernels = { count_sse2, ascii_sse2, locate_sse2 };
+static const Kernels avx2_kernels = { count_avx2, ascii_avx2, locate_avx2 };
+
+static void cpuid(int leaf, int regs[4]) {
+#ifdef _MSC_VER
+	__cpuidex(regs, leaf, 0);
+#else
+	__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long xgetbv0(void) {
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+#endif
+
+static const Kernels *select_kernels(void) {
+#ifdef UTF8_SIMD
+	int regs[4], max;
+
+	cpuid(0, regs);
+	max = regs[0];
+	cpuid(1, regs);
+	if (!(regs[3] & (1 << 26)))
+		return &scalar_kernels;
+	//--- AVX2 needs OS support for YMM registers (OSXSAVE + AVX, then XCR0 SSE and AVX states)
+	if (max >= 7 && (regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && (xgetbv0() & 6) == 6) {
+		cpuid(7, regs);
+		if (regs[1] & (1 << 5))
+			return &avx2_kernels;
+	}
+	return &sse2_kernels;
+#else
+	return &scalar_kernels;
+#endif
+}
+
+static PVOID volatile kernels = NULL;
+
+//--- Lua states run on several threads (see Worker), the first calls may select the kernels concurrently
+static const Kernels *get_kernels(void) {
+	PVOID k = InterlockedCompareExchangePointer(&kernels, NULL, NULL);
+
+	if (!k)
+		InterlockedExchangePointer(&kernels, (k = (PVOID)select_kernels()));
+	return (const Kernels *)k;
+}
+
+#define K (get_kernels())
+
+//-------------------------------------[ UTF8 functions ]
+
+//--- Malformed UTF8 is walked with utf8_charsize(), as character iterators do
+static size_t count_walk(const char *s, size_t len) {
+	const char *end = s + len;
+	size_t n = 0;
+
+	for (; s < end; n++)
+		s += utf8_charsize(s);
+	return n;
+}
+
+static size_t locate_walk(const char *s, size_t len, size_t pos) {
+	const char *p = s, *end = s + len;
+
+	while (pos-- && p < end)
+		p += utf8_charsize(p);
+	return p < end ? (size_t)(p - s) : len;
+}
+
+//--- Count the number of characters
+size_t utf8_count(const char *s, size_t len) {
+	size_t n = K->count(s, len);
+	return n != UTF8_MALFORMED ? n : count_walk(s, len);
+}
+
+//--- Returns the length of the ASCII prefix
+size_t utf8_ascii(const char *s, size_t len) {
+	return K->ascii(s, len);
+}
+
+//--- Returns the character at position pos (starting from 0), or s+len if there are not enough characters
+const char *utf8_lpos(const char *s, size_t len, size_t pos) {
+	size_t n = pos, offset = K->locate(s, len, &n);
+	return s + (offset != UTF8_MALFORMED ? offset : locate_walk(s, len, pos));
+}
+
+//--- Check for well formed UTF8 (no overlong forms, surrogates or code points above U+10FFFF)
+BOOL utf8_valid(const char *str, size_t len) {
+	const unsigned char *s = (const unsigned char *)str, *end = s + len;
+
+	while ((s += utf8_ascii((const char *)s, end-s)) < end) {
+		unsigned char c = *s;
+		size_t size;
+		if (c >= 0xC2 && c <= 0xDF)
+			size = 2;
+		else if (c >= 0xE0 && c <= 0xEF) {
+			size = 3;
+			if (end-s < 3 || (c == 0xE0 && s[1] < 0xA0) || (c == 0xED && s[1] > 0x9F))
+				return FALSE;
+		} else if (c >= 0xF0 && c <= 0xF4) {
+			size = 4;
+			if (end-s < 4 || (c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] > 0x8F))
+				return FALSE;
+		} else return FALSE;
+		if ((size_t)(end-s) < size)
+			return FALSE;
+		while (--size)
+			if ((*++s & 0xC0) != 0x80)
+				return FALSE;
+		s++;
+	}
+	return TRUE;
+}
@@ -17,7 +17,111 @@
 #include <string.h>
 
 luart_type TBuffer;
-static const char* encodings[] = { "utf8", "unicode", "base64", "hex", NULL };
+static const char* encodings[] = { "utf8", "unicode", "base64", "hex", "base64url", NULL };
+
+//-------------------------------------[ Shared storage ]
+//--- Buffer views share the storage of another Buffer, of a Lua string or of a File mapping
+//--- Shared storage is copied the first time a Buffer modifies it (copy on write),
+//--- except writable File mappings that are modified in place
+typedef struct BufferBlock {
+	int		refs;
+	int		ref;		//--- registry reference to the Lua string holding the bytes, or LUA_NOREF
+	BYTE	*data;
+	void	*map;		//--- mapped view of a File, or NULL
+	BOOL	inplace;	//--- bytes can be modified in place
+} BufferBlock;
+
+static BufferBlock *block_new(lua_State *L, BYTE *data, int ref) {
+	BufferBlock *blk = malloc(sizeof(BufferBlock));
+
+	if (!blk)
+		luaL_error(L, "Buffer allocation error: not enough memory");
+	blk->refs = 1;
+	blk->ref = ref;
+	blk->data = data;
+	blk->map = NULL;
+	blk->inplace = FALSE;
+	return blk;
+}
+
+static void block_release(lua_State *L, BufferBlock *blk) {
+	if (--blk->refs == 0) {
+		if (blk->map)
+			UnmapViewOfFile(blk->map);
+		else if (blk->ref != LUA_NOREF)
+			luaL_unref(L, LUA_REGISTRYINDEX, blk->ref);
+		else free(blk->data);
+		free(blk);
+	}
+}
+
+//--- Free the Buffer bytes, or release its shared storage
+static void buff_free(lua_State *L, Buffer *b) {
+	if (b->block)
+		block_release(L, b->block);
+	else free(b->bytes);
+	b->block = NULL;
+	b->bytes = NULL;
+	b->capacity = 0;
+}
+
+//--- Push a new Buffer view on size bytes of a shared storage
+static Buffer *buff_pushview(lua_State *L, BufferBlock *blk, BYTE *bytes, size_t size, int encoding) {
+	Buffer *b;
+
+	lua_pushnil(L);
+	b = lua_pushinstance(L, Buffer, 1);
+	lua_remove(L, -2);
+	blk->refs++;
+	b->block = blk;
+	b->bytes = bytes;
+	b->size = b->capacity = size;
+	b->encoding = encoding;
+	return b;
+}
+
+//--- Make sure the Buffer owns its bytes before modifying them
+static void buff_own(lua_State *L, Buffer *b, size_t capacity) {
+	BufferBlock *blk = b->block;
+	BYTE *bytes = NULL;
+
+	if (!blk)
+		return;
+	if (blk->refs == 1 && blk->ref == LUA_NOREF && !blk->map && b->bytes == blk->data) {
+		free(blk);
+		b->block = NULL;
+		return;
+	}
+	if (b->size > capacity)
+		b->size = capacity;
+	if (capacity && (bytes = malloc(capacity)) == NULL)
+		luaL_error(L, "Buffer allocation error: not enough memory");
+	if (b->size)
+		memcpy(bytes, b->bytes, b->size);
+	block_release(L, blk);
+	b->block = NULL;
+	b->bytes = bytes;
+	b->capacity = capacity;
+}
+
+//--- Make sure the Buffer bytes can be modified in place
+static void buff_writable(lua_State *L, Buffer *b) {
+	if (!b->block || !b->block->inplace)
+		buff_own(L, b, b->capacity);
+}
+
+//--- Push a Buffer on a mapped view of a File (see File:map()), unmapped when no more used
+Buffer *buffer_pushmapping(lua_State *L, void *view, BYTE *bytes, size_t size, BOOL writable) {
+	BufferBlock *blk = block_new(L, bytes, LUA_NOREF);
+	Buffer *b;
+
+	blk->map = view;
+	blk->inplace = writable;
+	b = buff_pushview(L, blk, bytes, size, 0);
+	//--- the Buffer holds the only reference
+	blk->refs = 1;
+	return b;
+}
 
 LUA_API Buffer *lua_toBuffer(lua_State *L, int idx) {
 	if (lua_isstring(L, idx)) {
@@ -29,6 +133,22 @@ LUA_API Buffer *lua_toBuffer(lua_State *L, int idx) {
 	return luaL_checkcinstance(L, idx, Buffer);
 }
 
+//--- Strings are wrapped in a Buffer view, without copying their content
+LUA_API Buffer *lua_viewBuffer(lua_State *L, int idx) {
+	if (lua_isstring(L, idx)) {
+		size_t len;
+		const char *str;
+		int ref;
+
+		idx = lua_absindex(L, idx);
+		str = lua_tolstring(L, idx, &len);
+		lua_pushvalue(L, idx);
+		ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		return buff_pushview(L, block_new(L, (BYTE *)str, ref), (BYTE *)str, len, 0);
+	}
+	return luaL_checkcinstance(L, idx, Buffer);
+}
+
 LUA_API void lua_pushBuffer(lua_State *L, void *p, size_t len) {
 	Buffer b;
 	b.bytes = p;
@@ -60,69 +180,58 @@ static void table_toarray(lua_State *L, int idx, Buffer *b) {
 extern size_t posrelatI (lua_Integer pos, size_t len);
 extern size_t getendpos (lua_State *L, int arg, lua_Integer def, size_t len);
 
-void base64_decode(Buffer *b) {
-	DWORD len = 0, skip = 0, flags = 0;
-	if (CryptStringToBinaryA((LPCSTR)b->bytes, b->size, CRYPT_STRING_BASE64, NULL, &len, &skip, &flags))
-    {
-		BYTE *buff = malloc(sizeof(char)*len);
-		if (CryptStringToBinaryA((LPCSTR)b->bytes, b->size, CRYPT_STRING_BASE64, buff, &len, &skip, &flags))
-		{
-			b->bytes = buff;
-			b->size = len;
-			return;
-		}
-		free(buff);
+//--- Decode a base64 or hexadecimal string into the Buffer
+static void buff_decodestr(lua_State *L, Buffer *b, const char *src, size_t len, int encoding) {
+	CodecState st;
+	size_t n = 0, last = 0;
+	BOOL ok;
+
+	codec_init(&st, FALSE);
+	b->size = encoding == 3 ? hex_decoded_size(len) : base64_decoded_size(len);
+	if (b->size && (b->bytes = malloc(b->size)) == NULL)
+		luaL_error(L, "memory allocation error: not enough memory");
+	if (encoding == 3)
+		ok = hex_decode(&st, src, len, b->bytes, &n) && hex_decode_end(&st);
+	else ok = base64_decode(&st, src, len, b->bytes, &n) && base64_decode_end(&st, b->bytes+n, &last);
+	b->size = n + last;
+	if (!ok) {
+		free(b->bytes);
+		b->bytes = NULL;
+		b->size = 0;
+		luaL_error(L, "invalid %s sequence", encoding == 3 ? "hexadecimal" : "base64");
 	}
 }
 
-unsigned char char2val(lua_State *L, unsigned char c)
-{
-	if (c >= '0' && c <= '9')
-		return c - '0';
-	else if (c >= 'A' && c <= 'F')
-		return c - 'A' + 10;
-	else if (c >= 'a' && c <= 'f')
-		return c - 'a' + 10;
-	else return luaL_error(L, "invalid character '%c' in hexadecimal sequence", c);
+//--- Set the Buffer capacity, keeping its content
+static void buff_realloc(lua_State *L, Buffer *b, size_t capacity) {
+	BYTE *bytes;
+
+	buff_own(L, b, capacity);
+	if (b->capacity == capacity)
+		return;
+	if ( capacity && ((bytes = realloc(b->bytes, capacity)) == NULL) )
+		luaL_error(L, "Buffer allocation error: not enough memory");
+	b->bytes = capacity ? bytes : (free(b->bytes), NULL);
+	b->capacity = capacity;
+	if (b->size > capacity)
+		b->size = capacity;
 }
 
-void hex_decode(lua_State *L, Buffer *b)
-{
-	unsigned char *result;
-    size_t j = 0, i = 0;
-	
-	if (b->size & 1)
-		luaL_error(L, "invalid hexadecimal sequence(odd number of characters)");
-	result = malloc(b->size/2);
-	while (i < b->size) {
-		result[j++] = char2val(L, b->bytes[i])*16 + char2val(L, b->bytes[i+1]);
-		i += 2;
+//--- Ensure the Buffer can hold size bytes, growing its capacity geometrically to amortize appends
+static void buff_grow(lua_State *L, Buffer *b, size_t size) {
+	if (size > b->capacity) {
+		size_t capacity = b->capacity < 64 ? 64 : b->capacity;
+		while (capacity < size)
+			capacity = capacity > ((size_t)-1)/2 ? size : capacity*2;
+		buff_realloc(L, b, capacity);
 	}
-	b->bytes = result;
-	b->bytes[i-1] = 0;
-	b->size /= 2;
-}
-
-int base64_encode(lua_State *L, Buffer *b) {
-	DWORD b64len = 0;
-	int result = 0;
-	if (CryptBinaryToStringA(b->bytes, b->size, CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, NULL, &b64len))
-	{
-		char *buff = malloc(sizeof(char)*b64len);
-		if (CryptBinaryToStringA(b->bytes, b->size, CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, buff, &b64len)) {
-			lua_pushlstring(L, buff, b64len);
-			result = 1;
-		}
-		free(buff);
-	}
-	return result;
 }
 
-static void buff_init(lua_State *L, int idx, Buffer *b) {
+static void buff_decode(lua_State *L, int idx, Buffer *b) {
 	BYTE *src = NULL;
 	BOOL free_src = FALSE;
 
-	free(b->bytes);
+	buff_free(L, b);
 	b->encoding = luaL_checkoption(L, idx+1, "utf8", encodings);
 	switch(lua_type(L, idx)) {
 		case LUA_TNUMBER:	if ( (b->size = (size_t)luaL_checkinteger(L, idx)) == 0 ) luaL_error(L, "cannot create Buffer with zero length"); break;
@@ -135,11 +244,9 @@ static void buff_init(lua_State *L, int idx, Buffer *b) {
 											src = (BYTE*)utf8_towchar((const char *)src, &len);
 											b->size = len*sizeof(wchar_t);
 											break;
-									case 2: b->bytes = src;
-											base64_decode(b);
-											return;
-									case 3: b->bytes = src;
-											hex_decode(L, b);
+									case 2:
+									case 3:
+									case 4: buff_decodestr(L, b, (const char *)src, b->size, b->encoding);
 											return;
 									default:luaL_error(L, "unknown encoding '%s'", lua_tostring(L, idx+1));  
 								}
@@ -158,99 +265,258 @@ static void buff_init(lua_State *L, int idx, Buffer *b) {
 	}
 }
 
+static void buff_init(lua_State *L, int idx, Buffer *b) {
+	buff_decode(L, idx, b);
+	b->capacity = b->size;
+}
+
 LUA_CONSTRUCTOR(Buffer) {
-	Buffer *b = calloc(1, sizeof(Buffer));
+	Buffer init = {0}, *b;
+
+	//--- content is initialized first, so that nothing leaks on errors
 	if (lua_islightuserdata(L, 2)) {
 		Buffer *from = lua_touserdata(L, 2);
-		b->size = from->size;
-		b->bytes = malloc(b->size);
-		memcpy(b->bytes, from->bytes, b->size);
+		init.size = init.capacity = from->size;
+		init.bytes = malloc(init.size);
+		memcpy(init.bytes, from->bytes, init.size);
 	}
 	else if (!lua_isnil(L, 2))
-		buff_init(L, 2, b);
+		buff_init(L, 2, &init);
+	b = malloc(sizeof(Buffer));
+	*b = init;
 	lua_newinstance(L, b, Buffer);
 	return 1;
 }
 
+//--- Returns a view sharing the Buffer storage
 LUA_METHOD(Buffer, sub) {
-	Buffer *b, *buff = lua_self(L, 1, Buffer);
+	Buffer *buff = lua_self(L, 1, Buffer);
 	size_t start = posrelatI(luaL_optinteger(L, 2, 0), buff->size); 
 	size_t end =  getendpos(L, 3, -1, buff->size);
 	
 	if (start > end)
 		end = buff->size;
-	lua_pushnil(L);
-	b = lua_pushinstance(L, Buffer, 1);
-	b->size = end-start+1;
-	b->bytes = malloc(b->size);
-	memcpy(b->bytes, buff->bytes+start-1, b->size);
+	if (start > end) {
+		lua_pushnil(L);
+		lua_pushinstance(L, Buffer, 1);
+		return 1;
+	}
+	if (!buff->block)
+		buff->block = block_new(L, buff->bytes, LUA_NOREF);
+	buff_pushview(L, buff->block, buff->bytes+start-1, end-start+1, buff->encoding);
 	return 1;
 }
 
 LUA_METHOD(Buffer, append) {
+	Buffer *b = lua_self(L, 1, Buffer), *from = NULL;
+	const BYTE *src = NULL;
+	size_t len;
+
+	//--- strings without encoding and Buffers are appended directly
+	if (lua_type(L, 2) == LUA_TSTRING && lua_gettop(L) == 2)
+		src = (const BYTE *)lua_tolstring(L, 2, &len);
+	else if ((from = lua_iscinstance(L, 2, TBuffer))) {
+		src = from->bytes;
+		len = from->size;
+	}
+	if (src) {
+		//--- a source view keeps its shared storage alive when the Buffer takes ownership of its bytes
+		buff_own(L, b, b->capacity);
+		buff_grow(L, b, b->size + len);
+		if (from)
+			src = from->bytes;
+		memcpy(b->bytes+b->size, src, len);
+	} else {
+		//--- other values are converted to a temporary Buffer, freed by the GC if growing fails
+		Buffer *temp = lua_pushinstance(L, Buffer, lua_gettop(L) - 1);
+		len = temp->size;
+		buff_own(L, b, b->capacity);
+		buff_grow(L, b, b->size + len);
+		memcpy(b->bytes+b->size, temp->bytes, len);
+	}
+	b->size += len;
+	return 0;
+}
+
+LUA_METHOD(Buffer, reserve) {
 	Buffer *b = lua_self(L, 1, Buffer);
-	Buffer temp = {0};
+	lua_Integer capacity = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, capacity >= 0, 2, "negative capacity");
+	if ((size_t)capacity > b->capacity)
+		buff_realloc(L, b, (size_t)capacity);
+	return 0;
+}
 
-	buff_init(L, 2, &temp);
-	b->bytes = realloc(b->bytes, b->size + temp.size);
-	memcpy(b->bytes+b->size, temp.bytes, temp.size);
-	free(temp.bytes);
-	b->size += temp.size;
+LUA_METHOD(Buffer, clear) {
+	lua_self(L, 1, Buffer)->size = 0;
 	return 0;
 }
 
+//--- Release the File mapping, returns false if other views on it are still alive
+LUA_METHOD(Buffer, unmap) {
+	Buffer *b = lua_self(L, 1, Buffer);
+	BOOL mapped = b->block && b->block->map;
+	BOOL released = mapped && b->block->refs == 1;
+
+	if (mapped) {
+		buff_free(L, b);
+		b->size = 0;
+	}
+	lua_pushboolean(L, released);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Buffer, mapped) {
+	Buffer *b = lua_self(L, 1, Buffer);
+	lua_pushboolean(L, b->block && b->block->map);
+	return 1;
+}
+
 LUA_METHOD(Buffer, from) {
 	Buffer *b = lua_self(L, 1, Buffer);
 	buff_init(L, 2, b);
 	return 0;
 }
 
-extern int str_pack (lua_State *L);
-extern int str_unpack (lua_State *L);
+//--- Pack/unpack with a format string or a PackFormat instance
+extern int pack_format (lua_State *L, int fmt, int arg);
+extern int unpack_format (lua_State *L, int fmt, const char *data, size_t ld, size_t pos);
 
 LUA_METHOD(Buffer, pack) {
 	Buffer *b = lua_self(L, 1, Buffer);
-	int n = lua_gettop(L);
 
-	lua_pushcfunction(L, str_pack);
-	lua_insert(L, -n);
-	lua_call(L, n-1, 1);
-	buff_init(L, -1, b);
+	pack_format(L, 2, 3);
+	buff_init(L, lua_gettop(L), b);
 	return 0;
 }
 
+//--- Unpacks directly from the Buffer bytes
 LUA_METHOD(Buffer, unpack) {
 	Buffer *b = lua_self(L, 1, Buffer);
-	int nargs = lua_gettop(L);
+	size_t pos = posrelatI(luaL_optinteger(L, 3, 1), b->size) - 1;
 
-	lua_pushcfunction(L, str_unpack);
-	lua_pushvalue(L, 2);
-	lua_pushlstring(L, (const char *)b->bytes, b->size);
-	if (nargs == 3)
-		lua_pushvalue(L, 3);
-	lua_call(L, nargs, LUA_MULTRET);
-	return lua_gettop(L)-nargs;
+	luaL_argcheck(L, pos <= b->size, 3, "initial position out of Buffer");
+	return unpack_format(L, 2, (const char *)b->bytes, b->size, pos);
 }
 
-LUA_METHOD(Buffer, contains) {
+//-------------------------------------[ Typed accessors ]
+typedef enum { NumInt, NumUInt, NumFloat } NumKind;
+static const char *endians[] = { "le", "be", NULL };
+
+static void push_number(lua_State *L, const BYTE *p, int size, NumKind kind, int big) {
+	UINT64 v = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		v |= (UINT64)p[big ? size-1-i : i] << (8*i);
+	if (kind == NumFloat) {
+		if (size == sizeof(float)) {
+			UINT32 u = (UINT32)v;
+			float f;
+			memcpy(&f, &u, sizeof(float));
+			lua_pushnumber(L, f);
+		} else {
+			double d;
+			memcpy(&d, &v, sizeof(double));
+			lua_pushnumber(L, d);
+		}
+	} else {
+		//--- sign extension
+		if (kind == NumInt && size < 8 && (v >> (size*8-1)) & 1)
+			v |= ~(UINT64)0 << (size*8);
+		lua_pushinteger(L, (lua_Integer)v);
+	}
+}
+
+static void store_number(lua_State *L, BYTE *p, int size, NumKind kind, int big, int idx) {
+	UINT64 v;
+	int i;
+
+	if (kind == NumFloat) {
+		if (size == sizeof(float)) {
+			float f = (float)luaL_checknumber(L, idx);
+			UINT32 u;
+			memcpy(&u, &f, sizeof(float));
+			v = u;
+		} else {
+			double d = (double)luaL_checknumber(L, idx);
+			memcpy(&v, &d, sizeof(double));
+		}
+	} else {
+		lua_Integer n = luaL_checkinteger(L, idx);
+		if (size < 8) {
+			lua_Integer lim = (lua_Integer)1 << (size*8 - (kind == NumInt));
+			luaL_argcheck(L, kind == NumInt ? (-lim <= n && n < lim) : (n >= 0 && n < lim), idx, "integer overflow");
+		}
+		v = (UINT64)n;
+	}
+	for (i = 0; i < size; i++)
+		p[big ? size-1-i : i] = (BYTE)(v >> (8*i));
+}
+
+//--- Returns the position (from 0) of size bytes at the offset at index idx (from 1, negative values count from the end)
+static size_t check_offset(lua_State *L, Buffer *b, int idx, int size) {
+	lua_Integer offset = luaL_optinteger(L, idx, 1);
+
+	if (offset < 0)
+		offset += (lua_Integer)b->size + 1;
+	if (offset < 1 || (size_t)(offset-1) > b->size || b->size - (size_t)(offset-1) < (size_t)size)
+		luaL_error(L, "out of bounds offset for Buffer");
+	return (size_t)(offset-1);
+}
+
+static int buff_read(lua_State *L, int size, NumKind kind) {
+	Buffer *b = lua_self(L, 1, Buffer);
+	size_t pos = check_offset(L, b, 2, size);
+
+	push_number(L, b->bytes+pos, size, kind, luaL_checkoption(L, 3, "le", endians));
+	return 1;
+}
+
+static int buff_write(lua_State *L, int size, NumKind kind) {
 	Buffer *b = lua_self(L, 1, Buffer);
+	size_t pos = check_offset(L, b, 2, size);
+	int big = luaL_checkoption(L, 4, "le", endians);
+
+	buff_writable(L, b);
+	store_number(L, b->bytes+pos, size, kind, big, 3);
+	return 0;
+}
+
+//--- Buffer:readXXX(offset, endian) and Buffer:writeXXX(offset, value, endian)
+#define BUFFER_ACCESSORS(name, size, kind) \
+	LUA_METHOD(Buffer, read##name) { return buff_read(L, size, kind); } \
+	LUA_METHOD(Buffer, write##name) { return buff_write(L, size, kind); }
+
+BUFFER_ACCESSORS(u8, 1, NumUInt)
+BUFFER_ACCESSORS(i8, 1, NumInt)
+BUFFER_ACCESSORS(u16, 2, NumUInt)
+BUFFER_ACCESSORS(i16, 2, NumInt)
+BUFFER_ACCESSORS(u32, 4, NumUInt)
+BUFFER_ACCESSORS(i32, 4, NumInt)
+BUFFER_ACCESSORS(u64, 8, NumUInt)
+BUFFER_ACCESSORS(i64, 8, NumInt)
+BUFFER_ACCESSORS(f32, 4, NumFloat)
+BUFFER_ACCESSORS(f64, 8, NumFloat)
+
+LUA_METHOD(Buffer, contains) {
+	Buffer *b = lua_self(L, 1, Buffer), *needle;
+	const char *str, *pos;
 	size_t len;
-	const char *str = luaL_tolstring(L, 2, &len);
-	const char *pos;
-  	const char *last = (const char *) b->bytes + b->size - len;
-  	BOOL result = FALSE;
-
-  	if (len && (b->size > len))
-	  	for (pos = (const char *)b->bytes; pos <= last; ++pos)
-			if (pos[0] == ((const char *) str)[0] && !memcmp ((const void *) &pos[1], (const void *) ((const char *) str + 1), len - 1)) {
-				result = TRUE;
-				break;
-			}
-  	if (result)
+
+	//--- Buffer needles are searched for their bytes, without converting them to a string
+	if ((needle = lua_iscinstance(L, 2, TBuffer))) {
+		str = (const char *)needle->bytes;
+		len = needle->size;
+	} else str = luaL_tolstring(L, 2, &len);
+	pos = len ? mem_find((const char *)b->bytes, b->size, str, len) : NULL;
+
+  	if (pos)
   		lua_pushinteger(L, pos-(char*)b->bytes+1);
 	else
-  		lua_pushboolean(L, result);
-	return 2;
+  		lua_pushboolean(L, FALSE);
+	return 1;
 }
 
 LUA_PROPERTY_GET(Buffer, encoding) {
@@ -269,12 +535,19 @@ LUA_PROPERTY_GET(Buffer, len) {
 
 LUA_PROPERTY_SET(Buffer, len) {
 	Buffer *b = lua_self(L, 1, Buffer);
-	b->size = (size_t)luaL_checkinteger(L, 2);
-	if ( (b->bytes = realloc(b->bytes, b->size)) == NULL)
-		luaL_error(L, "Buffer allocation error: not enough memory");
+	size_t size = (size_t)luaL_checkinteger(L, 2);
+	buff_own(L, b, b->capacity);
+	if (size > b->capacity)
+		buff_realloc(L, b, size);
+	b->size = size;
 	return 0;
 }
 
+LUA_PROPERTY_GET(Buffer, capacity) {
+	lua_pushinteger(L, lua_self(L, 1, Buffer)->capacity);
+	return 1;
+}
+
 LUA_METHOD(Buffer, __index) {
 	Buffer *b = lua_self(L, 1, Buffer);
 	lua_Integer idx, i;
@@ -300,20 +573,27 @@ LUA_METHOD(Buffer, __metanewindex) {
 		luaL_error(L, "out of bounds index for Buffer");
 	if (value<0 || value>255)
 		luaL_error(L, "invalid value (byte overflow)");
+	buff_writable(L, b);
 	b->bytes[i] = (BYTE)value;
 	return 0;
 }
 
 
-int hex_encode(lua_State *L, const char *bb, size_t len) {
-    static const char xx[]= "0123456789ABCDEF";
-	int n = len*2;
-	char *xp = malloc(n);
-    while (--n >= 0)
-		xp[n] = xx[(bb[n>>1] >> ((1 - (n&1)) << 2)) & 0xF];
-	lua_pushlstring(L, xp, len*2);
-	free(xp);
-	return 1;
+//--- Encode directly in the resulting Lua string
+static void push_encoded(lua_State *L, Buffer *b, int encoding) {
+	luaL_Buffer lb;
+	char *p = luaL_buffinitsize(L, &lb, encoding == 3 ? 2*b->size : base64_encoded_size(b->size));
+	size_t n;
+
+	if (encoding == 3)
+		n = hex_encode(b->bytes, b->size, p);
+	else {
+		CodecState st;
+		codec_init(&st, encoding == 4);
+		n = base64_encode(&st, b->bytes, b->size, p);
+		n += base64_encode_end(&st, p+n);
+	}
+	luaL_pushresultsize(&lb, n);
 }
 
 static int do_encode(lua_State *L, int encoding) {
@@ -321,8 +601,9 @@ static int do_encode(lua_State *L, int encoding) {
 	switch(encoding) {
 		case 0:		lua_pushlstring(L, (const char *)b->bytes, b->size); break;
 		case 1:		lua_pushlwstring(L, (wchar_t*)b->bytes, b->size / 2); break;
-		case 2:		base64_encode(L, b); break;
-		case 3:		hex_encode(L, (const char *)b->bytes, b->size); break;
+		case 2:
+		case 3:
+		case 4:		push_encoded(L, b, encoding); break;
 		default:	luaL_error(L, "unknown encoding '%s'", encodings[encoding]); 
 	}		
 	return 1;
@@ -343,8 +624,7 @@ LUA_METHOD(Buffer, __len) {
 
 LUA_METHOD(Buffer, __gc) {
 	Buffer *b = lua_self(L, 1, Buffer);
-	if (b->size)
-		free(b->bytes);
+	buff_free(L, b);
 	free(b);
 	return 0;
 }
@@ -403,11 +683,184 @@ const luaL_Reg Buffer_methods[] = {
 	{"pack",		Buffer_pack},
 	{"unpack",		Buffer_unpack},
 	{"append",		Buffer_append},
+	{"reserve",		Buffer_reserve},
+	{"clear",		Buffer_clear},
+	{"unmap",		Buffer_unmap},
 	{"contains",	Buffer_contains},
+	{"readu8",		Buffer_readu8},
+	{"readi8",		Buffer_readi8},
+	{"readu16",		Buffer_readu16},
+	{"readi16",		Buffer_readi16},
+	{"readu32",		Buffer_readu32},
+	{"readi32",		Buffer_readi32},
+	{"readu64",		Buffer_readu64},
+	{"readi64",		Buffer_readi64},
+	{"readf32",		Buffer_readf32},
+	{"readf64",		Buffer_readf64},
+	{"writeu8",		Buffer_writeu8},
+	{"writei8",		Buffer_writei8},
+	{"writeu16",	Buffer_writeu16},
+	{"writei16",	Buffer_writei16},
+	{"writeu32",	Buffer_writeu32},
+	{"writei32",	Buffer_writei32},
+	{"writeu64",	Buffer_writeu64},
+	{"writei64",	Buffer_writei64},
+	{"writef32",	Buffer_writef32},
+	{"writef64",	Buffer_writef64},
 	{"encode",		Buffer_encode},
 	{"set_size",	Buffer_setlen},
 	{"get_size",	Buffer_getlen},
+	{"get_capacity",Buffer_getcapacity},
+	{"get_mapped",	Buffer_getmapped},
 	{"set_encoding",Buffer_setencoding},
 	{"get_encoding",Buffer_getencoding},
 	{NULL, NULL}
-};
\ No newline at end of file
+};
+
+//-------------------------------------[ Reader object ]
+luart_type TReader;
+
+LUA_CONSTRUCTOR(Reader) {
+	Buffer *b = luaL_checkcinstance(L, 2, Buffer);
+	int big = luaL_checkoption(L, 3, "le", endians);
+	Reader *r = calloc(1, sizeof(Reader));
+
+	r->buffer = b;
+	r->big = big;
+	lua_pushvalue(L, 2);
+	r->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_newinstance(L, r, Reader);
+	return 1;
+}
+
+//--- Returns the current position and advances it by size bytes
+static size_t reader_take(lua_State *L, Reader *r, size_t size) {
+	size_t pos = r->pos;
+
+	if (pos > r->buffer->size || r->buffer->size - pos < size)
+		luaL_error(L, "not enough data in Buffer");
+	r->pos += size;
+	return pos;
+}
+
+static int reader_read(lua_State *L, int size, NumKind kind) {
+	Reader *r = lua_self(L, 1, Reader);
+	int big = lua_isnoneornil(L, 2) ? r->big : luaL_checkoption(L, 2, NULL, endians);
+	size_t pos = reader_take(L, r, size);
+
+	push_number(L, r->buffer->bytes+pos, size, kind, big);
+	return 1;
+}
+
+#define READER_ACCESSOR(name, size, kind) \
+	LUA_METHOD(Reader, read##name) { return reader_read(L, size, kind); }
+
+READER_ACCESSOR(u8, 1, NumUInt)
+READER_ACCESSOR(i8, 1, NumInt)
+READER_ACCESSOR(u16, 2, NumUInt)
+READER_ACCESSOR(i16, 2, NumInt)
+READER_ACCESSOR(u32, 4, NumUInt)
+READER_ACCESSOR(i32, 4, NumInt)
+READER_ACCESSOR(u64, 8, NumUInt)
+READER_ACCESSOR(i64, 8, NumInt)
+READER_ACCESSOR(f32, 4, NumFloat)
+READER_ACCESSOR(f64, 8, NumFloat)
+
+//--- Returns a Buffer view on the next n bytes (all remaining bytes by default)
+LUA_METHOD(Reader, read) {
+	Reader *r = lua_self(L, 1, Reader);
+	Buffer *b = r->buffer;
+	size_t size, pos;
+
+	reader_take(L, r, 0);
+	size = (size_t)luaL_optinteger(L, 2, (lua_Integer)(b->size - r->pos));
+	pos = reader_take(L, r, size);
+	if (!b->block)
+		b->block = block_new(L, b->bytes, LUA_NOREF);
+	buff_pushview(L, b->block, b->bytes+pos, size, b->encoding);
+	return 1;
+}
+
+LUA_METHOD(Reader, skip) {
+	Reader *r = lua_self(L, 1, Reader);
+	reader_take(L, r, (size_t)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+LUA_METHOD(Reader, unpack) {
+	Reader *r = lua_self(L, 1, Reader);
+	Buffer *b = r->buffer;
+	int n;
+
+	reader_take(L, r, 0);
+	n = unpack_format(L, 2, (const char *)b->bytes, b->size, r->pos);
+	r->pos = (size_t)lua_tointeger(L, -1) - 1;
+	lua_pop(L, 1);
+	return n - 1;
+}
+
+LUA_PROPERTY_GET(Reader, position) {
+	lua_pushinteger(L, lua_self(L, 1, Reader)->pos + 1);
+	return 1;
+}
+
+LUA_PROPERTY_SET(Reader, position) {
+	Reader *r = lua_self(L, 1, Reader);
+	lua_Integer pos = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, pos >= 1 && (size_t)(pos-1) <= r->buffer->size, 2, "position out of Buffer");
+	r->pos = (size_t)(pos-1);
+	return 0;
+}
+
+LUA_PROPERTY_GET(Reader, remaining) {
+	Reader *r = lua_self(L, 1, Reader);
+	lua_pushinteger(L, r->pos < r->buffer->size ? r->buffer->size - r->pos : 0);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Reader, buffer) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lua_self(L, 1, Reader)->ref);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Reader, endian) {
+	lua_pushstring(L, endians[lua_self(L, 1, Reader)->big]);
+	return 1;
+}
+
+LUA_PROPERTY_SET(Reader, endian) {
+	lua_self(L, 1, Reader)->big = luaL_checkoption(L, 2, NULL, endians);
+	return 0;
+}
+
+LUA_METHOD(Reader, __gc) {
+	Reader *r = lua_self(L, 1, Reader);
+	luaL_unref(L, LUA_REGISTRYINDEX, r->ref);
+	free(r);
+	return 0;
+}
+
+OBJECT_MEMBERS(Reader)
+	READWRITE_PROPERTY(Reader, position)
+	READWRITE_PROPERTY(Reader, endian)
+	READONLY_PROPERTY(Reader, remaining)
+	READONLY_PROPERTY(Reader, buffer)
+	METHOD(Reader, read)
+	METHOD(Reader, readu8)
+	METHOD(Reader, readi8)
+	METHOD(Reader, readu16)
+	METHOD(Reader, readi16)
+	METHOD(Reader, readu32)
+	METHOD(Reader, readi32)
+	METHOD(Reader, readu64)
+	METHOD(Reader, readi64)
+	METHOD(Reader, readf32)
+	METHOD(Reader, readf64)
+	METHOD(Reader, skip)
+	METHOD(Reader, unpack)
+END
+
+OBJECT_METAFIELDS(Reader)
+	METHOD(Reader, __gc)
+END
@@ -21,6 +21,8 @@
 #include <fcntl.h>
 #include <shlwapi.h>
 
+#include "pool.h"
+
 luart_type TDirectory;
 
 LUA_API wchar_t *luaL_checkDirname(lua_State *L, int idx) {
@@ -177,30 +179,633 @@ LUA_METHOD(Directory, list) {
 	return 1;
 }
 
-static BOOL removeall_dir(wchar_t *path) {
-	if ( SetCurrentDirectoryW(path)) {
-        WIN32_FIND_DATAW fdata;
-        HANDLE h = FindFirstFileW(L"*.*", &fdata);
-        while (h != INVALID_HANDLE_VALUE) {
-            wchar_t *fname = fdata.cFileName;
-            if (wcscmp(fname, L".") && wcscmp(fname, L"..")) {
-				if (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-               		if (!removeall_dir(fname))
-			   			return FALSE;
-				} else { 
-					if (!DeleteFileW(fname))
-						return FALSE;
+//-------------------------------------[ Directory.walk ]
+
+//--- Entries of one enumerated directory, their UTF8 paths being stored in the names buffer
+typedef struct {
+	size_t		name;
+	size_t		len;
+	BOOL		isdir;
+	UINT64		size;
+	FILETIME	modified;
+} WalkEntry;
+
+typedef struct WalkBatch {
+	struct WalkBatch	*next;
+	WalkEntry			*entries;
+	size_t				count;
+	char				*names;
+	size_t				nameslen;
+	wchar_t				**dirs;		//--- subdirectories to walk
+	size_t				ndirs;
+	int					depth;
+} WalkBatch;
+
+typedef struct WalkDir {
+	struct WalkDir		*next;
+	wchar_t				*path;
+	int					depth;
+} WalkDir;
+
+//--- Walker state, shared with the worker pool Jobs in parallel mode
+typedef struct {
+	volatile LONG		refs;
+	volatile LONG		cancel;
+	int					maxdepth;
+	wchar_t				*filter;
+	CRITICAL_SECTION	lock;
+	HANDLE				ready;
+	WalkBatch			*completed;	//--- batches enumerated by the worker pool
+	WalkBatch			*last;
+	//--- only used by the iterating thread
+	BOOL				stat;
+	int					parallel;
+	int					inflight;
+	WalkBatch			*current;
+	size_t				pos;
+	WalkDir				*pending;
+} Walker;
+
+typedef struct {
+	Job			job;
+	Walker		*walker;
+	wchar_t		*path;
+	int			depth;
+} WalkJob;
+
+static void *grow(void *ptr, size_t *capacity, size_t needed, size_t size) {
+	if (needed > *capacity) {
+		*capacity = needed > *capacity*2 ? needed : *capacity*2;
+		ptr = realloc(ptr, *capacity*size);
+	}
+	return ptr;
+}
+
+//--- Enumerates one directory, using the metadata returned by the enumeration itself
+static WalkBatch *walk_dir(Walker *w, const wchar_t *path, int depth) {
+	WalkBatch *batch = calloc(1, sizeof(WalkBatch));
+	size_t len = wcslen(path), ecap = 0, ncap = 0, dcap = 0;
+	wchar_t *full = malloc(sizeof(wchar_t)*(len+MAX_PATH+2));
+	WIN32_FIND_DATAW data;
+	HANDLE h;
+
+	batch->depth = depth;
+	_snwprintf(full, len+3, L"%s\\*", path);
+	if ((h = FindFirstFileExW(full, FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH)) != INVALID_HANDLE_VALUE) {
+		do {
+			BOOL isdir = data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+			if (data.cFileName[0] == L'.' && (!data.cFileName[1] || (data.cFileName[1] == L'.' && !data.cFileName[2])))
+				continue;
+			wcscpy(full+len+1, data.cFileName);
+			//--- directory links are not followed, to avoid cycles
+			if (isdir && !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) && (!w->maxdepth || depth < w->maxdepth)) {
+				batch->dirs = grow(batch->dirs, &dcap, batch->ndirs+1, sizeof(wchar_t*));
+				batch->dirs[batch->ndirs++] = wcsdup(full);
+			}
+			if (!w->filter || PathMatchSpecW(data.cFileName, w->filter)) {
+				WalkEntry *e;
+				int size = WideCharToMultiByte(CP_UTF8, 0, full, -1, NULL, 0, NULL, NULL);
+				batch->entries = grow(batch->entries, &ecap, batch->count+1, sizeof(WalkEntry));
+				batch->names = grow(batch->names, &ncap, batch->nameslen+size, 1);
+				e = &batch->entries[batch->count++];
+				e->name = batch->nameslen;
+				e->len = WideCharToMultiByte(CP_UTF8, 0, full, -1, batch->names+batch->nameslen, size, NULL, NULL)-1;
+				e->isdir = isdir;
+				e->size = ((UINT64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+				e->modified = data.ftLastWriteTime;
+				batch->nameslen += size;
+			}
+		} while (!w->cancel && FindNextFileW(h, &data));
+		FindClose(h);
+	}
+	free(full);
+	return batch;
+}
+
+static void walk_freebatch(WalkBatch *batch) {
+	size_t i;
+
+	for (i = 0; i < batch->ndirs; i++)
+		free(batch->dirs[i]);
+	free(batch->dirs);
+	free(batch->entries);
+	free(batch->names);
+	free(batch);
+}
+
+static void walk_release(Walker *w) {
+	if (InterlockedDecrement(&w->refs) == 0) {
+		WalkBatch *batch;
+		WalkDir *dir;
+		while ((batch = w->completed)) {
+			w->completed = batch->next;
+			walk_freebatch(batch);
+		}
+		if (w->current)
+			walk_freebatch(w->current);
+		while ((dir = w->pending)) {
+			w->pending = dir->next;
+			free(dir->path);
+			free(dir);
+		}
+		DeleteCriticalSection(&w->lock);
+		CloseHandle(w->ready);
+		free(w->filter);
+		free(w);
+	}
+}
+
+static void walk_push(Walker *w, wchar_t *path, int depth) {
+	WalkDir *dir = malloc(sizeof(WalkDir));
+	dir->path = path;
+	dir->depth = depth;
+	dir->next = w->pending;
+	w->pending = dir;
+}
+
+//--- Makes batch the current one, its subdirectories being walked next
+static void walk_take(Walker *w, WalkBatch *batch) {
+	size_t i = batch->ndirs;
+
+	while (i)
+		walk_push(w, batch->dirs[--i], batch->depth+1);
+	batch->ndirs = 0;
+	if (w->current)
+		walk_freebatch(w->current);
+	w->current = batch;
+	w->pos = 0;
+}
+
+static DWORD __stdcall WalkThread(LPVOID data) {
+	WalkJob *job = (WalkJob *)data;
+	Walker *w = job->walker;
+	WalkBatch *batch = w->cancel ? calloc(1, sizeof(WalkBatch)) : walk_dir(w, job->path, job->depth);
+
+	EnterCriticalSection(&w->lock);
+	if (w->last)
+		w->last->next = batch;
+	else w->completed = batch;
+	w->last = batch;
+	LeaveCriticalSection(&w->lock);
+	SetEvent(w->ready);
+	free(job->path);
+	free(job);
+	walk_release(w);
+	return 0;
+}
+
+//--- Returns the next enumerated batch, or NULL when the walk is done
+static WalkBatch *walk_next(Walker *w) {
+	WalkBatch *batch = NULL;
+	WalkDir *dir;
+
+	if (!w->parallel) {
+		if ((dir = w->pending)) {
+			w->pending = dir->next;
+			batch = walk_dir(w, dir->path, dir->depth);
+			free(dir->path);
+			free(dir);
+		}
+		return batch;
+	}
+	//--- at most parallel directories are enumerated at once, so that memory stays bounded
+	while (w->inflight < w->parallel && (dir = w->pending)) {
+		WalkJob *job = calloc(1, sizeof(WalkJob));
+		w->pending = dir->next;
+		job->job.func = WalkThread;
+		job->job.userdata = job;
+		job->walker = w;
+		job->path = dir->path;
+		job->depth = dir->depth;
+		free(dir);
+		InterlockedIncrement(&w->refs);
+		w->inflight++;
+		pool_queue_blocking(&job->job);
+	}
+	while (w->inflight) {
+		EnterCriticalSection(&w->lock);
+		if ((batch = w->completed) && !(w->completed = batch->next))
+			w->last = NULL;
+		LeaveCriticalSection(&w->lock);
+		if (batch) {
+			w->inflight--;
+			batch->next = NULL;
+			break;
+		}
+		WaitForSingleObject(w->ready, INFINITE);
+	}
+	return batch;
+}
+
+static int walk_iter(lua_State *L) {
+	Walker *w = *(Walker **)lua_touserdata(L, lua_upvalueindex(1));
+	WalkBatch *batch;
+
+	while (w) {
+		if (w->current && w->pos < w->current->count) {
+			WalkEntry *e = &w->current->entries[w->pos++];
+			lua_pushlstring(L, w->current->names + e->name, e->len);
+			lua_pushstring(L, e->isdir ? "directory" : "file");
+			if (!w->stat)
+				return 2;
+			lua_pushinteger(L, (lua_Integer)e->size);
+			//--- FILETIME counts 100ns intervals since 1601, converted to seconds since the Unix epoch
+			lua_pushnumber(L, ((lua_Number)(((UINT64)e->modified.dwHighDateTime << 32) | e->modified.dwLowDateTime) - 116444736000000000.0) / 10000000.0);
+			return 4;
+		}
+		if (!(batch = walk_next(w)))
+			break;
+		walk_take(w, batch);
+	}
+	return 0;
+}
+
+static int walk_close(lua_State *L) {
+	Walker **w = (Walker **)lua_touserdata(L, 1);
+	if (*w) {
+		InterlockedExchange(&(*w)->cancel, TRUE);
+		walk_release(*w);
+		*w = NULL;
+	}
+	return 0;
+}
+
+LUA_METHOD(Directory, walk) {
+	Directory *dir = lua_self(L, 1, Directory);
+	Walker *w = calloc(1, sizeof(Walker));
+	Walker **ud;
+
+	w->refs = 1;
+	InitializeCriticalSection(&w->lock);
+	w->ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+	//--- the userdata is created first, so that the Walker gets released on errors
+	ud = (Walker **)lua_newuserdatauv(L, sizeof(Walker *), 0);
+	*ud = w;
+	if (luaL_newmetatable(L, "Directory.walk")) {
+		lua_pushcfunction(L, walk_close);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, walk_close);
+		lua_setfield(L, -2, "__close");
+	}
+	lua_setmetatable(L, -2);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "depth") != LUA_TNIL)
+			luaL_argcheck(L, (w->maxdepth = (int)luaL_checkinteger(L, -1)) > 0, 2, "depth must be greater than zero");
+		if (lua_getfield(L, 2, "filter") != LUA_TNIL) {
+			luaL_checkstring(L, -1);
+			w->filter = lua_towstring(L, -1);
+		}
+		w->stat = lua_getfield(L, 2, "stat") != LUA_TNIL && lua_toboolean(L, -1);
+		if (lua_getfield(L, 2, "parallel") == LUA_TNUMBER)
+			luaL_argcheck(L, (w->parallel = (int)lua_tointeger(L, -1)) >= 0, 2, "parallel cannot be negative");
+		else if (lua_toboolean(L, -1))
+			w->parallel = (int)pool_size()*2;
+		lua_pop(L, 4);
+	}
+	walk_push(w, wcsdup(dir->fullpath), 1);
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, walk_iter, 1);
+	lua_insert(L, -2);
+	lua_pushnil(L);
+	lua_insert(L, -2);
+	lua_pushnil(L);
+	lua_insert(L, -2);
+	return 4;
+}
+
+//-------------------------------------[ Parallel copy and remove ]
+
+#define TREE_BATCH 64		//--- files copied or deleted by a single work item
+
+//--- Directories are released once enumerated and once all their children are done
+typedef struct TreeNode {
+	struct TreeNode	*parent;
+	volatile LONG	remaining;
+	wchar_t			*src;
+	wchar_t			*dst;
+} TreeNode;
+
+//--- A work item enumerates a directory, or processes a batch of its files
+typedef struct TreeWork {
+	struct TreeWork	*next;
+	TreeNode		*dir;
+	size_t			count;
+	wchar_t			*names[TREE_BATCH];
+} TreeWork;
+
+typedef struct {
+	volatile LONG		refs;
+	volatile LONG		stop;		//--- set on cancellation or on the first error
+	volatile LONG		failed;
+	volatile LONG		runners;
+	volatile LONG		files;		//--- files found
+	volatile LONG		done;		//--- files copied or deleted
+	BOOL				remove;
+	LONG				max;		//--- maximum concurrent runners
+	CRITICAL_SECTION	lock;
+	TreeWork			*work;
+	HANDLE				wakeup;
+	HANDLE				finished;
+	Job					*job;		//--- Job running the operation for a Task, or NULL
+	int					ref;		//--- progress callback
+	LONG				step;
+	LONG				reported;
+	BOOL				cancel;
+} TreeOp;
+
+typedef struct {
+	Job			job;
+	TreeOp		*op;
+} TreeJobRunner;
+
+static void tree_release(TreeOp *op) {
+	if (InterlockedDecrement(&op->refs) == 0) {
+		TreeWork *w;
+		while ((w = op->work)) {
+			op->work = w->next;
+			while (w->count)
+				free(w->names[--w->count]);
+			free(w);
+		}
+		DeleteCriticalSection(&op->lock);
+		CloseHandle(op->wakeup);
+		CloseHandle(op->finished);
+		free(op);
+	}
+}
+
+static BOOL tree_stopped(TreeOp *op) {
+	return op->stop || (op->job && op->job->cancelled);
+}
+
+static void tree_fail(TreeOp *op) {
+	InterlockedExchange(&op->failed, TRUE);
+	InterlockedExchange(&op->stop, TRUE);
+}
+
+static wchar_t *tree_path(const wchar_t *dir, const wchar_t *name) {
+	size_t len = wcslen(dir) + wcslen(name) + 2;
+	wchar_t *result = malloc(sizeof(wchar_t)*len);
+	_snwprintf(result, len, L"%s\\%s", dir, name);
+	return result;
+}
+
+static void tree_done(TreeOp *op, TreeNode *node) {
+	while (node && InterlockedDecrement(&node->remaining) == 0) {
+		TreeNode *parent = node->parent;
+		if (op->remove && !tree_stopped(op) && !RemoveDirectoryW(node->src))
+			tree_fail(op);
+		if (!parent)
+			SetEvent(op->finished);
+		free(node->src);
+		free(node->dst);
+		free(node);
+		node = parent;
+	}
+}
+
+static DWORD __stdcall TreeRunner(LPVOID data);
+
+//--- Queues a work item, starting a new runner on the worker pool if the limit is not reached
+static void tree_push(TreeOp *op, TreeWork *w) {
+	BOOL start = FALSE;
+
+	InterlockedIncrement(&w->dir->remaining);
+	EnterCriticalSection(&op->lock);
+	w->next = op->work;
+	op->work = w;
+	if (op->runners < op->max) {
+		op->runners++;
+		start = TRUE;
+	}
+	LeaveCriticalSection(&op->lock);
+	SetEvent(op->wakeup);
+	if (start) {
+		TreeJobRunner *runner = calloc(1, sizeof(TreeJobRunner));
+		runner->job.func = TreeRunner;
+		runner->job.userdata = runner;
+		runner->op = op;
+		InterlockedIncrement(&op->refs);
+		pool_queue_blocking(&runner->job);
+	}
+}
+
+static TreeWork *tree_work(TreeNode *dir) {
+	TreeWork *w = calloc(1, sizeof(TreeWork));
+	w->dir = dir;
+	return w;
+}
+
+static void tree_enumerate(TreeOp *op, TreeNode *dir) {
+	WIN32_FIND_DATAW data;
+	wchar_t *pattern;
+	TreeWork *batch = NULL;
+	HANDLE h;
+
+	if (!op->remove && !CreateDirectoryW(dir->dst, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		tree_fail(op);
+		return;
+	}
+	pattern = tree_path(dir->src, L"*");
+	h = FindFirstFileExW(pattern, FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	free(pattern);
+	if (h == INVALID_HANDLE_VALUE) {
+		tree_fail(op);
+		return;
+	}
+	do {
+		if (data.cFileName[0] == L'.' && (!data.cFileName[1] || (data.cFileName[1] == L'.' && !data.cFileName[2])))
+			continue;
+		//--- directory links are not followed : they are removed without their target content, and not copied
+		if ((data.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) == (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT) && !op->remove)
+			continue;
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+			TreeNode *child = calloc(1, sizeof(TreeNode));
+			child->parent = dir;
+			child->src = tree_path(dir->src, data.cFileName);
+			child->dst = op->remove ? NULL : tree_path(dir->dst, data.cFileName);
+			InterlockedIncrement(&dir->remaining);
+			tree_push(op, tree_work(child));
+		} else {
+			if (!batch)
+				batch = tree_work(dir);
+			batch->names[batch->count++] = wcsdup(data.cFileName);
+			InterlockedIncrement(&op->files);
+			if (batch->count == TREE_BATCH) {
+				tree_push(op, batch);
+				batch = NULL;
+			}
+		}
+	} while (!tree_stopped(op) && FindNextFileW(h, &data));
+	FindClose(h);
+	if (batch)
+		tree_push(op, batch);
+}
+
+static void tree_process(TreeOp *op, TreeWork *w) {
+	if (!w->count) {
+		if (!tree_stopped(op))
+			tree_enumerate(op, w->dir);
+		tree_done(op, w->dir);
+	} else {
+		while (w->count) {
+			wchar_t *name = w->names[--w->count];
+			if (!tree_stopped(op)) {
+				wchar_t *src = tree_path(w->dir->src, name);
+				BOOL ok;
+				if (op->remove) {
+					if (!(ok = DeleteFileW(src)) && (GetFileAttributesW(src) & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) == (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT))
+						ok = RemoveDirectoryW(src);
+				} else {
+					wchar_t *dst = tree_path(w->dir->dst, name);
+					ok = CopyFileW(src, dst, FALSE);
+					free(dst);
 				}
+				if (ok)
+					InterlockedIncrement(&op->done);
+				else tree_fail(op);
+				free(src);
 			}
-            if (!FindNextFileW(h, &fdata))
-                break;
-        }
-        FindClose(h);
-        SetCurrentDirectory("..");
-		return RemoveDirectoryW(path);
-    }
-	return FALSE;
-}	
+			free(name);
+		}
+		tree_done(op, w->dir);
+	}
+	free(w);
+}
+
+//--- Runners process work items until there are no more
+static DWORD __stdcall TreeRunner(LPVOID data) {
+	TreeOp *op = ((TreeJobRunner *)data)->op;
+	TreeWork *w;
+
+	free(data);
+	for (;;) {
+		EnterCriticalSection(&op->lock);
+		if ((w = op->work))
+			op->work = w->next;
+		else op->runners--;
+		LeaveCriticalSection(&op->lock);
+		if (!w)
+			break;
+		tree_process(op, w);
+	}
+	tree_release(op);
+	return 0;
+}
+
+//--- Runs the operation from the calling thread, that also processes work items until all are done
+static DWORD __stdcall TreeRun(LPVOID data) {
+	TreeOp *op = (TreeOp *)data;
+	HANDLE handles[2] = { op->finished, op->wakeup };
+	TreeWork *w;
+
+	while (WaitForSingleObject(op->finished, 0) != WAIT_OBJECT_0) {
+		EnterCriticalSection(&op->lock);
+		if ((w = op->work))
+			op->work = w->next;
+		LeaveCriticalSection(&op->lock);
+		if (w)
+			tree_process(op, w);
+		else WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+	}
+	return !op->failed && !tree_stopped(op);
+}
+
+static DWORD __stdcall TreeJob(LPVOID data) {
+	DWORD result = TreeRun(data);
+	tree_release((TreeOp *)data);
+	return result;
+}
+
+static TreeOp *tree_start(const wchar_t *src, const wchar_t *dst, BOOL remove) {
+	TreeOp *op = calloc(1, sizeof(TreeOp));
+	TreeNode *root = calloc(1, sizeof(TreeNode));
+	DWORD attrib = GetFileAttributesW(src);
+
+	op->refs = 1;
+	op->remove = remove;
+	op->max = (LONG)pool_size();
+	op->ref = LUA_NOREF;
+	InitializeCriticalSection(&op->lock);
+	op->wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+	op->finished = CreateEvent(NULL, TRUE, FALSE, NULL);
+	root->src = wcsdup(src);
+	root->dst = dst ? wcsdup(dst) : NULL;
+	root->remaining = 1;
+	if (attrib == INVALID_FILE_ATTRIBUTES || !(attrib & FILE_ATTRIBUTE_DIRECTORY))
+		tree_fail(op);
+	else tree_push(op, tree_work(root));
+	//--- the root node is released once its enumeration is done
+	tree_done(op, root);
+	return op;
+}
+
+//--- Directory.copy() and Directory.removeall() run on the calling thread, helped by the worker pool
+//--- They are synchronous : the Lua thread cannot resume other Tasks until the operation is done
+static int tree_wait(lua_State *L, const wchar_t *src, const wchar_t *dst, BOOL remove) {
+	TreeOp *op = tree_start(src, dst, remove);
+	lua_pushboolean(L, TreeRun(op));
+	tree_release(op);
+	return 1;
+}
+
+static int TreeTaskContinue(lua_State* L, int status, lua_KContext ctx) {
+	TreeOp *op = (TreeOp *)ctx;
+
+	if (status == STILL_ACTIVE) {
+		//--- progress callback, called at most once every step files
+		if (!op->cancel && op->ref != LUA_NOREF && op->done - op->reported >= op->step) {
+			op->reported = op->done;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, op->ref);
+			lua_pushinteger(L, op->done);
+			lua_pushinteger(L, op->files);
+			lua_call(L, 2, 1);
+			if ((op->cancel = lua_isnil(L, -1) ? FALSE : !lua_toboolean(L, -1)))
+				InterlockedExchange(&op->stop, TRUE);
+		}
+		return 0;
+	}
+	if (op->cancel)
+		return 0;
+	lua_pushboolean(L, status);
+	return 1;
+}
+
+static int gc_treeTask(lua_State *L) {
+	TreeOp *op = (TreeOp *)lua_self(L, 1, Task)->userdata;
+
+	InterlockedExchange(&op->stop, TRUE);
+	luaL_unref(L, LUA_REGISTRYINDEX, op->ref);
+	tree_release(op);
+	return 0;
+}
+
+static int tree_task(lua_State *L, const wchar_t *src, const wchar_t *dst, BOOL remove, int idx) {
+	TreeOp *op = tree_start(src, dst, remove);
+
+	//--- one reference for the Task, one for the running Job
+	InterlockedIncrement(&op->refs);
+	if (lua_isfunction(L, idx)) {
+		lua_pushvalue(L, idx);
+		op->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		op->step = (LONG)luaL_optinteger(L, idx+1, 1);
+	}
+	lua_pushjob(L, TreeJob, TreeTaskContinue, op, gc_treeTask, op->ref != LUA_NOREF ? 50 : INFINITE);
+	op->job = lua_self(L, -1, Task)->job;
+	return 1;
+}
+
+//-------------------------------------[ Directory.removeall ]
+//--- Blocks the calling thread, and any running Task, until the whole tree is removed
+//--- Directory.removealltask() is the non-blocking way, returning a Task
+LUA_METHOD(Directory, removeall) {
+	return tree_wait(L, lua_self(L, 1, Directory)->fullpath, NULL, TRUE);
+}
+
+LUA_METHOD(Directory, removealltask) {
+	return tree_task(L, lua_self(L, 1, Directory)->fullpath, NULL, TRUE, 2);
+}
 
 wchar_t * GetCurrentDir() {
 	DWORD size = GetCurrentDirectoryW(0, NULL)+1;
@@ -209,74 +814,28 @@ wchar_t * GetCurrentDir() {
 	return current;
 }
 
-LUA_METHOD(Directory, removeall) {
-	wchar_t *current = GetCurrentDir();
-	lua_pushboolean(L, removeall_dir(lua_self(L, 1, Directory)->fullpath));
-	SetCurrentDirectoryW(current);
-	free(current);
-    return 1;
-}
-
-BOOL DirectoryCopy(const wchar_t* sourceDir, const wchar_t* destDir) {
-    WIN32_FIND_DATAW findFileData;
-    HANDLE hFind;
-
-    CreateDirectoryW(destDir, NULL);
-    wchar_t searchPattern[1024];
-    _snwprintf(searchPattern, 1024, L"%s\\*.*", sourceDir);
-    hFind = FindFirstFileW(searchPattern, &findFileData);
-    if (hFind == INVALID_HANDLE_VALUE)
-       return FALSE;
-
-    do {
-        const wchar_t* name = findFileData.cFileName;
-        if (wcscmp(name, L".") == 0 || wcscmp(name, L"..") == 0)
-            continue;
-        wchar_t sourcePath[1024];
-        wchar_t destPath[1024];
-        _snwprintf(sourcePath, 1024, L"%s\\%s", sourceDir, name);
-        _snwprintf(destPath, 1024, L"%s\\%s", destDir, name);
-
-        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-           	if (!DirectoryCopy(sourcePath, destPath))
-				return FALSE;
-        } else {
-            if (!CopyFileW(sourcePath, destPath, FALSE)) 
-				return FALSE;
-        }
-    } while (FindNextFileW(hFind, &findFileData));
-
-    FindClose(hFind);
-	return TRUE;
-}
-
-static DWORD __stdcall DirCopy(LPVOID data) {
-	return DirectoryCopy(((AsyncIO*)data)->from, ((AsyncIO*)data)->to);
-}
-
+//-------------------------------------[ Directory.copytask ]
+//--- Returns a Task that copies the tree on the worker pool, without blocking other Tasks
 LUA_METHOD(Directory, copytask) {
 	if (lua_iscinstance(L, 2, TFile) )
 		luaL_typeerror(L, 2, "Directory");
 	else {
-		AsyncIO *async = calloc(1, sizeof(AsyncIO));
-		async->from = lua_self(L, 1, Directory)->fullpath;
-		async->to = luaL_checkFilename(L, 2);
-		lua_pushtask(L, IOTaskContinue, async, gc_asyncTask);
-		lua_pushvalue(L, -1);
-		if ((async->thread = CreateThread(NULL, 0, DirCopy, async, 0, NULL)))
-			lua_call(L, 0, 0);
-		else luaL_error(L, "new thread creation failed");
-		return 1;
+		wchar_t *to = luaL_checkFilename(L, 2);
+		tree_task(L, lua_self(L, 1, Directory)->fullpath, to, FALSE, 3);
+		free(to);
 	}
 	return 1;
 }
 
+//-------------------------------------[ Directory.copy ]
+//--- Blocks the calling thread, and any running Task, until the whole tree is copied
+//--- Directory.copytask() is the non-blocking way, returning a Task
 LUA_METHOD(Directory, copy) {
 	if ( lua_iscinstance(L, 2, TFile) )
 		luaL_typeerror(L, 2, "Directory");
 	else {
-		wchar_t *to = luaL_checkFilename(L, 2);		
-		lua_pushboolean(L, DirectoryCopy(lua_self(L, 1, Directory)->fullpath, to));
+		wchar_t *to = luaL_checkFilename(L, 2);
+		tree_wait(L, lua_self(L, 1, Directory)->fullpath, to, FALSE);
 		free(to);
 	}
 	return 1;
@@ -317,11 +876,13 @@ const luaL_Reg Directory_methods[] = {
 	{"make",			Directory_make},
 	{"remove",			File_remove},
 	{"removeall",		Directory_removeall},
+	{"removealltask",	Directory_removealltask},
 	{"get_isempty",		Directory_getisempty},
 	{"move",			File_move},
 	{"copy",			Directory_copy},
 	{"copytask",		Directory_copytask},
 	{"list",			Directory_list},
+	{"walk",			Directory_walk},
 	{"get_name",		File_getfilename},
 	{"get_parent",		File_getparent},
 	{"get_path",		File_getpath},
@@ -22,6 +22,7 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <shlwapi.h>
+#include <wchar.h>
 
 luart_type TFile;
 
@@ -104,6 +105,47 @@ LUA_API Encoding detectBOM(FILE *f) {
 	return ASCII;;
 }
 
+//-------------------------------------[ File read-ahead ]
+
+//--- Returns the number of bytes available in the read-ahead buffer, reading more from the stream
+//--- when less than need bytes are left
+static size_t readahead_fill(lua_State *L, File *f, size_t need) {
+	size_t left = f->rlen - f->rpos;
+
+	if (left < need) {
+		if (!f->rbuf && !(f->rbuf = malloc(FILE_READAHEAD)))
+			luaL_error(L, "File read error: not enough memory");
+		memmove(f->rbuf, f->rbuf + f->rpos, left);
+		f->rpos = 0;
+		f->rlen = left + fread(f->rbuf + left, 1, FILE_READAHEAD - left, f->stream);
+		left = f->rlen;
+	}
+	return left;
+}
+
+//--- Discards the read-ahead buffer, moving the stream back to the current reading position
+static void readahead_sync(File *f) {
+	if (f->rlen && f->stream)
+		_fseeki64(f->stream, -(__int64)(f->rlen - f->rpos), SEEK_CUR);
+	f->rpos = f->rlen = 0;
+}
+
+//--- End of File is reached only when the read-ahead buffer is empty too
+static BOOL readahead_eof(lua_State *L, File *f) {
+	if (f->std || (f->mode > 0 && f->mode < 3))
+		return feof(f->stream);
+	return f->rpos == f->rlen && !readahead_fill(L, f, 1);
+}
+
+static void readahead_free(File *f) {
+	free(f->rbuf);
+	f->rbuf = NULL;
+	f->rpos = f->rlen = 0;
+	free(f->wbuf);
+	f->wbuf = NULL;
+	f->wsize = 0;
+}
+
 //-------------------------------------[ File.open() ]
 LUA_API LUA_METHOD(File, open) {
 	File *f;
@@ -114,9 +156,11 @@ LUA_API LUA_METHOD(File, open) {
 	if (!f->std) {
 		if (f->stream)
 			fclose(f->stream);
+		readahead_free(f);
 		f->stream = _wfopen(f->fullpath, file_values[mode]);
 		if (!f->stream)
 			luaL_error(L, "File open failed '%s'", strerror(errno));
+		setvbuf(f->stream, NULL, _IOFBF, f->bufsize ? f->bufsize : FILE_BUFFERSIZE);
 		f->mode = mode;
 		if (mode < 2) {
 			f->encoding = detectBOM(f->stream);
@@ -144,32 +188,91 @@ LUA_API LUA_METHOD(File, open) {
 }
 
 //-------------------------------------[ File.write() ]
+
+//--- Values smaller than this are gathered in the File scratch buffer and written at once
+#define FILE_GATHER 16384
+
+static size_t file_put(File *f, const char *data, size_t len) {
+	size_t r, done = 0;
+
+	while (done < len && (r = fwrite(data + done, 1, len - done, f->stream)))
+		done += r;
+	return done;
+}
+
+static char *file_scratch(lua_State *L, File *f, size_t size) {
+	if (size > f->wsize) {
+		char *wbuf = realloc(f->wbuf, size);
+		if (!wbuf)
+			luaL_error(L, "File write error: not enough memory");
+		f->wbuf = wbuf;
+		f->wsize = size;
+	}
+	return f->wbuf;
+}
+
+//--- Writes the values from index first to last, gathering them in one fwrite() call when possible
+//--- Strings are converted to UTF16 when the File uses the "unicode" encoding
+static size_t file_write(lua_State *L, File *f, int first, int last, BOOL eol) {
+	size_t done = 0, used = 0, len;
+	BOOL unicode = f->encoding == _UNICODE;
+	const char *data;
+	int i;
+
+	readahead_sync(f);
+	for (i = first; i <= last + eol; i++) {
+		BOOL convert = unicode && (i > last || lua_isstring(L, i));
+		if (i > last) {
+			data = "\r\n";
+			len = 2;
+		} else if (lua_isstring(L, i))
+			data = lua_tolstring(L, i, &len);
+		else data = luaL_tolstring(L, i, &len);
+		if (len * (convert ? 2 : 1) > FILE_GATHER) {
+			//--- large values are written directly
+			done += file_put(f, f->wbuf, used);
+			used = 0;
+			if (convert) {
+				int units = MultiByteToWideChar(CP_UTF8, 0, data, (int)len, (wchar_t *)file_scratch(L, f, len*2), (int)len);
+				done += file_put(f, f->wbuf, units*sizeof(wchar_t));
+			} else done += file_put(f, data, len);
+		} else {
+			if (used + len*2 > FILE_GATHER*2) {
+				done += file_put(f, f->wbuf, used);
+				used = 0;
+			}
+			file_scratch(L, f, FILE_GATHER*2);
+			if (convert)
+				used += MultiByteToWideChar(CP_UTF8, 0, data, (int)len, (wchar_t *)(f->wbuf + used), (int)len)*sizeof(wchar_t);
+			else {
+				memcpy(f->wbuf + used, data, len);
+				used += len;
+			}
+		}
+		if (i <= last && !lua_isstring(L, i))
+			lua_pop(L, 1);
+	}
+	done += file_put(f, f->wbuf, used);
+	if (f->autoflush)
+		fflush(f->stream);
+	return done;
+}
+
+//--- Writes raw bytes at the current reading position, as File:write() does
+size_t file_writebytes(File *f, const void *data, size_t len) {
+	readahead_sync(f);
+	len = file_put(f, data, len);
+	if (f->autoflush)
+		fflush(f->stream);
+	return len;
+}
+
 LUA_METHOD(File, write) {
 	File *f = lua_self(L, 1, File);
 	if (f->stream) {
-		char *buf;
-		size_t wsize;
-		int len;
-		size_t r, done = 0;
 		if (!f->mode)
 			luaL_error(L, "error: File not opened for writing");
-		if (f->encoding == _UNICODE) {
-			if (!lua_isstring(L, 2))
-				buf = (char*)luaL_tolstring(L, 2, &wsize);
-			else {
-				buf = (char*)lua_tolwstring(L, 2, &len);
-				wsize = len * sizeof(wchar_t);
-			}
-		}
-		else
-			buf = (char*)luaL_tolstring(L, 2, &wsize);
-		while (done < wsize && (r = fwrite(buf + done, 1, wsize - done, f->stream)))
-			done += r;
-		if (f->encoding == _UNICODE)
-			free(buf);
-		lua_pushinteger(L, done);
-		if (f->std)
-			fflush(f->stream);
+		lua_pushinteger(L, file_write(L, f, 2, lua_gettop(L), FALSE));
 		return 1;
 	}
 	return luaL_error(L, "error: File not opened for writing");
@@ -177,23 +280,20 @@ LUA_METHOD(File, write) {
 //-------------------------------------[ File.writeln() ]
 LUA_METHOD(File, writeln) {
 	File *f = lua_self(L, 1, File);
-	if (lua_gettop(L) > 1)
-		File_write(L);
-	if (f->encoding == _UNICODE)
-		fputws(L"\r\n", f->stream);
-	else
-		fputs("\r\n", f->stream);
-	return 1;
+	if (f->stream) {
+		if (!f->mode)
+			luaL_error(L, "error: File not opened for writing");
+		lua_pushinteger(L, file_write(L, f, 2, lua_gettop(L), TRUE));
+		return 1;
+	}
+	return luaL_error(L, "error: File not opened for writing");
 }
 
 static int FileRead(lua_State *L, File *f, size_t size, BOOL line) {
 	luaL_Buffer b;
-	char buff[4];
-	wchar_t *c = (wchar_t*)buff;
 	int nbytes = f->std ? 2 : encoding_size[f->encoding];
 	size_t todo = size;
-	size_t utf8size;
-	DWORD i = 0, last = 0;
+	DWORD i = 0;
 	extern wchar_t echochar;
 
 	if (f->mode > 0 && f->mode < 3)
@@ -273,23 +373,49 @@ readstd:
 		} else goto readstd;
 	}
 	else if (f->stream) {
-		while ( (fread(buff, nbytes, 1, f->stream)) ) {
-			if (f->encoding == UTF8 && ((utf8size = utf8_charsize(buff)) > 1)) {
-				fread(buff+1, utf8size-1, 1, f->stream);
-				luaL_addlstring(&b, buff, utf8size);
+		//--- size counts characters (bytes, UTF8 characters or UTF16 units), 0 reads until the end of File
+		BOOL utf8 = f->encoding == UTF8;
+		size_t avail, n;
+		char *p, *nl;
+
+		while (!size || todo) {
+			//--- large binary reads bypass the read-ahead buffer
+			if (!f->encoding && !line && f->rpos == f->rlen && (!size || todo >= FILE_READAHEAD)) {
+				n = size ? todo : FILE_READAHEAD;
+				if (!(n = fread(luaL_prepbuffsize(&b, n), 1, n, f->stream)))
+					break;
+				luaL_addsize(&b, n);
+				todo -= size ? n : 0;
 				continue;
 			}
-			if (((nbytes == 2) && (*c == 10)) || ((nbytes == 1) && (*buff == 10))) {
-				if (f->encoding && last == 13)
-					b.n = b.n-nbytes;
+			if ((avail = readahead_fill(L, f, nbytes)) < (size_t)nbytes)
+				break;
+			p = f->rbuf + f->rpos;
+			n = avail - avail % nbytes;
+			if (size)
+				n = utf8 ? (size_t)(utf8_lpos(p, n, todo) - p) : (todo*nbytes < n ? todo*nbytes : n);
+			if ((line || f->encoding) && (nl = nbytes == 2 ? (char *)wmemchr((wchar_t *)p, L'\n', n/2) : memchr(p, '\n', n)))
+				n = nl - p;
+			else nl = NULL;
+			luaL_addlstring(&b, p, n);
+			f->rpos += n;
+			if (size)
+				todo -= utf8 ? utf8_count(p, n) : n/nbytes;
+			if (nl) {
+				//--- CR LF end of lines are translated to LF when reading text
+				f->rpos += nbytes;
+				if (f->encoding && luaL_bufflen(&b) && (nbytes == 2 ? *(wchar_t *)(luaL_buffaddr(&b) + luaL_bufflen(&b) - 2) : luaL_buffaddr(&b)[luaL_bufflen(&b)-1]) == 13)
+					luaL_buffsub(&b, nbytes);
 				if (line)
 					break;
+				luaL_addlstring(&b, nl, nbytes);
+				if (size)
+					todo--;
 			}
-			last = nbytes == 2 ? *c : *buff;
-			luaL_addlstring(&b, buff, nbytes);
-			if (!--todo)
-				break;
 		}
+		//--- the last UTF8 character may continue at the start of the next block
+		while (utf8 && size && readahead_fill(L, f, 1) && ((unsigned char)f->rbuf[f->rpos] & 0xC0) == 0x80)
+			luaL_addchar(&b, f->rbuf[f->rpos++]);
 	}
 	else
 		luaL_error(L, "could not read, File is not open");
@@ -331,11 +457,76 @@ LUA_METHOD(File, readln) {
 //-------------------------------------[ File.flush() ]
 LUA_METHOD(File, flush) {
 	File *f = lua_self(L, 1, File);
-	if (f->stream)
+	if (f->stream) {
+		readahead_sync(f);
 		fflush(f->stream);
+	}
 	return 0;
 }
 
+//-------------------------------------[ File.map() ]
+static const char *map_modes[] = { "read", "write", "copy", NULL };
+static const DWORD map_protect[] = { PAGE_READONLY, PAGE_READWRITE, PAGE_WRITECOPY };
+static const DWORD map_access[] = { FILE_MAP_READ, FILE_MAP_WRITE, FILE_MAP_COPY };
+
+static int map_error(lua_State *L, HANDLE h, HANDLE hmap) {
+	DWORD err = GetLastError();
+
+	if (hmap)
+		CloseHandle(hmap);
+	if (h != INVALID_HANDLE_VALUE)
+		CloseHandle(h);
+	luaL_getlasterror(L, err);
+	return luaL_error(L, "failed to map File : %s", lua_tostring(L, -1));
+}
+
+//--- Returns a Buffer on the mapped File content (offset starts from 1, raw bytes including any BOM)
+//--- "read" Buffers are copied on first modification, "write" and "copy" Buffers are modified in place
+LUA_METHOD(File, map) {
+	File *f = lua_self(L, 1, File);
+	int mode = luaL_checkoption(L, 2, "read", map_modes);
+	lua_Integer offset = luaL_optinteger(L, 3, 1);
+	HANDLE h, hmap = NULL;
+	LARGE_INTEGER fsize;
+	ULONGLONG start, aligned, length;
+	SYSTEM_INFO si;
+	BYTE *view;
+
+	luaL_argcheck(L, offset > 0, 3, "offset out of range");
+	if (f->stream)
+		fflush(f->stream);
+	h = CreateFileW(f->fullpath, mode == 1 ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE || !GetFileSizeEx(h, &fsize))
+		return map_error(L, h, NULL);
+	start = (ULONGLONG)offset - 1;
+	if (start > (ULONGLONG)fsize.QuadPart) {
+		CloseHandle(h);
+		return luaL_argerror(L, 3, "offset out of range");
+	}
+	length = lua_isnoneornil(L, 4) ? (ULONGLONG)fsize.QuadPart - start : (ULONGLONG)luaL_checkinteger(L, 4);
+	if ((lua_Integer)length < 0 || length > (ULONGLONG)fsize.QuadPart - start || length > (SIZE_T)-1) {
+		CloseHandle(h);
+		return luaL_argerror(L, 4, "length out of range");
+	}
+	if (!length) {
+		CloseHandle(h);
+		lua_pushinstance(L, Buffer, 0);
+		return 1;
+	}
+	//--- mapped views must start on the allocation granularity
+	GetSystemInfo(&si);
+	aligned = start - start % si.dwAllocationGranularity;
+	if (!(hmap = CreateFileMappingW(h, NULL, map_protect[mode], 0, 0, NULL)))
+		return map_error(L, h, NULL);
+	if (!(view = MapViewOfFile(hmap, map_access[mode], (DWORD)(aligned >> 32), (DWORD)aligned, (SIZE_T)(length + start - aligned))))
+		return map_error(L, h, hmap);
+	//--- the view keeps the mapping alive
+	CloseHandle(hmap);
+	CloseHandle(h);
+	buffer_pushmapping(L, view, view + (start - aligned), (size_t)length, mode > 0);
+	return 1;
+}
+
 //-------------------------------------[ File.close() ]
 LUA_API LUA_METHOD(File, close) {
 	File *f = lua_self(L, 1, File);
@@ -345,6 +536,7 @@ LUA_API LUA_METHOD(File, close) {
 		f->stream = 0;
 		f->h = 0;
 	}
+	readahead_free(f);
 	if (f->stdstream) {
 		f->std = TRUE;
 		f->encoding = UTF8;
@@ -366,32 +558,38 @@ LUA_METHOD(File, remove) {
 //-------------------------------------[ File.copy ]
 int IOTaskContinue(lua_State* L, int status, lua_KContext ctx) {
     AsyncIO *async = (AsyncIO*)ctx;
-	DWORD result;
 
-	if (async->cancel)
-		return 0;
-    if (WaitForSingleObject(async->thread, 0) == WAIT_OBJECT_0) {
-        GetExitCodeThread(async->thread, &result); 
-		lua_pushboolean(L, result);
-        return 1;
-    }
-	if (async->ref) {
-		if (lua_rawgeti(L, LUA_REGISTRYINDEX, async->ref)) {
+	if (status == STILL_ACTIVE) {
+		//--- copy in progress
+		if (!async->cancel && lua_rawgeti(L, LUA_REGISTRYINDEX, async->ref)) {
 			lua_pushnumber(L, async->totalfilesize.QuadPart);
 			lua_pushnumber(L, async->transferred.QuadPart);
 			lua_call(L, 2, 1);
 			async->cancel = lua_isnil(L, -1) ? FALSE : !lua_toboolean(L, -1);
-			lua_pop(L, 1);
 		}
+		return 0;
+	}
+	if (async->cancel)
+		return 0;
+	lua_pushboolean(L, status);
+	return 1;
+}
+
+static void async_release(AsyncIO *async) {
+	if (InterlockedDecrement(&async->refs) == 0) {
+		free(async->from);
+		free(async->to);
+		free(async);
 	}
-    return lua_yieldk(L, 0, ctx, IOTaskContinue);
 }
 
+//--- the copy may still be running when the Task is collected : stop it, the Job releasing the AsyncIO last
 int gc_asyncTask(lua_State *L) {
     AsyncIO *async = (AsyncIO*)lua_self(L, 1, Task)->userdata;
-    CloseHandle(async->thread);
-    free(async->to);
-    free(async);
+	async->cancel = TRUE;
+	if (async->ref)
+		luaL_unref(L, LUA_REGISTRYINDEX, async->ref);
+	async_release(async);
     return 0;
 }
 
@@ -411,7 +609,10 @@ static DWORD __stdcall FileCopy(LPVOID data) {
     AsyncIO *async = (AsyncIO*)data;
 
 	COPYFILE2_EXTENDED_PARAMETERS cpp = {sizeof(COPYFILE2_EXTENDED_PARAMETERS), COPY_FILE_FAIL_IF_EXISTS | COPY_FILE_NO_BUFFERING, NULL, CopyProgressRoutine, async};
-	return SUCCEEDED(CopyFile2(async->from, async->to, &cpp));
+	DWORD result = SUCCEEDED(CopyFile2(async->from, async->to, &cpp));
+
+	async_release(async);
+	return result;
 }
 
 //-------------------------------------[ File.copytask ]
@@ -419,18 +620,15 @@ LUA_METHOD(File, copytask) {
 	File *f = lua_self(L, 1, File);
 	AsyncIO *async = calloc(1, sizeof(AsyncIO));
 	
-	async->from = f->fullpath;
+	//--- the File may be collected while copying
+	async->from = _wcsdup(f->fullpath);
 	async->to = lua_towstring(L, 2);
+	async->refs = 2;
 	if (lua_isfunction(L, 3)) {
 		lua_pushvalue(L, 3);
 		async->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	}
-	lua_pushtask(L, IOTaskContinue, async, gc_asyncTask);
-    lua_pushvalue(L, -1);
-    if ((async->thread = CreateThread(NULL, 0, FileCopy, async, 0, NULL)))
-        lua_call(L, 0, 0);
-	else luaL_error(L, "new thread creation failed");
-	return 1;
+	return lua_pushjob(L, FileCopy, IOTaskContinue, async, gc_asyncTask, async->ref ? 50 : INFINITE);
 }
 
 //-------------------------------------[ File.copy ]
@@ -632,7 +830,7 @@ LUA_METHOD(File, setmodified) {
 LUA_METHOD(File, getposition) {
 	File *f = lua_self(L, 1, File);
 	if (f->stream)
-		lua_pushinteger(L, _ftelli64( f->stream)-1);
+		lua_pushinteger(L, _ftelli64( f->stream)-1-(lua_Integer)(f->rlen-f->rpos));
 	else
 		lua_pushnil(L);
 	return 1;
@@ -645,8 +843,10 @@ LUA_METHOD(File, setposition) {
 	if (pos == 0)
 		luaL_error(L, "zero is an invalid File.position value");
 
-	if (f->stream)
+	if (f->stream) {
+		f->rpos = f->rlen = 0;
 		_fseeki64(f->stream, (pos-1) + bom_size[f->encoding], SEEK_SET);
+	}
 	return 0;
 }
 
@@ -654,12 +854,42 @@ LUA_METHOD(File, setposition) {
 LUA_METHOD(File, geteof) {
 	File *f = lua_self(L, 1, File);
 	if (f->stream)
-		lua_pushboolean(L, feof(f->stream));
+		lua_pushboolean(L, readahead_eof(L, f));
 	else
 		lua_pushnil(L);
 	return 1;
 }
 
+//-------------------------------------[ File.buffersize ]
+LUA_METHOD(File, getbuffersize) {
+	File *f = lua_self(L, 1, File);
+	lua_pushinteger(L, f->bufsize ? f->bufsize : FILE_BUFFERSIZE);
+	return 1;
+}
+
+LUA_METHOD(File, setbuffersize) {
+	File *f = lua_self(L, 1, File);
+	lua_Integer size = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, size > 1 && size <= INT_MAX, 2, "invalid buffer size");
+	//--- setvbuf() cannot be called once the stream has been used : the size applies from the next File:open()
+	f->bufsize = (size_t)size;
+	return 0;
+}
+
+//-------------------------------------[ File.autoflush ]
+LUA_METHOD(File, getautoflush) {
+	lua_pushboolean(L, lua_self(L, 1, File)->autoflush);
+	return 1;
+}
+
+LUA_METHOD(File, setautoflush) {
+	File *f = lua_self(L, 1, File);
+	if ((f->autoflush = lua_toboolean(L, 2)) && f->stream)
+		fflush(f->stream);
+	return 0;
+}
+
 //-------------------------------------[ File.encoding ]
 LUA_METHOD(File, getencoding) {
 	File *f = lua_self(L, 1, File);
@@ -670,7 +900,7 @@ LUA_METHOD(File, getencoding) {
 //-------------------------------------[ File.lines ]
 static int iterate_lines(lua_State *L) {
 	File *f = lua_self(L, lua_upvalueindex(1), File);
-	if (feof(f->stream))
+	if (readahead_eof(L, f))
 		return 0;
 	FileRead(L, f, 0, TRUE);
 	return 1;
@@ -690,6 +920,7 @@ const luaL_Reg File_methods[] = {
 	{"read",			File_read},
 	{"readln",			File_readln},
 	{"flush",			File_flush},
+	{"map",				File_map},
 	{"remove",			File_remove},
 	{"copy",			File_copy},
 	{"copytask",		File_copytask},
@@ -711,6 +942,10 @@ const luaL_Reg File_methods[] = {
 	{"set_position",	File_setposition},
 	{"get_eof",			File_geteof},
 	{"get_encoding",	File_getencoding},
+	{"get_buffersize",	File_getbuffersize},
+	{"set_buffersize",	File_setbuffersize},
+	{"get_autoflush",	File_getautoflush},
+	{"set_autoflush",	File_setautoflush},
 	{"get_lines",		File_getlines},
 	{"get_created",		File_getcreated},
 	{"get_modified",	File_getmodified},
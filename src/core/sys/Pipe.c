@@ -102,7 +102,8 @@ static int PipeReadTaskContinue(lua_State* L, int status, lua_KContext ctx) {
 	}
 	if ((exitCode != STILL_ACTIVE) || !p->out_read)
 		return 0;
-	return lua_yieldk(L, 0, ctx, PipeReadTaskContinue);
+	//--- anonymous pipes are not waitable : check them periodically until the delay expires, or wait for the process to exit
+	return lua_waitevent(L, p->pi.hProcess, p->delay > GetTickCount64() ? 10 : INFINITE, ctx, PipeReadTaskContinue);
 }
 
 LUA_METHOD(Pipe, read) {
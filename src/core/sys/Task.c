@@ -65,8 +65,8 @@ LUA_METHOD(Task, __call) {
 //----------------------------------[ Task destructor ]
 LUA_METHOD(Task, __gc) {
 	Task *t = lua_self(L, 1, Task);
-	if (t->status != TTerminated)
-		close_task(t);
+	t->status = TTerminated;
+	unwait_task(t);
 	if (t->gc_func)
 		t->gc_func(L);
 	free(t);
@@ -0,0 +1,425 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | Watcher.c | LuaRT Watcher object implementation
+*/
+
+#define LUA_LIB
+
+#include <Watcher.h>
+#include <Task.h>
+#include <luart.h>
+#include <stdlib.h>
+
+luart_type TWatcher;
+
+#define WATCHER_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION)
+
+//-------------------------------------[ WatcherState functions ]
+static BOOL watcher_arm(WatcherState *w) {
+	return ReadDirectoryChangesW(w->dir, w->buffer, WATCHER_BUFFER, w->recursive, WATCHER_FILTER, NULL, &w->ov, NULL);
+}
+
+//--- Waiting Tasks are woken up, and get the remaining changes
+static void watcher_close(WatcherState *w) {
+	if (!w->closed) {
+		DWORD bytes;
+		w->closed = TRUE;
+		if (w->dir != INVALID_HANDLE_VALUE) {
+			CancelIoEx(w->dir, &w->ov);
+			GetOverlappedResult(w->dir, &w->ov, &bytes, TRUE);
+			CloseHandle(w->dir);
+			w->dir = INVALID_HANDLE_VALUE;
+		}
+		SetEvent(w->ov.hEvent);
+	}
+}
+
+static void watcher_release(lua_State *L, WatcherState *w) {
+	if (--w->refs == 0) {
+		watcher_close(w);
+		CloseHandle(w->ov.hEvent);
+		luaL_unref(L, LUA_REGISTRYINDEX, w->changes);
+		luaL_unref(L, LUA_REGISTRYINDEX, w->index);
+		free(w->buffer);
+		free(w->path);
+		free(w);
+	}
+}
+
+//-------------------------------------[ Changes coalescing ]
+
+//--- Pushes a new change for the path at the top of the stack, replacing it
+static void change_new(lua_State *L, WatcherState *w, const char *action) {
+	lua_createtable(L, 0, 3);
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, "path");
+	lua_pushstring(L, action);
+	lua_setfield(L, -2, "action");
+	lua_rawgeti(L, LUA_REGISTRYINDEX, w->changes);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, luaL_len(L, -2) + 1);
+	lua_pop(L, 1);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, w->index);
+	lua_pushvalue(L, -3);
+	lua_pushvalue(L, -3);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	lua_remove(L, -2);
+}
+
+//--- Replaces the nil at the top of the stack by a new change for the path below it
+static void change_push(lua_State *L, WatcherState *w, const char *action) {
+	lua_pop(L, 1);
+	lua_pushvalue(L, -1);
+	change_new(L, w, action);
+}
+
+//--- Pushes the pending change for the path at the top of the stack, or nil
+static int change_get(lua_State *L, WatcherState *w) {
+	int type;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, w->index);
+	lua_pushvalue(L, -2);
+	type = lua_rawget(L, -2);
+	lua_remove(L, -2);
+	return type;
+}
+
+//--- Drops the change at the top of the stack, that won't be delivered
+static void change_drop(lua_State *L, WatcherState *w) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, w->index);
+	lua_getfield(L, -2, "path");
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	lua_setfield(L, -2, "action");
+}
+
+static BOOL change_is(lua_State *L, int idx, const char *action) {
+	BOOL result;
+	lua_getfield(L, idx, "action");
+	result = !strcmp(lua_tostring(L, -1), action);
+	lua_pop(L, 1);
+	return result;
+}
+
+static void push_path(lua_State *L, WatcherState *w, FILE_NOTIFY_INFORMATION *info) {
+	lua_pushwstring(L, w->path);
+	lua_pushstring(L, "\\");
+	lua_pushlwstring(L, info->FileName, info->FileNameLength/sizeof(wchar_t));
+	lua_concat(L, 3);
+}
+
+//--- Merges a notification with the pending change on the same path
+static void change_add(lua_State *L, WatcherState *w, FILE_NOTIFY_INFORMATION *info, int from) {
+	BOOL exists;
+
+	push_path(L, w, info);
+	exists = change_get(L, w) == LUA_TTABLE;
+	switch (info->Action) {
+		case FILE_ACTION_ADDED:
+			if (!exists)
+				change_push(L, w, "added");
+			else if (change_is(L, -1, "removed")) {
+				lua_pushstring(L, "modified");
+				lua_setfield(L, -2, "action");
+			}
+			break;
+		case FILE_ACTION_REMOVED:
+			if (!exists)
+				change_push(L, w, "removed");
+			else if (change_is(L, -1, "added"))
+				change_drop(L, w);
+			else if (change_is(L, -1, "renamed")) {
+				//--- a renamed then removed entry was removed from its original path
+				change_drop(L, w);
+				lua_getfield(L, -1, "from");
+				change_new(L, w, "removed");
+				lua_pop(L, 1);
+			} else {
+				lua_pushstring(L, "removed");
+				lua_setfield(L, -2, "action");
+			}
+			break;
+		case FILE_ACTION_MODIFIED:
+			if (!exists)
+				change_push(L, w, "modified");
+			break;
+		case FILE_ACTION_RENAMED_NEW_NAME: {
+			const char *action = "renamed";
+			//--- the renamed entry replaces any change on its new path
+			if (exists)
+				change_drop(L, w);
+			lua_pop(L, 1);
+			if (!from) {
+				change_new(L, w, "added");
+				lua_pop(L, 1);
+				return;
+			}
+			lua_pushvalue(L, from);
+			if (change_get(L, w) == LUA_TTABLE) {
+				if (change_is(L, -1, "added"))
+					action = "added";
+				else if (change_is(L, -1, "renamed")) {
+					//--- keeps the original path of entries renamed several times
+					lua_getfield(L, -1, "from");
+					lua_replace(L, -3);
+				}
+				change_drop(L, w);
+			}
+			lua_pop(L, 1);
+			if (lua_rawequal(L, -1, -2))
+				action = "modified";
+			lua_pushvalue(L, -2);
+			change_new(L, w, action);
+			if (*action == 'r') {
+				lua_pushvalue(L, -2);
+				lua_setfield(L, -2, "from");
+			}
+			lua_pop(L, 3);
+			return;
+		}
+	}
+	lua_pop(L, 2);
+}
+
+//--- Reads the available notifications and queues the next read
+static void watcher_read(lua_State *L, WatcherState *w) {
+	DWORD bytes = 0;
+	int top = lua_gettop(L), from = 0;
+	BOOL done = GetOverlappedResult(w->dir, &w->ov, &bytes, FALSE);
+
+	//--- the watched directory may have been removed, or the handle became invalid
+	if (!done && GetLastError() != ERROR_NOTIFY_ENUM_DIR) {
+		watcher_close(w);
+		return;
+	}
+	if (done && bytes) {
+		FILE_NOTIFY_INFORMATION *info = (FILE_NOTIFY_INFORMATION *)w->buffer;
+		for (;;) {
+			if (info->Action == FILE_ACTION_RENAMED_OLD_NAME) {
+				push_path(L, w, info);
+				from = lua_gettop(L);
+			} else {
+				change_add(L, w, info, from);
+				from = 0;
+			}
+			if (!info->NextEntryOffset)
+				break;
+			info = (FILE_NOTIFY_INFORMATION *)((BYTE *)info + info->NextEntryOffset);
+		}
+	} else {
+		//--- the notifications did not fit in the buffer (no bytes returned, or ERROR_NOTIFY_ENUM_DIR)
+		lua_pushwstring(L, w->path);
+		change_new(L, w, "overflow");
+	}
+	lua_settop(L, top);
+	w->last = GetTickCount64();
+	if (!watcher_arm(w))
+		watcher_close(w);
+}
+
+//--- Pushes the coalesced changes as an array, or returns FALSE if there are none
+static BOOL watcher_batch(lua_State *L, WatcherState *w) {
+	int i, n, count = 0;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, w->changes);
+	n = (int)luaL_len(L, -1);
+	lua_createtable(L, n, 0);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, -2, i);
+		if (lua_getfield(L, -1, "action") != LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_rawseti(L, -2, ++count);
+		} else lua_pop(L, 2);
+	}
+	lua_remove(L, -2);
+	if (n) {
+		lua_newtable(L);
+		lua_rawseti(L, LUA_REGISTRYINDEX, w->changes);
+		lua_newtable(L);
+		lua_rawseti(L, LUA_REGISTRYINDEX, w->index);
+	}
+	if (!count)
+		lua_pop(L, 1);
+	return count > 0;
+}
+
+static BOOL watcher_pending(lua_State *L, WatcherState *w) {
+	BOOL result;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, w->changes);
+	result = luaL_len(L, -1) > 0;
+	lua_pop(L, 1);
+	return result;
+}
+
+//-------------------------------------[ Watcher Constructor ]
+LUA_CONSTRUCTOR(Watcher) {
+	Watcher *wt = (Watcher *)calloc(1, sizeof(Watcher));
+	WatcherState *w = (WatcherState *)calloc(1, sizeof(WatcherState));
+	wchar_t *path;
+	DWORD len;
+
+	wt->state = w;
+	w->refs = 1;
+	w->delay = WATCHER_DELAY;
+	w->dir = INVALID_HANDLE_VALUE;
+	w->changes = w->index = LUA_NOREF;
+	w->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	//--- create the instance first, so that the WatcherState gets released on errors
+	lua_newinstance(L, wt, Watcher);
+	path = luaL_checkDirname(L, 2);
+	len = GetFullPathNameW(path, 0, NULL, NULL);
+	w->path = (wchar_t *)calloc(len+1, sizeof(wchar_t));
+	GetFullPathNameW(path, len, w->path, NULL);
+	free(path);
+	if ((len = (DWORD)wcslen(w->path)) > 3 && (w->path[len-1] == L'\\' || w->path[len-1] == L'/'))
+		w->path[len-1] = 0;
+	w->recursive = lua_toboolean(L, 3);
+	lua_newtable(L);
+	w->changes = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_newtable(L);
+	w->index = luaL_ref(L, LUA_REGISTRYINDEX);
+	w->buffer = (DWORD *)malloc(WATCHER_BUFFER);
+	w->dir = CreateFileW(w->path, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (w->dir == INVALID_HANDLE_VALUE || !watcher_arm(w)) {
+		DWORD err = GetLastError();
+		watcher_close(w);
+		lua_pushwstring(L, w->path);
+		luaL_getlasterror(L, err);
+		luaL_error(L, "failed to watch '%s' : %s", lua_tostring(L, -2), lua_tostring(L, -1));
+	}
+	return 1;
+}
+
+//-------------------------------------[ Watcher.wait() / Watcher.watch() ]
+typedef struct {
+	WatcherState	*state;
+	int				callback;	//--- LUA_NOREF for Watcher.wait()
+} Watching;
+
+static int gc_watching(lua_State *L) {
+	Watching *wg = (Watching *)lua_self(L, 1, Task)->userdata;
+	luaL_unref(L, LUA_REGISTRYINDEX, wg->callback);
+	watcher_release(L, wg->state);
+	free(wg);
+	return 0;
+}
+
+static int WatchCalled(lua_State *L, int status, lua_KContext ctx);
+
+//--- Changes are delivered once no more notifications have been received during the Watcher delay
+static int WatchTaskContinue(lua_State *L, int status, lua_KContext ctx) {
+	Watching *wg = (Watching *)ctx;
+	WatcherState *w = wg->state;
+
+	while (!w->closed && WaitForSingleObject(w->ov.hEvent, 0) == WAIT_OBJECT_0)
+		watcher_read(L, w);
+	if (watcher_pending(L, w)) {
+		ULONGLONG elapsed = GetTickCount64() - w->last;
+		if (!w->closed && elapsed < w->delay)
+			return lua_waitevent(L, w->ov.hEvent, (DWORD)(w->delay - elapsed), ctx, WatchTaskContinue);
+		if (watcher_batch(L, w)) {
+			if (wg->callback == LUA_NOREF)
+				return 1;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, wg->callback);
+			lua_insert(L, -2);
+			lua_callk(L, 1, 1, ctx, WatchCalled);
+			return WatchCalled(L, LUA_OK, ctx);
+		}
+	}
+	if (w->closed) {
+		lua_pushnil(L);
+		return 1;
+	}
+	return lua_waitevent(L, w->ov.hEvent, INFINITE, ctx, WatchTaskContinue);
+}
+
+//--- Watcher.watch() stops when the callback returns false
+static int WatchCalled(lua_State *L, int status, lua_KContext ctx) {
+	BOOL stop = !lua_isnil(L, -1) && !lua_toboolean(L, -1);
+
+	lua_pop(L, 1);
+	return stop ? 0 : WatchTaskContinue(L, LUA_OK, ctx);
+}
+
+static int push_watching(lua_State *L, int callback) {
+	Watcher *wt = lua_self(L, 1, Watcher);
+	Watching *wg = (Watching *)calloc(1, sizeof(Watching));
+
+	wg->state = wt->state;
+	wg->state->refs++;
+	wg->callback = callback;
+	return lua_pushtask(L, WatchTaskContinue, wg, gc_watching);
+}
+
+LUA_METHOD(Watcher, wait) {
+	return push_watching(L, LUA_NOREF);
+}
+
+LUA_METHOD(Watcher, watch) {
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_pushvalue(L, 2);
+	return push_watching(L, luaL_ref(L, LUA_REGISTRYINDEX));
+}
+
+//-------------------------------------[ Watcher.close() ]
+LUA_METHOD(Watcher, close) {
+	watcher_close(lua_self(L, 1, Watcher)->state);
+	return 0;
+}
+
+//-------------------------------------[ Watcher properties ]
+LUA_PROPERTY_GET(Watcher, path) {
+	lua_pushwstring(L, lua_self(L, 1, Watcher)->state->path);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Watcher, recursive) {
+	lua_pushboolean(L, lua_self(L, 1, Watcher)->state->recursive);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Watcher, closed) {
+	lua_pushboolean(L, lua_self(L, 1, Watcher)->state->closed);
+	return 1;
+}
+
+LUA_PROPERTY_GET(Watcher, delay) {
+	lua_pushinteger(L, lua_self(L, 1, Watcher)->state->delay);
+	return 1;
+}
+
+LUA_PROPERTY_SET(Watcher, delay) {
+	lua_Integer delay = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, delay >= 0, 2, "negative delay");
+	lua_self(L, 1, Watcher)->state->delay = (DWORD)delay;
+	return 0;
+}
+
+OBJECT_MEMBERS(Watcher)
+	READONLY_PROPERTY(Watcher, path)
+	READONLY_PROPERTY(Watcher, recursive)
+	READONLY_PROPERTY(Watcher, closed)
+	READWRITE_PROPERTY(Watcher, delay)
+	METHOD(Watcher, wait)
+	METHOD(Watcher, watch)
+	METHOD(Watcher, close)
+END
+
+//-------------------------------------[ Watcher destructor ]
+LUA_METHOD(Watcher, __gc) {
+	Watcher *wt = lua_self(L, 1, Watcher);
+	//--- waiting Tasks keep the WatcherState alive, and get the remaining changes
+	watcher_close(wt->state);
+	watcher_release(L, wt->state);
+	free(wt);
+	return 0;
+}
+
+OBJECT_METAFIELDS(Watcher)
+	METHOD(Watcher, __gc)
+END
@@ -0,0 +1,360 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | Worker.c | LuaRT Worker object implementation
+*/
+
+#define LUA_LIB
+
+#include <Worker.h>
+#include <Task.h>
+#include <luart.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "async.h"
+#include "serialize.h"
+
+luart_type TWorker;
+
+//-------------------------------------[ Channel functions ]
+static LONG channel_load(volatile LONG *value) {
+	return InterlockedCompareExchange(value, 0, 0);
+}
+
+static void channel_init(Channel *c) {
+	c->readable = CreateEvent(NULL, TRUE, FALSE, NULL);
+	c->writable = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+static void channel_close(Channel *c) {
+	InterlockedExchange(&c->closed, TRUE);
+	SetEvent(c->readable);
+	SetEvent(c->writable);
+}
+
+static void channel_free(Channel *c) {
+	while (c->head != c->tail)
+		free(c->slots[c->head++ % CHANNEL_SIZE].data);
+	CloseHandle(c->readable);
+	CloseHandle(c->writable);
+}
+
+//--- Returns FALSE if the Channel is full
+static BOOL channel_push(Channel *c, Message *m) {
+	LONG tail = c->tail;
+
+	ResetEvent(c->writable);
+	if (tail - channel_load(&c->head) == CHANNEL_SIZE)
+		return FALSE;
+	c->slots[tail % CHANNEL_SIZE] = *m;
+	InterlockedIncrement(&c->tail);
+	SetEvent(c->readable);
+	//--- let other waiting senders retry
+	if (tail + 1 - channel_load(&c->head) < CHANNEL_SIZE)
+		SetEvent(c->writable);
+	return TRUE;
+}
+
+//--- Returns FALSE if the Channel is empty
+static BOOL channel_pop(Channel *c, Message *m) {
+	LONG head = c->head;
+
+	ResetEvent(c->readable);
+	if (head == channel_load(&c->tail))
+		return FALSE;
+	*m = c->slots[head % CHANNEL_SIZE];
+	InterlockedIncrement(&c->head);
+	SetEvent(c->writable);
+	//--- let other waiting receivers retry
+	if (head + 1 != channel_load(&c->tail))
+		SetEvent(c->readable);
+	return TRUE;
+}
+
+//-------------------------------------[ WorkerState functions ]
+static WorkerState *worker_ref(WorkerState *w) {
+	InterlockedIncrement(&w->refs);
+	return w;
+}
+
+static void worker_release(WorkerState *w) {
+	if (InterlockedDecrement(&w->refs) == 0) {
+		channel_free(&w->in);
+		channel_free(&w->out);
+		if (w->thread)
+			CloseHandle(w->thread);
+		free(w->chunk);
+		free(w->args);
+		free(w->error);
+		free(w);
+	}
+}
+
+//--- The Worker object sends to the "in" Channel from the parent side, and to the "out" Channel inside the Worker
+#define sending(wk)		((wk)->inside ? &(wk)->state->out : &(wk)->state->in)
+#define receiving(wk)	((wk)->inside ? &(wk)->state->in : &(wk)->state->out)
+
+//-------------------------------------[ Worker thread ]
+
+//--- The Worker function results are kept for Worker:wait()
+static int WorkerTaskContinue(lua_State *L, int status, lua_KContext ctx) {
+	WorkerState *w = (WorkerState *)ctx;
+	w->args = serialize(L, 1, lua_gettop(L), &w->argslen);
+	return 0;
+}
+
+static int worker_task(lua_State *L) {
+	WorkerState *w = (WorkerState *)lua_touserdata(L, lua_upvalueindex(1));
+	lua_callk(L, lua_gettop(L) - 1, LUA_MULTRET, (lua_KContext)w, WorkerTaskContinue);
+	return WorkerTaskContinue(L, LUA_OK, (lua_KContext)w);
+}
+
+//--- The Worker function runs as a Task, as the main chunk does, so that it can sleep and await
+//--- The Lua state is closed once all its Tasks have terminated
+static int worker_main(lua_State *L) {
+	WorkerState *w = (WorkerState *)lua_touserdata(L, 1);
+	int nargs, top;
+	Task *t;
+
+	luaL_openlibs(L);
+	if (luaL_loadbuffer(L, w->chunk, w->chunklen, "=Worker"))
+		return lua_error(L);
+	lua_pushlightuserdata(L, w);
+	lua_pushinstance(L, Worker, 1);
+	lua_remove(L, -2);
+	nargs = deserialize(L, w->args, w->argslen) + 2;
+	free(w->args);
+	w->args = NULL;
+	lua_pushlightuserdata(L, w);
+	lua_pushcclosure(L, worker_task, 1);
+	t = (Task *)lua_pushinstance(L, Task, 1);
+	start_task(L, t, nargs);
+	top = lua_gettop(L);
+	while (t->status != TTerminated || running_tasks()) {
+		if (lua_schedule(L) == -1)
+			return lua_error(L);
+		lua_settop(L, top);
+	}
+	return 0;
+}
+
+static DWORD __stdcall WorkerThread(LPVOID data) {
+	WorkerState *w = (WorkerState *)data;
+	lua_State *L = luaL_newstate();
+
+	lua_pushcfunction(L, worker_main);
+	lua_pushlightuserdata(L, w);
+	if (lua_pcall(L, 1, 0, 0))
+		w->error = _strdup(lua_isstring(L, -1) ? lua_tostring(L, -1) : "error in Worker");
+	lua_close(L);
+	close_scheduler();
+	channel_close(&w->in);
+	channel_close(&w->out);
+	worker_release(w);
+	return 0;
+}
+
+static int chunk_writer(lua_State *L, const void *p, size_t size, void *ud) {
+	WorkerState *w = (WorkerState *)ud;
+
+	w->chunk = realloc(w->chunk, w->chunklen + size);
+	memcpy(w->chunk + w->chunklen, p, size);
+	w->chunklen += size;
+	return 0;
+}
+
+//-------------------------------------[ Worker Constructor ]
+LUA_CONSTRUCTOR(Worker) {
+	Worker *wk = (Worker *)calloc(1, sizeof(Worker));
+	int top = lua_gettop(L);
+	WorkerState *w;
+
+	if (lua_islightuserdata(L, 2)) {
+		wk->state = (WorkerState *)lua_touserdata(L, 2);
+		wk->inside = TRUE;
+		lua_newinstance(L, wk, Worker);
+		return 1;
+	}
+	w = (WorkerState *)calloc(1, sizeof(WorkerState));
+	wk->state = w;
+	w->refs = 1;
+	channel_init(&w->in);
+	channel_init(&w->out);
+	//--- create the instance first, so that the WorkerState gets released on errors
+	lua_newinstance(L, wk, Worker);
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		size_t len;
+		const char *src = lua_tolstring(L, 2, &len);
+		w->chunk = malloc(len);
+		memcpy(w->chunk, src, len);
+		w->chunklen = len;
+	} else {
+		const char *upvalue;
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		if (lua_iscfunction(L, 2))
+			luaL_argerror(L, 2, "expecting a Lua function or a string");
+		//--- the Worker function runs in another Lua state : it can only use its globals
+		if ((upvalue = lua_getupvalue(L, 2, 1)) && (strcmp(upvalue, "_ENV") || lua_getupvalue(L, 2, 2)))
+			luaL_argerror(L, 2, "Worker function cannot use upvalues");
+		lua_settop(L, top + 1);
+		lua_pushvalue(L, 2);
+		lua_dump(L, chunk_writer, w, 0);
+		lua_pop(L, 1);
+	}
+	w->args = serialize(L, 3, top, &w->argslen);
+	if (!(w->thread = CreateThread(NULL, 0, WorkerThread, worker_ref(w), 0, NULL))) {
+		worker_release(w);
+		luaL_getlasterror(L, GetLastError());
+		luaL_error(L, "failed to start Worker thread : %s", lua_tostring(L, -1));
+	}
+	return 1;
+}
+
+//-------------------------------------[ Worker.send() ]
+typedef struct {
+	WorkerState	*state;
+	Channel		*channel;
+	Message		msg;
+} Sending;
+
+static int SendContinue(lua_State *L, int status, lua_KContext ctx) {
+	Sending *s = (Sending *)ctx;
+	BOOL sent;
+
+	if (!(sent = (!channel_load(&s->channel->closed) && channel_push(s->channel, &s->msg)))) {
+		if (!channel_load(&s->channel->closed))
+			return lua_waitevent(L, s->channel->writable, INFINITE, ctx, SendContinue);
+		free(s->msg.data);
+	}
+	worker_release(s->state);
+	free(s);
+	lua_pushboolean(L, sent);
+	return 1;
+}
+
+LUA_METHOD(Worker, send) {
+	Worker *wk = lua_self(L, 1, Worker);
+	size_t len;
+	char *data = serialize(L, 2, lua_gettop(L), &len);
+	Sending *s = (Sending *)calloc(1, sizeof(Sending));
+
+	s->msg.data = data;
+	s->msg.len = len;
+	s->state = worker_ref(wk->state);
+	s->channel = sending(wk);
+	return SendContinue(L, LUA_OK, (lua_KContext)s);
+}
+
+//-------------------------------------[ Worker.receive() ]
+typedef struct {
+	WorkerState	*state;
+	Channel		*channel;
+} Receiving;
+
+static int gc_receiving(lua_State *L) {
+	Receiving *r = (Receiving *)lua_self(L, 1, Task)->userdata;
+	worker_release(r->state);
+	free(r);
+	return 0;
+}
+
+static int ReceiveTaskContinue(lua_State *L, int status, lua_KContext ctx) {
+	Receiving *r = (Receiving *)ctx;
+	Message msg;
+
+	if (channel_pop(r->channel, &msg)) {
+		int count = deserialize(L, msg.data, msg.len);
+		free(msg.data);
+		return count;
+	}
+	if (channel_load(&r->channel->closed)) {
+		//--- wake up other receivers of the closed Channel
+		SetEvent(r->channel->readable);
+		return 0;
+	}
+	return lua_waitevent(L, r->channel->readable, INFINITE, ctx, ReceiveTaskContinue);
+}
+
+LUA_METHOD(Worker, receive) {
+	Worker *wk = lua_self(L, 1, Worker);
+	Receiving *r = (Receiving *)calloc(1, sizeof(Receiving));
+
+	r->state = worker_ref(wk->state);
+	r->channel = receiving(wk);
+	return lua_pushtask(L, ReceiveTaskContinue, r, gc_receiving);
+}
+
+//-------------------------------------[ Worker.wait() ]
+static int gc_waiting(lua_State *L) {
+	worker_release((WorkerState *)lua_self(L, 1, Task)->userdata);
+	return 0;
+}
+
+static int WaitTaskContinue(lua_State *L, int status, lua_KContext ctx) {
+	WorkerState *w = (WorkerState *)ctx;
+
+	if (WaitForSingleObject(w->thread, 0) != WAIT_OBJECT_0)
+		return lua_waitevent(L, w->thread, INFINITE, ctx, WaitTaskContinue);
+	if (w->error)
+		luaL_error(L, "%s", w->error);
+	return w->args ? deserialize(L, w->args, w->argslen) : 0;
+}
+
+LUA_METHOD(Worker, wait) {
+	Worker *wk = lua_self(L, 1, Worker);
+
+	if (wk->inside)
+		luaL_error(L, "a Worker cannot wait for itself");
+	return lua_pushtask(L, WaitTaskContinue, worker_ref(wk->state), gc_waiting);
+}
+
+//-------------------------------------[ Worker.close() ]
+LUA_METHOD(Worker, close) {
+	Worker *wk = lua_self(L, 1, Worker);
+	channel_close(sending(wk));
+	return 0;
+}
+
+//-------------------------------------[ Worker.terminated property ]
+LUA_PROPERTY_GET(Worker, terminated) {
+	Worker *wk = lua_self(L, 1, Worker);
+	lua_pushboolean(L, !wk->inside && WaitForSingleObject(wk->state->thread, 0) == WAIT_OBJECT_0);
+	return 1;
+}
+
+//-------------------------------------[ Worker.error property ]
+LUA_PROPERTY_GET(Worker, error) {
+	Worker *wk = lua_self(L, 1, Worker);
+	if (!wk->inside && wk->state->error && WaitForSingleObject(wk->state->thread, 0) == WAIT_OBJECT_0)
+		lua_pushstring(L, wk->state->error);
+	else lua_pushnil(L);
+	return 1;
+}
+
+OBJECT_MEMBERS(Worker)
+	READONLY_PROPERTY(Worker, terminated)
+	READONLY_PROPERTY(Worker, error)
+	METHOD(Worker, send)
+	METHOD(Worker, receive)
+	METHOD(Worker, wait)
+	METHOD(Worker, close)
+END
+
+//-------------------------------------[ Worker destructor ]
+LUA_METHOD(Worker, __gc) {
+	Worker *wk = lua_self(L, 1, Worker);
+	if (!wk->inside) {
+		//--- the Worker won't receive messages anymore
+		channel_close(&wk->state->in);
+		worker_release(wk->state);
+	}
+	free(wk);
+	return 0;
+}
+
+OBJECT_METAFIELDS(Worker)
+	METHOD(Worker, __gc)
+END
@@ -8,18 +8,228 @@
 
 #define LUA_LIB
 
-#include <list>
+#include <unordered_set>
+#include <vector>
+#include <deque>
 
 #define LUART_TYPES
 #include "async.h"
+#include "pool.h"
 
 extern "C" {
 	LUA_API luart_type TTask;
 }
 
 
-static std::list<Task *> Tasks;
-static lua_CFunction lua_update = NULL;
+//--- Scheduler state, one for each thread running Lua (the main thread and each Worker thread)
+struct Scheduler {
+	std::unordered_set<Task *> Tasks;			//--- all alive Tasks
+	std::deque<Task *> Ready;					//--- yielded Tasks to be resumed on next tick
+	std::vector<Task *> Timers;					//--- sleeping Tasks, min-heap ordered by deadline
+	std::vector<Task *> Terminated;				//--- terminated Tasks to be released
+	std::vector<Task *> Signaled;				//--- parked Tasks whose waitable handle got signaled (filled from the thread pool)
+	std::vector<Job *> Completed;				//--- Jobs completed by the worker pool (filled from the pool threads)
+	size_t Parked = 0;							//--- number of Tasks parked on a waitable handle
+	size_t Pending = 0;							//--- number of Jobs queued on the worker pool
+	CRITICAL_SECTION Lock;						//--- protects Signaled and Completed
+	HANDLE Wakeup;								//--- signaled each time a parked Task becomes ready or a Job completes
+	int tosleep = 0;
+
+	Scheduler() {
+		InitializeCriticalSection(&Lock);
+		Wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+	~Scheduler() {
+		DeleteCriticalSection(&Lock);
+		CloseHandle(Wakeup);
+	}
+};
+
+static thread_local Scheduler *S = NULL;
+static thread_local lua_CFunction lua_update = NULL;	//--- set by the ui module, for the thread that loaded it
+
+//-------- Get the current thread scheduler
+static Scheduler *scheduler() {
+	if (!S)
+		S = new Scheduler();
+	return S;
+}
+
+static void complete_jobs();
+
+//-------- Free the current thread scheduler, once its Lua state has been closed
+void close_scheduler(void) {
+	if (S) {
+		//--- Jobs still running on the worker pool will report to this scheduler
+		while (S->Pending) {
+			WaitForSingleObject(S->Wakeup, INFINITE);
+			complete_jobs();
+		}
+		delete S;
+		S = NULL;
+	}
+}
+
+//-------- Returns TRUE while the current thread has started Tasks that are not terminated
+BOOL running_tasks(void) {
+	if (S)
+		for (auto it = S->Tasks.begin(); it != S->Tasks.end(); ++it)
+			if ((*it)->status != TCreated && (*it)->status != TTerminated)
+				return TRUE;
+	return FALSE;
+}
+
+//-------- Each Task coroutine links back to its Task through its LUA_EXTRASPACE
+#define task_of(L) (*(Task **)lua_getextraspace(L))
+
+//-------- Monotonic clock used for Task deadlines, in milliseconds
+static inline ULONGLONG task_clock() {
+	return GetTickCount64();
+}
+
+//-------- Timers heap management (Task->timer is the heap position + 1, or 0 if not sleeping)
+static void timer_swap(size_t a, size_t b) {
+	std::swap(S->Timers[a], S->Timers[b]);
+	S->Timers[a]->timer = a+1;
+	S->Timers[b]->timer = b+1;
+}
+
+static void timer_up(size_t i) {
+	while (i && S->Timers[(i-1)/2]->sleep > S->Timers[i]->sleep) {
+		timer_swap(i, (i-1)/2);
+		i = (i-1)/2;
+	}
+}
+
+static void timer_down(size_t i) {
+	size_t n = S->Timers.size();
+	for (;;) {
+		size_t l = 2*i+1, r = l+1, m = i;
+		if (l < n && S->Timers[l]->sleep < S->Timers[m]->sleep)
+			m = l;
+		if (r < n && S->Timers[r]->sleep < S->Timers[m]->sleep)
+			m = r;
+		if (m == i)
+			break;
+		timer_swap(i, m);
+		i = m;
+	}
+}
+
+static void timer_remove(Task *t) {
+	size_t i = t->timer-1, last = S->Timers.size()-1;
+	if (i != last)
+		timer_swap(i, last);
+	S->Timers.pop_back();
+	t->timer = 0;
+	if (i < S->Timers.size()) {
+		timer_down(i);
+		timer_up(i);
+	}
+}
+
+static void timer_push(Task *t) {
+	S->Timers.push_back(t);
+	t->timer = S->Timers.size();
+	timer_up(S->Timers.size()-1);
+}
+
+//-------- Schedule a yielded Task for the next tick
+static void push_ready(Task *t) {
+	if (!t->queued) {
+		t->queued = TRUE;
+		S->Ready.push_back(t);
+	}
+}
+
+//-------- Thread pool callback, called when the handle a Task is parked on is signaled (or timed out)
+static void CALLBACK task_signaled(PVOID ctx, BOOLEAN timedout) {
+	Scheduler *s = ((Task *)ctx)->scheduler;
+
+	EnterCriticalSection(&s->Lock);
+	s->Signaled.push_back((Task *)ctx);
+	LeaveCriticalSection(&s->Lock);
+	SetEvent(s->Wakeup);
+}
+
+//-------- Move the parked Tasks that got signaled to the Ready queue
+static void wakeup_tasks() {
+	std::vector<Task *> signaled;
+
+	if (!S->Parked)
+		return;
+	EnterCriticalSection(&S->Lock);
+	signaled.swap(S->Signaled);
+	LeaveCriticalSection(&S->Lock);
+	for (auto it = signaled.begin(); it != signaled.end(); ++it) {
+		Task *t = *it;
+		if (t->wait) {
+			UnregisterWaitEx(t->wait, NULL);
+			t->wait = NULL;
+			S->Parked--;
+			if (t->status == TWaiting) {
+				t->status = TRunning;
+				push_ready(t);
+			}
+		}
+	}
+}
+
+//-------- Queue a blocking Job on the worker pool, its completion being reported to the current scheduler
+void queue_job(Job *job) {
+	job->scheduler = scheduler();
+	S->Pending++;
+	pool_queue_blocking(job);
+}
+
+//-------- Called from the worker pool threads once a Job has completed
+void complete_job(Job *job) {
+	Scheduler *s = job->scheduler;
+
+	EnterCriticalSection(&s->Lock);
+	s->Completed.push_back(job);
+	LeaveCriticalSection(&s->Lock);
+	SetEvent(s->Wakeup);
+}
+
+//-------- Wake up the Tasks whose Job has been completed by the worker pool
+static void complete_jobs() {
+	std::vector<Job *> completed;
+
+	if (!S->Pending)
+		return;
+	EnterCriticalSection(&S->Lock);
+	completed.swap(S->Completed);
+	LeaveCriticalSection(&S->Lock);
+	S->Pending -= completed.size();
+	for (auto it = completed.begin(); it != completed.end(); ++it) {
+		Job *job = *it;
+		Task *t = job->task;
+		if (!t) {
+			//--- the Task has been closed in the meantime
+			free(job);
+			continue;
+		}
+		job->done = TRUE;
+		if (t->timer)
+			timer_remove(t);
+		if (t->status == TWaiting || t->status == TSleep) {
+			t->status = TRunning;
+			push_ready(t);
+		}
+	}
+}
+
+//-------- Release a terminated Task, unless it has been rescheduled in the meantime
+static void release_task(lua_State *L, Task *t) {
+	if (S->Tasks.count(t) && t->status == TTerminated && !t->queued && !t->timer && !t->wait) {
+		task_of(t->L) = NULL;
+		luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, t->taskref);
+		t->ref = -1;
+		S->Tasks.erase(t);
+	}
+}
 
 void set_lua_update(lua_CFunction func) {
 	lua_update = func;
@@ -44,6 +254,8 @@ Task *create_task(lua_State *L) {
 	Task *tt, *t = (Task*)calloc(1, sizeof(Task));
 
 	t->L = lua_newthread(L);
+	task_of(t->L) = t;
+	t->scheduler = scheduler();
 	t->status = TCreated;
 	t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	if ((tt = search_task(L)))
@@ -53,7 +265,7 @@ Task *create_task(lua_State *L) {
 	lua_xmove(L, t->L, 1);	
 	lua_pushvalue(L, 1);
 	t->taskref = luaL_ref(L, LUA_REGISTRYINDEX);
-	Tasks.push_back(t);
+	S->Tasks.insert(t);
 	if (lua_getfield(L, LUA_REGISTRYINDEX, "_TASKHOOK")) {
 		int mask, count;
 		lua_getfield(L, -1, "mask");
@@ -81,15 +293,95 @@ Task *create_task(lua_State *L) {
 
 //-------- Search for the current running Task
 Task *search_task(lua_State *L) {
-	for (auto it = Tasks.begin(); it != Tasks.end(); ++it) 
-		if ((*it)->L == L)
-			return (*it);		
-	return NULL;
+	return task_of(L);
 } 
 
+//-------- Cancel the registered wait of a parked Task
+static void cancel_wait(Task *t) {
+	if (t->wait) {
+		UnregisterWaitEx(t->wait, INVALID_HANDLE_VALUE);
+		t->wait = NULL;
+		S->Parked--;
+		EnterCriticalSection(&S->Lock);
+		for (auto it = S->Signaled.begin(); it != S->Signaled.end(); ++it)
+			if (*it == t) {
+				S->Signaled.erase(it);
+				break;
+			}
+		LeaveCriticalSection(&S->Lock);
+	}
+}
+
+//-------- Unlink a Task from its Job, the Job being freed later by the scheduler if still running
+static void cancel_job(Task *t) {
+	if (t->job) {
+		Job *job = t->job;
+		t->job = NULL;
+		if (job->done)
+			free(job);
+		else {
+			job->task = NULL;
+			InterlockedExchange(&job->cancelled, TRUE);
+		}
+	}
+}
+
+//-------- Park a Task until the provided handle is signaled or the timeout expires
+void wait_task(Task *t, HANDLE h, DWORD timeout) {
+	cancel_wait(t);
+	if (t->timer)
+		timer_remove(t);
+	t->status = TWaiting;
+	if (RegisterWaitForSingleObject(&t->wait, h, task_signaled, t, timeout, WT_EXECUTEONLYONCE))
+		S->Parked++;
+	else {
+		//--- the handle cannot be waited on : fallback to polling on next tick
+		t->wait = NULL;
+		t->status = TSleep;
+	}
+}
+
+//-------- Park a Task until its Job completes, waking it up every period milliseconds if not INFINITE
+void wait_job(Task *t, Job *job) {
+	t->job = job;
+	job->task = t;
+	if (job->period != INFINITE)
+		sleep_task(t, job->period);
+	else
+		t->status = TWaiting;
+}
+
+//-------- Cancel the pending wait of a parked Task, if any
+void unwait_task(Task *t) {
+	cancel_wait(t);
+	cancel_job(t);
+}
+
+//-------- Close a Task
+void close_task(Task *t) {
+	if (t->status != TTerminated) {
+		t->status = TTerminated;
+		if (t->timer)
+			timer_remove(t);
+		unwait_task(t);
+		if (!t->queued)
+			S->Terminated.push_back(t);
+	}
+}
+
+//-------- Put a Task to sleep
+void sleep_task(Task *t, lua_Integer delay) {
+	if (t->timer)
+		timer_remove(t);
+	t->sleep = task_clock() + (delay > 0 ? delay : 0);
+	t->status = TSleep;
+	timer_push(t);
+}
+
 //-------- Disable debug hoook on Tasks
 void unhook_tasks(lua_State *L) {
-	for (auto it = Tasks.begin(); it != Tasks.end(); ++it) 
+	scheduler();
+	for (auto it = S->Tasks.begin(); it != S->Tasks.end(); ++it) 
 		lua_sethook((*it)->L, hookf, 0, 0);
 } 
 
@@ -119,7 +411,10 @@ int resume_task(lua_State *L, Task *t, int args) {
 		return -1;
 	else if (status == LUA_YIELD) {
 		lua_xmove(t->L, from, nresults);
-		t->status = TSleep;
+		if (!t->timer && !t->wait && !t->job) {
+			t->status = TSleep;
+			push_ready(t);
+		}
 	} else if (status == LUA_OK) {
 		if (lua_rawgeti(t->L, LUA_REGISTRYINDEX, t->taskref)) {
 			if (lua_getfield(t->L, -1, "after") == LUA_TFUNCTION) {
@@ -141,51 +436,70 @@ int resume_task(lua_State *L, Task *t, int args) {
 
 //-------- Task scheduler
 int update_tasks(lua_State *L) {
-	static int tosleep = 0;
+	ULONGLONG now;
+	size_t count;
  
+	scheduler();
 	if (lua_update)
 		if (lua_update(L) == -1)
 			return -1;
 
-	for (auto it = Tasks.begin(); it != Tasks.end(); ++it) {
-		Task *t = *it;
-		if (t->status == TSleep) {	
-			if (t->sleep < GetTickCount64()) {	
-				t->sleep = 0;
-				t->status = TRunning;
+	for (auto it = S->Terminated.begin(); it != S->Terminated.end(); ++it)
+		release_task(L, *it);
+	S->Terminated.clear();
+
+	wakeup_tasks();
+	complete_jobs();
+
+	now = task_clock();
+	while (!S->Timers.empty() && S->Timers[0]->sleep <= now) {
+		Task *t = S->Timers[0];
+		timer_remove(t);
+		t->sleep = 0;
+		t->status = TRunning;
+		if (lua_status(t->L) == LUA_YIELD)
+			push_ready(t);
+	}
+
+	//--- only resume Tasks ready at the start of this tick, the ones yielding again will run on the next one
+	count = S->Ready.size();
+	while (count--) {
+		Task *t = S->Ready.front();
+		S->Ready.pop_front();
+		t->queued = FALSE;
+		if (t->status == TTerminated) {
+			release_task(L, t);
+			continue;
+		}
+		if (t->status == TSleep && !t->timer)
+			t->status = TRunning;
+		if (t->status == TRunning && lua_status(t->L) == LUA_YIELD) {
+			int nresults = resume_task(L, t, -1);
+			if (nresults == -1) {
+				lua_xmove(t->L, L, 1);
+				return -1;
 			}
+			if (t->status == TTerminated) 
+				return nresults;			
 		}
 	}
 
-	auto it = Tasks.begin();
-	while (it != Tasks.end()) {
-		Task *tt = *it;
-		if (tt->status == TTerminated) {
-			luaL_unref(L, LUA_REGISTRYINDEX, tt->ref);
-			luaL_unref(L, LUA_REGISTRYINDEX, tt->taskref);
-			tt->ref = -1;
-			it = Tasks.erase(it);
-		} else ++it;
-	}
-			
-	for (auto it = Tasks.begin(); it != Tasks.end(); ++it) {
-		Task *t = *it;
-		if (t->status == TRunning) {
-			int status = lua_status(t->L);
-			if (status == LUA_YIELD) {
-				int nresults = resume_task(L, t, -1);
-				if (nresults == -1) {
-					lua_xmove(t->L, L, 1);
-					return -1;
-				}
-				if (t->status == TTerminated) 
-					return nresults;			
-			}		
+	if (S->Ready.empty() && (S->Parked || S->Pending || !S->Timers.empty())) {
+		//--- only sleeping or parked Tasks : block until the next deadline, a signaled handle, a completed Job (or any window message)
+		ULONGLONG delay = INFINITE;
+		now = task_clock();
+		if (!S->Timers.empty())
+			delay = S->Timers[0]->sleep > now ? S->Timers[0]->sleep - now : 0;
+		if (delay) {
+			if (delay >= INFINITE)
+				delay = S->Timers.empty() ? INFINITE : INFINITE-1;
+			BOOL signals = S->Parked || S->Pending;
+			MsgWaitForMultipleObjectsEx(signals ? 1 : 0, signals ? &S->Wakeup : NULL, (DWORD)delay, lua_update ? QS_ALLINPUT : 0, MWMO_INPUTAVAILABLE);
 		}
-	}
-	if (++tosleep > 100) {
+		S->tosleep = 0;
+	} else if (++S->tosleep > 100) {
 		Sleep(1);
-		tosleep = 0;
+		S->tosleep = 0;
 	}
 	return TRUE;
 }
@@ -208,6 +522,6 @@ int waitall_tasks(lua_State *L) {
     do
 		if (!update_tasks(L))
 			lua_error(L);
-	while (Tasks.size() > 1);		
+	while (S->Tasks.size() > 1);		
     return 0;
 }
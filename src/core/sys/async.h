@@ -30,7 +30,31 @@ extern "C" {
     void unhook_tasks(lua_State *L);
 
     //-------- Close a Task
-    #define close_task(t) (t)->status = TTerminated
+    void close_task(Task *t);
+
+    //-------- Put a Task to sleep for the provided delay in milliseconds
+    void sleep_task(Task *t, lua_Integer delay);
+
+    //-------- Park a Task until the provided handle is signaled or the timeout (in milliseconds) expires
+    void wait_task(Task *t, HANDLE h, DWORD timeout);
+
+    //-------- Park a Task until its Job completes (see pool.h)
+    void wait_job(Task *t, struct Job *job);
+
+    //-------- Queue a Job on the worker pool, its completion being reported to the current scheduler
+    void queue_job(struct Job *job);
+
+    //-------- Report a completed Job to its scheduler (called from the worker pool threads)
+    void complete_job(struct Job *job);
+
+    //-------- Free the current thread scheduler, once its Lua state has been closed
+    void close_scheduler(void);
+
+    //-------- Returns TRUE while the current thread has started Tasks that are not terminated
+    BOOL running_tasks(void);
+
+    //-------- Cancel the pending wait of a parked Task
+    void unwait_task(Task *t);
 
     //-------- Resume a Task
     int resume_task(lua_State *L, Task *t, int args);
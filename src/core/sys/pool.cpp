@@ -0,0 +1,198 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | pool.cpp | LuaRT worker pools for blocking operations
+*/
+
+#define LUA_LIB
+
+#include <deque>
+
+#include "async.h"
+#include "pool.h"
+
+#define BLOCKING_WORKERS	4		//--- maximum number of blocking workers per processor
+
+struct Pool;
+
+//--- Each worker owns a queue of Jobs, and steals from the other queues when its own is empty
+typedef struct {
+	HANDLE				thread;
+	CRITICAL_SECTION	lock;
+	std::deque<Job *>	jobs;
+	struct Pool			*pool;
+} Worker;
+
+//--- CPU-bound Jobs run on one worker per processor
+//--- Blocking Jobs run on another pool, that starts workers on demand up to a higher limit
+typedef struct Pool {
+	Worker				*workers;
+	volatile LONG		size;			//--- number of started workers
+	LONG				max;			//--- maximum number of workers
+	volatile LONG		next;			//--- round robin queue for the next Job
+	volatile LONG		queued;			//--- Jobs not taken by a worker yet
+	volatile LONG		idle;			//--- workers waiting for a Job
+	volatile LONG		closing;		//--- set by pool_close(), workers stop once all queues are empty
+	HANDLE				available;		//--- semaphore counting queued Jobs
+	INIT_ONCE			started;
+} Pool;
+
+static Pool Compute;
+static Pool Blocking;
+static size_t Size = 0;
+static volatile LONG States = 0;		//--- number of Lua states using the pools
+
+//-------- Take a Job from the worker queue, or steal one from another worker
+static Job *pool_take(Pool *p, size_t self) {
+	Job *job = NULL;
+
+	for (size_t i = 0; !job; i++) {
+		size_t size = (size_t)p->size;
+		//--- when closing, a whole pass without any Job means that the worker can stop
+		if (i && i % size == 0 && p->closing)
+			return NULL;
+		Worker *w = &p->workers[(self + i) % size];
+		EnterCriticalSection(&w->lock);
+		if (!w->jobs.empty()) {
+			if (i % size == 0) {
+				job = w->jobs.front();
+				w->jobs.pop_front();
+			} else {
+				job = w->jobs.back();
+				w->jobs.pop_back();
+			}
+		}
+		LeaveCriticalSection(&w->lock);
+	}
+	InterlockedDecrement(&p->queued);
+	return job;
+}
+
+static DWORD __stdcall pool_worker(LPVOID data) {
+	Worker *w = (Worker *)data;
+	Pool *p = w->pool;
+	size_t self = w - p->workers;
+	Job *job;
+
+	for (;;) {
+		//--- each semaphore count matches one queued Job, or one worker to stop when closing
+		InterlockedIncrement(&p->idle);
+		WaitForSingleObject(p->available, INFINITE);
+		InterlockedDecrement(&p->idle);
+		if (!(job = pool_take(p, self)))
+			break;
+		if (!job->scheduler)
+			job->func(job->userdata);
+		else {
+			job->result = job->func(job->userdata);
+			complete_job(job);
+		}
+	}
+	return 0;
+}
+
+size_t pool_size(void) {
+	if (!Size) {
+		DWORD count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+		Size = count > 2 ? count : 2;
+	}
+	return Size;
+}
+
+//-------- Start a new worker, unless the pool has reached its maximum size
+static void pool_grow(Pool *p) {
+	LONG size;
+
+	do {
+		if ((size = p->size) >= p->max)
+			return;
+	} while (InterlockedCompareExchange(&p->size, size + 1, size) != size);
+	p->workers[size].thread = CreateThread(NULL, 0, pool_worker, &p->workers[size], 0, NULL);
+}
+
+static BOOL CALLBACK pool_start(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+	Pool *p = (Pool *)param;
+	size_t size = pool_size();
+
+	p->max = (LONG)(p == &Blocking ? size*BLOCKING_WORKERS : size);
+	p->available = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+	p->workers = new Worker[p->max];
+	for (LONG i = 0; i < p->max; i++) {
+		InitializeCriticalSection(&p->workers[i].lock);
+		p->workers[i].pool = p;
+	}
+	if (p == &Compute)
+		while (p->size < p->max)
+			pool_grow(p);
+	return TRUE;
+}
+
+static void pool_push(Pool *p, Job *job) {
+	Worker *w = &p->workers[(ULONG)InterlockedIncrement(&p->next) % (ULONG)p->size];
+
+	EnterCriticalSection(&w->lock);
+	w->jobs.push_back(job);
+	LeaveCriticalSection(&w->lock);
+	InterlockedIncrement(&p->queued);
+	ReleaseSemaphore(p->available, 1, NULL);
+}
+
+//-------- Jobs may be queued from any thread running a Lua state
+void pool_queue(Job *job) {
+	InitOnceExecuteOnce(&Compute.started, pool_start, &Compute, NULL);
+	pool_push(&Compute, job);
+}
+
+void pool_queue_blocking(Job *job) {
+	InitOnceExecuteOnce(&Blocking.started, pool_start, &Blocking, NULL);
+	//--- a new worker is started when no idle worker is left for the Job
+	if (Blocking.queued >= Blocking.idle)
+		pool_grow(&Blocking);
+	pool_push(&Blocking, job);
+}
+
+//-------- Wait for the workers to run their queued Jobs and stop, the pool may be started again later
+static void pool_stop(Pool *p) {
+	if (p->workers) {
+		LONG i;
+
+		p->closing = TRUE;
+		ReleaseSemaphore(p->available, p->size, NULL);
+		for (i = 0; i < p->size; i++) {
+			WaitForSingleObject(p->workers[i].thread, INFINITE);
+			CloseHandle(p->workers[i].thread);
+		}
+		for (i = 0; i < p->max; i++)
+			DeleteCriticalSection(&p->workers[i].lock);
+		delete[] p->workers;
+		CloseHandle(p->available);
+		memset(p, 0, sizeof(Pool));
+	}
+}
+
+void pool_close(void) {
+	pool_stop(&Blocking);
+	pool_stop(&Compute);
+}
+
+static int pool_gc(lua_State *L) {
+	if (InterlockedDecrement(&States) == 0)
+		pool_close();
+	return 0;
+}
+
+//-------- Each Lua state holds a registry userdata, the pools are closed when the last one is collected
+void pool_open(lua_State *L) {
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, (void *)&States) == LUA_TNIL) {
+		lua_newuserdatauv(L, 0, 0);
+		lua_createtable(L, 0, 1);
+		lua_pushcfunction(L, pool_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_setmetatable(L, -2);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, (void *)&States);
+		InterlockedIncrement(&States);
+	}
+	lua_pop(L, 1);
+}
@@ -0,0 +1,46 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | pool.h | LuaRT worker pool header
+*/
+
+
+#pragma once
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    #include <Task.h>
+
+    typedef struct Job {
+        LPTHREAD_START_ROUTINE  func;       //--- function run on a worker thread
+        void                    *userdata;  //--- argument passed to func, that must hold its own reference as the Task may be collected first
+        lua_KFunction           k;          //--- Task continuation
+        DWORD                   period;     //--- progress period in milliseconds, or INFINITE
+        DWORD                   result;     //--- func return value
+        BOOL                    done;       //--- set by the scheduler once the Job completion has been drained
+        volatile LONG           cancelled;  //--- set when the waiting Task is cancelled, func may stop early
+        Task                    *task;      //--- Task waiting for the Job, or NULL if it has been closed
+        struct Scheduler        *scheduler; //--- scheduler to report the Job completion to
+    } Job;
+
+    //-------- Queue a CPU-bound Job on the worker pool (use queue_job() to get notified of its completion)
+    //-------- Jobs without scheduler are detached : their completion is not reported, and func must release them
+    void pool_queue(Job *job);
+
+    //-------- Queue a Job that blocks on I/O, on a separate pool that doesn't hold up the CPU-bound Jobs
+    void pool_queue_blocking(Job *job);
+
+    //-------- Number of worker threads for CPU-bound Jobs
+    size_t pool_size(void);
+
+    //-------- Register a Lua state using the pools, their workers are joined when the last state is closed
+    void pool_open(lua_State *L);
+
+#ifdef __cplusplus
+}
+#endif
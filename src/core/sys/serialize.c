@@ -0,0 +1,291 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | serialize.c | LuaRT values serialization
+*/
+
+#define LUA_LIB
+
+#include <Buffer.h>
+#include <luart.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "serialize.h"
+
+#define MAX_DEPTH	200
+#define MAX_ENCODING	4		//--- last Buffer encoding ("utf8", "unicode", "base64", "hex", "base64url")
+
+//--- STable is followed by the array and hash parts sizes, SRef by the index of an already serialized table
+enum { SNil, SFalse, STrue, SInteger, SFloat, SString, STable, SRef, SBuffer };
+
+//--- growable output block, kept in a userdata so that it gets freed on errors
+typedef struct {
+	char		*data;
+	size_t		len;
+	size_t		size;
+	int			refs;		//--- stack index of the table mapping already serialized tables to their index
+	lua_Integer	count;		//--- number of tables serialized so far
+} Output;
+
+static int Output_gc(lua_State *L) {
+	free(((Output *)lua_touserdata(L, 1))->data);
+	return 0;
+}
+
+static char *out_reserve(Output *o, size_t len) {
+	if (o->len + len > o->size) {
+		size_t size = o->size ? o->size : 256;
+		while (size < o->len + len)
+			size *= 2;
+		o->data = realloc(o->data, size);
+		o->size = size;
+	}
+	return o->data + o->len;
+}
+
+static void out_write(Output *o, const void *p, size_t len) {
+	memcpy(out_reserve(o, len), p, len);
+	o->len += len;
+}
+
+static void out_byte(Output *o, BYTE b) {
+	*out_reserve(o, 1) = b;
+	o->len++;
+}
+
+static void out_size(Output *o, size_t n) {
+	do {
+		BYTE b = n & 0x7F;
+		n >>= 7;
+		out_byte(o, n ? b | 0x80 : b);
+	} while (n);
+}
+
+static void serialize_value(lua_State *L, Output *o, int idx, int depth);
+
+static void serialize_table(lua_State *L, Output *o, int idx, int depth) {
+	lua_Integer narr = 0, i;
+	size_t nhash = 0;
+
+	//--- tables already serialized (shared or cyclic) are only referenced
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, o->refs) == LUA_TNUMBER) {
+		out_byte(o, SRef);
+		out_size(o, (size_t)lua_tointeger(L, -1));
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	if (depth >= MAX_DEPTH)
+		luaL_error(L, "cannot serialize tables nested deeper than %d levels", MAX_DEPTH);
+	luaL_checkstack(L, 3, "too many nested tables");
+	lua_pushvalue(L, idx);
+	lua_pushinteger(L, ++o->count);
+	lua_rawset(L, o->refs);
+	//--- count the array part and the remaining keys, to let deserialize() preallocate the table
+	while (lua_rawgeti(L, idx, narr+1) != LUA_TNIL) {
+		narr++;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		lua_pop(L, 1);
+		if (!lua_isinteger(L, -1) || (i = lua_tointeger(L, -1)) < 1 || i > narr)
+			nhash++;
+	}
+	out_byte(o, STable);
+	out_size(o, (size_t)narr);
+	out_size(o, nhash);
+	for (i = 1; i <= narr; i++) {
+		lua_rawgeti(L, idx, i);
+		serialize_value(L, o, -1, depth+1);
+		lua_pop(L, 1);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		if (!lua_isinteger(L, -2) || (i = lua_tointeger(L, -2)) < 1 || i > narr) {
+			serialize_value(L, o, -2, depth+1);
+			serialize_value(L, o, -1, depth+1);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+static void serialize_value(lua_State *L, Output *o, int idx, int depth) {
+	idx = lua_absindex(L, idx);
+	switch (lua_type(L, idx)) {
+		case LUA_TNIL:		out_byte(o, SNil); break;
+		case LUA_TBOOLEAN:	out_byte(o, lua_toboolean(L, idx) ? STrue : SFalse); break;
+		case LUA_TNUMBER:	if (lua_isinteger(L, idx)) {
+								lua_Integer i = lua_tointeger(L, idx);
+								out_byte(o, SInteger);
+								out_write(o, &i, sizeof(i));
+							} else {
+								lua_Number n = lua_tonumber(L, idx);
+								out_byte(o, SFloat);
+								out_write(o, &n, sizeof(n));
+							}
+							break;
+		case LUA_TSTRING:	{
+								size_t len;
+								const char *str = lua_tolstring(L, idx, &len);
+								out_byte(o, SString);
+								out_size(o, len);
+								out_write(o, str, len);
+							}
+							break;
+		case LUA_TTABLE:	{
+								Buffer *b;
+								//--- Buffer bytes are copied as is, without any conversion
+								if ((b = lua_iscinstance(L, idx, TBuffer))) {
+									out_byte(o, SBuffer);
+									out_size(o, b->size);
+									out_byte(o, (BYTE)b->encoding);
+									out_write(o, b->bytes, b->size);
+								} else if (luaL_getmetafield(L, idx, "__type")) {
+									luaL_getmetafield(L, idx, "__name");
+									luaL_error(L, "cannot serialize %s instances", lua_tostring(L, -1));
+								} else serialize_table(L, o, idx, depth);
+							}
+							break;
+		default:			luaL_error(L, "cannot serialize %s values", luaL_typename(L, idx));
+	}
+}
+
+char *serialize(lua_State *L, int first, int last, size_t *len) {
+	int i;
+	Output *o;
+	char *data;
+
+	first = lua_absindex(L, first);
+	last = lua_absindex(L, last);
+	o = lua_newuserdatauv(L, sizeof(Output), 0);
+	memset(o, 0, sizeof(Output));
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, Output_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	o->refs = lua_gettop(L);
+	for (i = first; i <= last; i++)
+		serialize_value(L, o, i, 0);
+	data = o->data;
+	*len = o->len;
+	o->data = NULL;
+	lua_pop(L, 2);
+	return data ? data : calloc(1, 1);
+}
+
+//--- input block reader
+typedef struct {
+	lua_State	*L;
+	const char	*p;
+	const char	*end;
+	int			refs;		//--- stack index of the table of deserialized tables, by index
+	lua_Integer	count;
+} Input;
+
+static const char *in_read(Input *in, size_t len) {
+	const char *p = in->p;
+	if ((size_t)(in->end - in->p) < len)
+		luaL_error(in->L, "malformed serialized data");
+	in->p += len;
+	return p;
+}
+
+static size_t in_size(Input *in) {
+	size_t n = 0;
+	int shift = 0;
+	BYTE b;
+
+	do {
+		b = *in_read(in, 1);
+		if (shift < 64)
+			n |= (size_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return n;
+}
+
+static void deserialize_value(Input *in, int depth) {
+	lua_State *L = in->L;
+	BYTE tag = *in_read(in, 1);
+
+	switch (tag) {
+		case SNil:		lua_pushnil(L); break;
+		case SFalse:	lua_pushboolean(L, FALSE); break;
+		case STrue:		lua_pushboolean(L, TRUE); break;
+		case SInteger:	{
+							lua_Integer i;
+							memcpy(&i, in_read(in, sizeof(i)), sizeof(i));
+							lua_pushinteger(L, i);
+						}
+						break;
+		case SFloat:	{
+							lua_Number n;
+							memcpy(&n, in_read(in, sizeof(n)), sizeof(n));
+							lua_pushnumber(L, n);
+						}
+						break;
+		case SString:	{
+							size_t len = in_size(in);
+							lua_pushlstring(L, in_read(in, len), len);
+						}
+						break;
+		case STable:	{
+							size_t narr = in_size(in), nhash = in_size(in), i, left = in->end - in->p;
+							if (depth >= MAX_DEPTH || narr > left || nhash > left/2 || narr > INT_MAX || nhash > INT_MAX)
+								luaL_error(L, "malformed serialized data");
+							luaL_checkstack(L, 3, "too many nested tables");
+							lua_createtable(L, (int)narr, (int)nhash);
+							lua_pushvalue(L, -1);
+							lua_rawseti(L, in->refs, ++in->count);
+							for (i = 1; i <= narr; i++) {
+								deserialize_value(in, depth+1);
+								lua_rawseti(L, -2, i);
+							}
+							while (nhash--) {
+								deserialize_value(in, depth+1);
+								if (lua_isnil(L, -1))
+									luaL_error(L, "malformed serialized data");
+								deserialize_value(in, depth+1);
+								lua_rawset(L, -3);
+							}
+						}
+						break;
+		case SRef:		if (lua_rawgeti(L, in->refs, (lua_Integer)in_size(in)) != LUA_TTABLE)
+							luaL_error(L, "malformed serialized data");
+						break;
+		case SBuffer:	{
+							size_t len = in_size(in);
+							int encoding = (BYTE)*in_read(in, 1);
+							if (encoding > MAX_ENCODING)
+								luaL_error(L, "malformed serialized data");
+							lua_pushBuffer(L, (void *)in_read(in, len), len);
+							lua_remove(L, -2);		//--- lua_pushBuffer() leaves its argument below the Buffer
+							lua_toBuffer(L, -1)->encoding = encoding;
+						}
+						break;
+		default:		luaL_error(L, "malformed serialized data");
+	}
+}
+
+int deserialize(lua_State *L, const char *data, size_t len) {
+	Input in = { L, data, data + len, 0, 0 };
+	int count = 0;
+
+	lua_newtable(L);
+	in.refs = lua_gettop(L);
+	while (in.p < in.end) {
+		luaL_checkstack(L, 1, "too many values to deserialize");
+		deserialize_value(&in, 0);
+		count++;
+	}
+	lua_remove(L, in.refs);
+	return count;
+}
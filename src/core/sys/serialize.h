@@ -0,0 +1,27 @@
+/*
+ | LuaRT - A Windows programming framework for Lua
+ | Luart.org, Copyright (c) Tine Samir 2025
+ | See Copyright Notice in LICENSE.TXT
+ |-------------------------------------------------
+ | serialize.h | LuaRT values serialization header
+*/
+
+
+#pragma once
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    #include <luart.h>
+
+    //-------- Serialize the values from index first to index last, returning a malloc'ed block
+    char *serialize(lua_State *L, int first, int last, size_t *len);
+
+    //-------- Push the values serialized in data, returning their count
+    int deserialize(lua_State *L, const char *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
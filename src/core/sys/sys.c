@@ -10,6 +10,8 @@
 
 #include <luart.h>
 #include "lrtapi.h"
+#include "serialize.h"
+#include "pool.h"
 
 #include <locale.h>
 #include <Buffer.h>
@@ -19,6 +21,8 @@
 #include <Pipe.h>
 #include <Date.h>
 #include <Com.h>
+#include <Worker.h>
+#include <Watcher.h>
 #include <wininet.h>
 #include <winreg.h>
 #include <shlobj.h>
@@ -131,6 +135,34 @@ LUA_METHOD(sys, fsentry) {
 	return 1;
 }
 
+//-------------------------------------[ sys.serialize() ]
+//--- The Buffer takes ownership of the serialized bytes
+LUA_METHOD(sys, serialize) {
+	size_t len;
+	char *data = serialize(L, 1, lua_gettop(L), &len);
+	Buffer *b;
+
+	lua_pushnil(L);
+	b = lua_pushinstance(L, Buffer, 1);
+	lua_remove(L, -2);
+	b->bytes = (BYTE *)data;
+	b->size = b->capacity = len;
+	return 1;
+}
+
+//-------------------------------------[ sys.deserialize() ]
+LUA_METHOD(sys, deserialize) {
+	Buffer *b = lua_iscinstance(L, 1, TBuffer);
+	size_t len;
+	const char *data;
+
+	if (b) {
+		data = (const char *)b->bytes;
+		len = b->size;
+	} else data = luaL_checklstring(L, 1, &len);
+	return deserialize(L, data, len);
+}
+
 //-------------------------------------[ sys.tempdir() ]
 LUA_METHOD(sys, tempdir) {
 	return pushtmp(L, TRUE);
@@ -569,6 +601,8 @@ MODULE_FUNCTIONS(sys)
 	METHOD(sys, cmd)
 	METHOD(sys, halt)
 	METHOD(sys, fsentry)
+	METHOD(sys, serialize)
+	METHOD(sys, deserialize)
 END
 
 MODULE_PROPERTIES(sys)
@@ -592,10 +626,14 @@ LUAMOD_API int luaopen_sys(lua_State *L) {
 	lua_regobjectmt(L, Task);
 	lua_regobjectmt(L, File);
 	lua_regobjectmt(L, Buffer);
+	lua_regobjectmt(L, Reader);
 	lua_regobjectmt(L, Pipe);
 	lua_regobjectmt(L, Directory);
 	lua_regobjectmt(L, Datetime);
 	lua_regobjectmt(L, COM);
+	lua_regobjectmt(L, Worker);
+	lua_regobjectmt(L, Watcher);
+	pool_open(L);
 	GetTempPathW(MAX_PATH, temp_path);
 	return 1;
 }
\ No newline at end of file
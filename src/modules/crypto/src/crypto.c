@@ -51,7 +51,7 @@ static const crypt_Reg hash_funcs[] = {
 static int hash(lua_State *L, ALG_ID algo)
 {
 	HCRYPTHASH hash;
-	Buffer *buff = lua_toBuffer(L, 2);
+	Buffer *buff = lua_viewBuffer(L, 2);
 	DWORD len = 0;
 	int result = 0;
 
@@ -23,47 +23,46 @@ static asyncTask *newFTPTask(Ftp *f) {
     return task;
 }
 
+static void release_asyncTask(asyncTask *t) {
+    if (InterlockedDecrement(&t->refs) == 0) {
+        free(t->str1);
+        free(t->str2);
+        delete t;
+    }
+}
+
 static int gc_asyncTask(lua_State *L) {
-    asyncTask *t = (asyncTask*)lua_self(L, 1, Task)->userdata;
-    CloseHandle(t->thread);
-    free(t->str1);
-    free(t->str2);
-    free(t);
+    release_asyncTask((asyncTask*)lua_self(L, 1, Task)->userdata);
     return 0;
 }
 
+//--- the Task may be collected while the transfer is still running, the last one releasing the asyncTask frees it
+static DWORD __stdcall FtpJob(LPVOID data) {
+    asyncTask *t = (asyncTask*)data;
+    DWORD result = t->thread(t);
+
+    release_asyncTask(t);
+    return result;
+}
+
 static int FtpTaskContinue(lua_State* L, int status, lua_KContext ctx) {
     asyncTask *t = (asyncTask*)ctx;
-
-    if ( WaitForSingleObject(t->thread, 0) == WAIT_OBJECT_0) {
-        TaskResult result;
-        GetExitCodeThread(t->thread, (LPDWORD)&result); 
-        switch(result) {  
-            case RString:   lua_pushstring(L, t->received.c_str()); break;
-            case RFile:     lua_pushwstring(L, t->str2);
-                            lua_pushinstance(L, File, 1);
-                            break;
-            case RError:    SetLastError(t->error);
-            default:        lua_pushboolean(L, result == RBoolean ? t->boolean : (int)result);     
-        };
-        CloseHandle(t->thread);
-        free(t->str1);
-        free(t->str2);
-        free(t);
-        return 1;
-    }
-    return lua_yieldk(L, 0, ctx, FtpTaskContinue);
+    TaskResult result = (TaskResult)status;
+
+    switch(result) {  
+        case RString:   lua_pushstring(L, t->received.c_str()); break;
+        case RFile:     lua_pushwstring(L, t->str2);
+                        lua_pushinstance(L, File, 1);
+                        break;
+        case RError:    SetLastError(t->error);
+        default:        lua_pushboolean(L, result == RBoolean ? t->boolean : (int)result);     
+    };
+    return 1;
 }
 
 static void push_waitTask(lua_State *L, asyncTask *t, LPTHREAD_START_ROUTINE thread) {
-    lua_pushtask(L, FtpTaskContinue, t, gc_asyncTask);
-    lua_pushvalue(L, -1);
-    if ((t->thread = CreateThread(NULL, 0, thread, t, 0, NULL)))
-        lua_call(L, 0, 0); 
-    else {
-        luaL_getlasterror(L, GetLastError());
-        luaL_error(L, "async error : %s", lua_tostring(L, -1));
-    }   
+    t->thread = thread;
+    lua_pushjob(L, FtpJob, FtpTaskContinue, t, gc_asyncTask, INFINITE);
 }
 
 static void log(Ftp *f) {
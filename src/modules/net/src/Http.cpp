@@ -129,6 +129,8 @@ static void ProcessRequest(Http *h, DWORD *error) {
     if (*error && (*error != ERROR_IO_PENDING))
         h->failed = true;
 done:
+    if (h->done || h->failed)
+        SetEvent(h->completed);
     unlockRequest(h);
     return;
 }
@@ -139,13 +141,17 @@ static void CALLBACK RequestCallback(HINTERNET hInternet, DWORD_PTR dwContext, D
     if ((h->type == THttp) && (dwInternetStatus == INTERNET_STATUS_REQUEST_COMPLETE)) {
         if (((LPINTERNET_ASYNC_RESULT)lpvStatusInformation)->dwResult)
             ProcessRequest(h, &((LPINTERNET_ASYNC_RESULT)lpvStatusInformation)->dwError);
-        else h->failed = true;
+        else {
+            h->failed = true;
+            SetEvent(h->completed);
+        }
     }
 }
 
 //----------------------------------[ Http() constructor ]
 LUA_CONSTRUCTOR(Http) {
     Http *h = new Http();
+    h->completed = CreateEvent(NULL, TRUE, FALSE, NULL);
     bool gzip = true;
     URL_COMPONENTSA urlcomps;
 	CHAR buf0[256], buf1[256], buf2[256], buf3[256], buf4[1024], buf5[1024];
@@ -352,6 +358,9 @@ static int RequestTaskContinue(lua_State* L, int status, lua_KContext ctx) {
             unlockRequest(h);
             return 2;
         }
+        unlockRequest(h);
+        //--- sleep until the request completes, signaled from the WinINet callback
+        return lua_waitevent(L, h->completed, INFINITE, (lua_KContext)h, RequestTaskContinue);
     }
     unlockRequest(h);
     return lua_yieldk(L, 0, (lua_KContext)h, RequestTaskContinue);
@@ -414,6 +423,7 @@ static int do_request(lua_State *L, Http *h, const char *verb) {
     h->method = verb;   
     h->sended = 0; 
     h->done = false;
+    ResetEvent(h->completed);
     h->received = "";
     h->url += h->host + uri;
     if (h->hRequest)
@@ -752,6 +762,7 @@ LUA_METHOD(Http, __gc) {
         InternetCloseHandle(h->hConnect);
     InternetSetStatusCallback(h->handle, NULL);
     DeleteCriticalSection(&h->CriticalSection);        
+    CloseHandle(h->completed);
     delete h;
 	return 0;
 }
@@ -39,6 +39,23 @@ static int gc_SocketBuffer(lua_State *L) {
 	return 0;
 }
 
+//--- Reset the Socket event before retrying an operation, signaling it again if other Tasks are waiting for other network events
+static void reset_socket(Socket *s, long events) {
+	WSANETWORKEVENTS ne;
+
+	if (s->event && !WSAEnumNetworkEvents(s->sock, s->event, &ne) && (ne.lNetworkEvents & ~events))
+		WSASetEvent(s->event);
+}
+
+//--- Park the current Task until some network activity occurs on the Socket (polls on next tick if not possible)
+static int wait_socket(lua_State *L, Socket *s, lua_KContext ctx, lua_KFunction k) {
+	if (!s->event && (s->event = WSACreateEvent()) == WSA_INVALID_EVENT)
+		s->event = NULL;
+	if (s->event && !WSAEventSelect(s->sock, s->event, FD_READ | FD_WRITE | FD_ACCEPT | FD_CLOSE))
+		return lua_waitevent(L, s->event, INFINITE, ctx, k);
+	return lua_yieldk(L, 0, ctx, k);
+}
+
 int dns(lua_State *L, const char *str, WORD type) {
 	PDNS_RECORD result;
 	DNS_STATUS s = DnsQuery_A(str, type, 0, NULL, &result, NULL);
@@ -264,6 +281,9 @@ LUA_METHOD(Socket, close) {
 	if (s->tls)
 		free_tls(s->tls);
 	s->sock = INVALID_SOCKET;
+	//--- wake up Tasks waiting on the Socket, they will fail on their next attempt
+	if (s->event)
+		WSASetEvent(s->event);
 	return 0;
 }
 
@@ -367,6 +387,7 @@ static int RecvTaskContinue(lua_State* L, int status, lua_KContext ctx) {
 	SocketBuffer *sb = (SocketBuffer *)ctx;
 	int done = 0;
 
+	reset_socket(sb->socket, FD_READ | FD_CLOSE);
 	if ( sb->socket->tls ) {
 		if ( (done = DecryptRecv(sb->socket, sb->buffer, sb->size)) == SOCKET_ERROR  )
 			goto error;
@@ -377,7 +398,7 @@ static int RecvTaskContinue(lua_State* L, int status, lua_KContext ctx) {
 error:		if ( WSAGetLastError() != WSAEWOULDBLOCK )
 				lua_pushboolean(L, FALSE);
 			else
-				return lua_yieldk(L, 0, (lua_KContext)sb, RecvTaskContinue);				
+				return wait_socket(L, sb->socket, (lua_KContext)sb, RecvTaskContinue);
 		} else 
 done:	if (done == 0)
 			lua_pushboolean(L, FALSE);
@@ -463,6 +484,7 @@ static int SendTaskContinue(lua_State* L, int status, lua_KContext ctx) {
 	SocketBuffer *sb = (SocketBuffer *)ctx;
 	int sent;
 	
+	reset_socket(sb->socket, FD_WRITE | FD_CLOSE);
 	if(sb->size) {
 		if ( (sent = sb->socket->tls ? EncryptSend(L, sb->socket, sb->buffer + sb->pos, sb->size) : send(sb->socket->sock, sb->buffer + sb->pos, sb->size, 0)) < 0 ) {
 			if ( (sent == -2)|| (WSAGetLastError() != WSAEWOULDBLOCK) ) {
@@ -471,12 +493,12 @@ static int SendTaskContinue(lua_State* L, int status, lua_KContext ctx) {
 				lua_pushboolean(L, FALSE);
 				return 1;
 			}
-yield:		return lua_yieldk(L, 0, (lua_KContext)sb, SendTaskContinue);
+			return wait_socket(L, sb->socket, (lua_KContext)sb, SendTaskContinue);
 		} 
 		if (sent < sb->size) {
 			sb->pos += sent;
 			sb->size -= sent;
-			goto yield;
+			return lua_yieldk(L, 0, (lua_KContext)sb, SendTaskContinue);
 		} 
 	}
 	lua_pushboolean(L, TRUE);
@@ -673,6 +695,8 @@ static void accept_socket(lua_State *L, SOCKET accepted, SOCKADDR_STORAGE *paddr
 		s->sizeaddr = sizeof(SOCKADDR_IN6);
 	}
 	WSAAddressToStringA((LPSOCKADDR)&s->addr, s->sizeaddr, NULL, s->ip, &size);
+	//--- accepted sockets inherit the listening Socket event selection
+	WSAEventSelect(accepted, NULL, 0);
 	s->blocking = blocking;
 	lua_pushlightuserdata(L, s);
 	lua_pushinstance(L, Socket, 1);
@@ -685,11 +709,12 @@ static int AcceptTaskContinue(lua_State* L, int status, lua_KContext ctx) {
 	int len = sizeof(SOCKADDR_STORAGE);
 	SOCKET accepted;
 
+	reset_socket(s, FD_ACCEPT);
 	accepted = accept(s->sock, (LPSOCKADDR)paddr, &len);
 	
 	if ((int)accepted == SOCKET_ERROR ) {
 		if (WSAGetLastError() == WSAEWOULDBLOCK)
-			return lua_yieldk(L, 0, (lua_KContext)s, AcceptTaskContinue);
+			return wait_socket(L, s, (lua_KContext)s, AcceptTaskContinue);
 		else
 			lua_pushboolean(L, FALSE);
 	}
@@ -732,6 +757,8 @@ LUA_METHOD(Socket, shutdown) {
 LUA_PROPERTY_SET(Socket, blocking) {
 	Socket *s = lua_self(L, 1, Socket);
 	unsigned long mode = !lua_toboolean(L, 2);
+	if (s->event)
+		WSAEventSelect(s->sock, NULL, 0);
 	ioctlsocket(s->sock, FIONBIO, &mode);
 	s->blocking = !mode;
 	return 0;
@@ -798,6 +825,8 @@ LUA_METHOD(Socket,__gc)
 	if ((s = lua_self(L, 1, Socket))) {
 		if (s->sock != INVALID_SOCKET)
 			Socket_close(L);
+		if (s->event)
+			WSACloseEvent(s->event);
 		free(s);
 	}
 	return 0;